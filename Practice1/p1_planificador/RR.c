@@ -84,7 +84,7 @@ void init_mythreadlib() {
   /*
     Initialize our queue
   */
-  q = queue_new();
+  q = queue_new(offsetof(TCB, link));
 }
 
 
@@ -85,8 +85,8 @@ void init_mythreadlib() {
   /*
     Initialize our queues for low and high priorities
   */
-  q_low = queue_new();
-  q_high = queue_new();
+  q_low = queue_new(offsetof(TCB, link));
+  q_high = queue_new(offsetof(TCB, link));
 }
 
 
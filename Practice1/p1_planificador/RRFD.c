@@ -4,176 +4,512 @@
 #include <stdlib.h>
 #include <ucontext.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include "mythread.h"
 #include "interrupt.h"
 
 #include "queue.h"
+#include "context.h"
 
 TCB* scheduler();
 void activator();
 void timer_interrupt(int sig);
 void disk_interrupt(int sig);
 
-/* Array of state thread control blocks: the process allows a maximum of N threads */
-static TCB t_state[N];
+#define TID_INDEX_MASK ((1 << TID_INDEX_BITS) - 1)
+#define TID_GENERATIONS (1 << (31 - TID_INDEX_BITS))
+
+/* Table of thread control blocks, grown a chunk at a time so that the blocks
+   never move. The slot of a thread is the low bits of its tid */
+static TCB * t_state[(1 << TID_INDEX_BITS) / TCB_CHUNK];
+static int t_used = 0; /* Slots handed out so far */
+static TCB * t_free = NULL; /* Slots of the finished threads, to be used again */
+static pthread_mutex_t t_state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Kernel thread running user threads, with ready queues of its own */
+typedef struct worker{
+  int id;
+  pthread_t kthread;
+  pthread_mutex_t lock; /* Guards the ready queues, taken by the thieves too */
+  struct queue * q_low;
+  struct queue * q_high;
+  int ready; /* Threads in the ready queues */
+  TCB* running; /* Current running thread of the worker */
+  TCB* prev; /* Thread switched out, queued once its context is saved */
+  TCB idle; /* Thread control block for the idle thread of the worker */
+}WORKER;
+
+static WORKER workers[MAX_WORKERS];
+static int n_workers = 1;
+
+/* Worker of the calling kernel thread. A user thread may resume on another
+   worker after a switch, so it is read again on every access */
+static __thread WORKER * volatile self;
+
+// Creates the waiting queue, shared by the workers
+static struct queue * q_waiting;
+static pthread_mutex_t waiting_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Current running thread */
-static TCB* running;
-static int current = 0;
+/* Threads created and not finished yet */
+static int alive = 0;
 
-// Creates three empty queues, for the 2 different priorities and for the waiting queue
-static struct queue * q_low;
-static struct queue * q_high;
-static struct queue * q_waiting;
+/* Released stacks of one size, linked through their lowest word */
+typedef struct stack_pool{
+  size_t size;
+  void * free;
+  int count;
+}STACK_POOL;
+
+static STACK_POOL stack_pools[STACK_POOL_SIZES];
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t page_size;
+
+/* Signals of the timer and the disk, blocked while a worker starts */
+static sigset_t sched_signals;
+
+/* Set while the worker changes the scheduler state. The handlers find it set
+   and leave their interrupt in sched_pending, handled by sched_leave. Kept per
+   kernel thread, that is per worker, so that one instruction sets it */
+static __thread volatile sig_atomic_t sched_busy;
+static __thread int sched_pending;
+#define PENDING_TIMER 1
+#define PENDING_DISK 2
 
 /* Variable indicating if the library is initialized (init == 1) or not (init == 0) */
 static int init=0;
 
-/* Thread control block for the idle thread */
-static TCB idle;
+static TCB* pick_next(int steal);
+static void finish_switch();
+
+/* Disables the interrupts of the worker without a system call. Returns
+   whether they were disabled already */
+static int sched_enter(){
+  int old = sched_busy;
+
+  sched_busy = 1;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  return old;
+}
+
+/* Restores the state returned by sched_enter, handling the interrupts that
+   arrived in between once they are enabled */
+static void sched_leave(int old){
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  sched_busy = old;
+  while (!sched_busy && sched_pending) {
+    int pending = __atomic_exchange_n(&sched_pending, 0, __ATOMIC_RELAXED);
+    if (pending & PENDING_TIMER) timer_interrupt(SIGVTALRM);
+    if (pending & PENDING_DISK) disk_interrupt(SIGPROF);
+  }
+}
+
+/* Tells whether a handler must leave its interrupt for sched_leave */
+static int sched_defer(int pending){
+  if (!sched_busy) return 0;
+  __atomic_or_fetch(&sched_pending, pending, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Lets the kernel deliver sig while its handler runs: a handler may switch to
+   another thread and not return for a long time, sched_busy defers it instead */
+static void sched_nodefer(int sig){
+  struct sigaction action;
+
+  sigaction(sig, NULL, &action);
+  action.sa_flags |= SA_NODEFER;
+  sigaction(sig, &action, NULL);
+}
+
+/* Idle thread: takes the threads made ready here or on the other workers */
 static void idle_function(){
-  while(1);
+  int old;
+
+  finish_switch();
+  sched_leave(0);
+  while(1){
+    int i, any = 0;
+    for (i = 0; i < n_workers && !any; i++)
+      any = __atomic_load_n(&workers[i].ready, __ATOMIC_RELAXED) > 0;
+    if (!any) {
+      sched_yield();
+      continue;
+    }
+    old = sched_enter();
+    TCB* next = pick_next(1);
+    if (next != NULL) {
+      printf("*** THREAD READY : SET CONTEXT TO %d\n", next->tid);
+      activator(next);
+    }
+    sched_leave(old);
+  }
+}
+
+/* Takes a free slot of the table, growing it if needed. NULL if it is full */
+static TCB* tcb_alloc(){
+  TCB* t;
+
+  pthread_mutex_lock(&t_state_lock);
+  t = t_free;
+  if (t != NULL) {
+    t_free = t->next_free;
+  } else if (t_used <= TID_INDEX_MASK) {
+    int chunk = t_used / TCB_CHUNK;
+    if (t_state[chunk] == NULL) {
+      t_state[chunk] = calloc(TCB_CHUNK, sizeof(TCB));
+    }
+    if (t_state[chunk] != NULL) {
+      t = &t_state[chunk][t_used % TCB_CHUNK];
+      t->tid = t_used++;
+    }
+  }
+  if (t != NULL) t->state = INIT;
+  pthread_mutex_unlock(&t_state_lock);
+  return t;
+}
+
+/* Returns the slot of a finished thread to the table. Its next thread gets
+   the following generation, so the tid of this one is not found again */
+static void tcb_free(TCB* t){
+  int generation = ((t->tid >> TID_INDEX_BITS) + 1) % TID_GENERATIONS;
+
+  pthread_mutex_lock(&t_state_lock);
+  t->tid = (generation << TID_INDEX_BITS) | (t->tid & TID_INDEX_MASK);
+  t->state = FREE;
+  t->next_free = t_free;
+  t_free = t;
+  pthread_mutex_unlock(&t_state_lock);
+}
+
+/* Gets a stack of at least size bytes for a thread, above a page with no
+   access so that an overflow faults instead of corrupting memory */
+static int stack_alloc(TCB* t, size_t size){
+  STACK_POOL* pool = NULL;
+  char* base;
+  int i;
+
+  size = (size + page_size - 1) & ~(page_size - 1);
+  pthread_mutex_lock(&stack_lock);
+  for (i = 0; i < STACK_POOL_SIZES && pool == NULL; i++) {
+    if (stack_pools[i].size == size && stack_pools[i].free != NULL) pool = &stack_pools[i];
+  }
+  if (pool != NULL) {
+    t->stack = pool->free;
+    t->stack_size = size;
+    pool->free = *(void **) pool->free;
+    pool->count--;
+    pthread_mutex_unlock(&stack_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&stack_lock);
+
+  base = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (base == MAP_FAILED) return -1;
+  if (mprotect(base, page_size, PROT_NONE) == -1) {
+    munmap(base, size + page_size);
+    return -1;
+  }
+  t->stack = base + page_size;
+  t->stack_size = size;
+  return 0;
+}
+
+/* Keeps the stack of a finished thread for the next one of the same size,
+   or unmaps it if the pool of that size is full or there is no room for it.
+   The main thread runs on the stack of the process, which is left alone */
+static void stack_free(TCB* t){
+  STACK_POOL* pool = NULL;
+  int i;
+
+  if (t->stack == NULL) return;
+  pthread_mutex_lock(&stack_lock);
+  for (i = 0; i < STACK_POOL_SIZES && pool == NULL; i++) {
+    if (stack_pools[i].size == t->stack_size) pool = &stack_pools[i];
+  }
+  for (i = 0; i < STACK_POOL_SIZES && pool == NULL; i++) {
+    if (stack_pools[i].free == NULL) {
+      pool = &stack_pools[i];
+      pool->size = t->stack_size;
+    }
+  }
+  if (pool != NULL && pool->count < STACK_POOL_MAX) {
+    *(void **) t->stack = pool->free;
+    pool->free = t->stack;
+    pool->count++;
+    pthread_mutex_unlock(&stack_lock);
+  } else {
+    pthread_mutex_unlock(&stack_lock);
+    munmap((char *) t->stack - page_size, t->stack_size + page_size);
+  }
+  t->stack = NULL;
+}
+
+/* Prepares the stack of a thread so that the first switch to it calls start,
+   with the interrupts still disabled */
+static void make_context(TCB* t, void (*start)()){
+#ifdef FAST_CONTEXT
+  t->sp = context_make(t->stack, t->stack_size, start);
+#else
+  if(getcontext(&t->run_env) == -1){
+    perror("*** ERROR: getcontext in make_context");
+    exit(-1);
+  }
+  t->run_env.uc_stack.ss_sp = t->stack;
+  t->run_env.uc_stack.ss_size = t->stack_size;
+  t->run_env.uc_stack.ss_flags = 0;
+  makecontext(&t->run_env, start, 0);
+#endif
+}
+
+/* Kernel thread of the workers but the first one, which is the main thread */
+static void *worker_main(void *arg){
+  self = (WORKER *) arg;
+  self->running = &self->idle;
+  init_thread_interrupt();
+  pthread_sigmask(SIG_UNBLOCK, &sched_signals, NULL);
+  idle_function();
+  return NULL;
+}
+
+/* First function of every thread: queues the thread switched out and runs the body */
+static void thread_start(){
+  finish_switch();
+  sched_leave(0);
+  self->running->function(self->running->tid);
+  mythread_exit();
+}
+
+/* Sets the number of kernel threads running the user threads */
+int mythread_setworkers(int workers_number){
+  if (init || workers_number < 0 || workers_number > MAX_WORKERS) return -1;
+  if (workers_number == 0) {
+    workers_number = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers_number > MAX_WORKERS) workers_number = MAX_WORKERS;
+  }
+  n_workers = workers_number < 1 ? 1 : workers_number;
+  return 0;
 }
 
 /* Initialize the thread library */
 void init_mythreadlib() {
   int i;
-  /* Create context for the idle thread */
-  if(getcontext(&idle.run_env) == -1){
-    perror("*** ERROR: getcontext in init_thread_lib");
-    exit(-1);
+  sigset_t old;
+
+  sigemptyset(&sched_signals);
+  sigaddset(&sched_signals, SIGVTALRM);
+  sigaddset(&sched_signals, SIGPROF);
+  page_size = sysconf(_SC_PAGESIZE);
+
+  for (i = 0; i < n_workers; i++) {
+    WORKER* w = &workers[i];
+    w->id = i;
+    pthread_mutex_init(&w->lock, NULL);
+    /*
+      Initialize the queues for low and high priorities of the worker
+    */
+    w->q_low = queue_new(offsetof(TCB, link));
+    w->q_high = queue_new(offsetof(TCB, link));
+    w->idle.state = IDLE;
+    w->idle.priority = SYSTEM;
+    w->idle.function = idle_function;
+    w->idle.tid = -1;
+    w->idle.ticks = QUANTUM_TICKS;
   }
-  idle.state = IDLE;
-  idle.priority = SYSTEM;
-  idle.function = idle_function;
-  idle.run_env.uc_stack.ss_sp = (void *)(malloc(STACKSIZE));
-  idle.tid = -1;
-  if(idle.run_env.uc_stack.ss_sp == NULL){
+
+  /* Create context for the idle thread of the first worker, the others run it on their kernel thread */
+  WORKER* w = &workers[0];
+  if(stack_alloc(&w->idle, STACKSIZE) == -1){
     printf("*** ERROR: thread failed to get stack space\n");
     exit(-1);
   }
-  idle.run_env.uc_stack.ss_size = STACKSIZE;
-  idle.run_env.uc_stack.ss_flags = 0;
-  idle.ticks = QUANTUM_TICKS;
-  makecontext(&idle.run_env, idle_function, 1);
-
-  t_state[0].state = INIT;
-  t_state[0].priority = LOW_PRIORITY;
-  t_state[0].ticks = QUANTUM_TICKS;
-  if(getcontext(&t_state[0].run_env) == -1){
-    perror("*** ERROR: getcontext in init_thread_lib");
-    exit(5);
-  }
+  make_context(&w->idle, idle_function);
 
-  for(i=1; i<N; i++){
-    t_state[i].state = FREE;
+  /* The main thread takes the first slot, so its tid is 0 */
+  TCB* main_thread = tcb_alloc();
+  if (main_thread == NULL) {
+    printf("*** ERROR: thread failed to get a thread control block\n");
+    exit(-1);
   }
+  main_thread->priority = LOW_PRIORITY;
+  main_thread->ticks = QUANTUM_TICKS;
+  main_thread->stack = NULL;
+  alive = 1;
 
-  t_state[0].tid = 0;
-
-  running = &t_state[0];
+  self = w;
+  self->running = main_thread;
 
   /*
     First thread that runs after idle. Print the message
   */
-  printf("*** THREAD READY : SET CONTEXT TO %d\n", running->tid);
+  printf("*** THREAD READY : SET CONTEXT TO %d\n", self->running->tid);
+
+  /*
+    Initialize our waiting queue
+  */
+  q_waiting = queue_new(offsetof(TCB, link));
 
-  /* Initialize disk and clock interrupts */
+  /* Initialize disk and clock interrupts. With several workers each one is
+     preempted by a timer of its own */
   init_disk_interrupt();
-  init_interrupt();
+  sched_nodefer(SIGPROF);
+  if (n_workers == 1) {
+    init_interrupt();
+    sched_nodefer(SIGVTALRM);
+  } else {
+    /* Installs a handler that is not deferred, again on every worker */
+    init_thread_interrupt();
+  }
+
+  /* The workers take no interrupt until they know who they are */
+  pthread_sigmask(SIG_BLOCK, &sched_signals, &old);
+  for (i = 1; i < n_workers; i++) {
+    if (pthread_create(&workers[i].kthread, NULL, worker_main, &workers[i]) != 0) {
+      perror("*** ERROR: pthread_create in init_thread_lib");
+      exit(-1);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Queues a ready thread in the worker running this code */
+static void make_ready(TCB* t){
+  pthread_mutex_lock(&self->lock);
+  enqueue (t->priority == HIGH_PRIORITY ? self->q_high : self->q_low, t);
+  self->ready++;
+  pthread_mutex_unlock(&self->lock);
+}
+
+/* Takes the first thread of a worker, high priority first. NULL if none */
+static TCB* take(WORKER* w, int priority){
+  TCB* t = NULL;
+
+  if (__atomic_load_n(&w->ready, __ATOMIC_RELAXED) == 0) return NULL;
+  pthread_mutex_lock(&w->lock);
+  if (priority == HIGH_PRIORITY || !queue_empty(w->q_high)) {
+    t = dequeue(w->q_high);
+  }
+  if (t == NULL && priority == LOW_PRIORITY) {
+    t = dequeue(w->q_low);
+  }
+  if (t != NULL) w->ready--;
+  pthread_mutex_unlock(&w->lock);
+  return t;
+}
+
+/* Next thread of the worker, or one stolen from the others if steal is 1. NULL if none */
+static TCB* pick_next(int steal){
+  TCB* t = take(self, LOW_PRIORITY);
+  int p, i;
 
   /*
-    Initialize our queues for low and high priorities, and waiting
+    High priority threads of the other workers go before the low priority ones
   */
-  q_low = queue_new();
-  q_high = queue_new();
-  q_waiting = queue_new();
+  for (p = HIGH_PRIORITY; t == NULL && steal && p >= LOW_PRIORITY; p--) {
+    for (i = 1; t == NULL && i < n_workers; i++) {
+      t = take(&workers[(self->id + i) % n_workers], p);
+    }
+  }
+  return t;
+}
+
+/* Places the thread switched out, now that its context is saved */
+static void finish_switch(){
+  TCB* prev = self->prev;
+
+  self->prev = NULL;
+  if (prev == NULL) return;
+  if (prev->state == INIT) {
+    make_ready(prev);
+  } else if (prev->state == WAITING) {
+    pthread_mutex_lock(&waiting_lock);
+    enqueue (q_waiting , prev);
+    pthread_mutex_unlock(&waiting_lock);
+  } else if (prev->state == EXITING) {
+    stack_free(prev);
+    tcb_free(prev);
+  }
 }
 
 
 /* Create and intialize a new thread with body fun_addr and one integer argument */
 int mythread_create (void (*fun_addr)(),int priority)
 {
-  int i;
+  return mythread_create_stack(fun_addr, priority, STACKSIZE);
+}
+
+/* Same as mythread_create, with a stack of stack_size bytes or STACKSIZE if 0 */
+int mythread_create_stack (void (*fun_addr)(), int priority, size_t stack_size)
+{
+  TCB* t;
+  int tid;
+  int old;
 
   if (!init) { init_mythreadlib(); init=1;}
-  for (i=0; i<N; i++)
-    if (t_state[i].state == FREE) break;
-  if (i == N) return(-1);
-  if(getcontext(&t_state[i].run_env) == -1){
-    perror("*** ERROR: getcontext in my_thread_create");
-    exit(-1);
+  /*
+      We disable the interrupts to perform an atomic action
+  */
+  old = sched_enter();
+  t = tcb_alloc();
+  if (t == NULL) {
+    sched_leave(old);
+    return(-1);
   }
-  t_state[i].state = INIT;
-  t_state[i].priority = priority;
-  t_state[i].function = fun_addr;
-  t_state[i].ticks = QUANTUM_TICKS;
-  t_state[i].run_env.uc_stack.ss_sp = (void *)(malloc(STACKSIZE));
-  if(t_state[i].run_env.uc_stack.ss_sp == NULL){
+  t->priority = priority;
+  t->function = fun_addr;
+  t->ticks = QUANTUM_TICKS;
+  if(stack_alloc(t, stack_size == 0 ? STACKSIZE : stack_size) == -1){
     printf("*** ERROR: thread failed to get stack space\n");
     exit(-1);
   }
-  t_state[i].tid = i;
-  t_state[i].run_env.uc_stack.ss_size = STACKSIZE;
-  t_state[i].run_env.uc_stack.ss_flags = 0;
-  makecontext(&t_state[i].run_env, fun_addr, 1);
+  tid = t->tid;
+  make_context(t, thread_start);
+  __atomic_add_fetch(&alive, 1, __ATOMIC_SEQ_CST);
 
 
-  printf("*** THREAD %d READY\n", t_state[i].tid);
+  printf("*** THREAD %d READY\n", tid);
 
-  /*
-      We disable the interrupts to perform an atomic action
-  */
-  disable_interrupt ();
   /*
       If the current thread has low priority and the new one has high,
       we should preempt the former.
   */
   if (mythread_getpriority()==LOW_PRIORITY && priority==HIGH_PRIORITY) {
-      TCB* aux = running;
-      printf("*** THREAD %d PREEMTED : SETCONTEXT OF %d\n", running->tid, t_state[i].tid);
-      running = &t_state[i];
-      current = running->tid;
-      aux->ticks = QUANTUM_TICKS;
-      enqueue (q_low , aux);
-      if(swapcontext (&(aux->run_env), &(running->run_env)) == -1){
-        perror("*** ERROR: swapcontext in my_thread_create");
-        exit(-1);
-      }
+      printf("*** THREAD %d PREEMTED : SETCONTEXT OF %d\n", self->running->tid, tid);
+      self->running->ticks = QUANTUM_TICKS;
+      activator(t);
   /*
       Otherwise, we enqueue the new thread in its corresponding queue,
-      according to its priority.
+      according to its priority. Idle workers steal it from there.
   */
-  } else if (priority==LOW_PRIORITY){
-      TCB * t = & t_state [i];
-      enqueue (q_low , t);
-  } else if (priority==HIGH_PRIORITY){
-      TCB * t = & t_state [i];
-      enqueue (q_high , t);
+  } else {
+      make_ready(t);
   }
-  enable_interrupt ();
-  return i;
+  sched_leave(old);
+  return tid;
 } /****** End my_thread_create() ******/
 
 /* Read disk syscall */
 int read_disk()
 {
+    int old;
+
     /*
         If the data is not in cache, we should interrupt the thread
     */
     if (!data_in_page_cache()){
-        printf("*** THREAD %d READ FROM DISK\n", running->tid);
-        running->ticks = QUANTUM_TICKS;
-        running->state = WAITING;
+        old = sched_enter();
+        printf("*** THREAD %d READ FROM DISK\n", self->running->tid);
+        self->running->ticks = QUANTUM_TICKS;
+        self->running->state = WAITING;
         /*
-            We insert the thread in the waiting queue,
-            and swap context to the next thread.
+            The thread goes to the waiting queue once switched out,
+            and we swap context to the next thread.
         */
-        enqueue (q_waiting , running);
         TCB* next = scheduler();
-        printf("*** SWAPCONTEXT FROM %d TO %d\n", running->tid, next->tid);
+        printf("*** SWAPCONTEXT FROM %d TO %d\n", self->running->tid, next->tid);
         activator(next);
+        sched_leave(old);
     }
     return 1;
 }
@@ -181,57 +517,58 @@ int read_disk()
 /* Disk interrupt  */
 void disk_interrupt(int sig)
 {
-    disable_disk_interrupt ();
+    int old;
+    TCB * ready = NULL;
+
+    if (sched_defer(PENDING_DISK)) return;
+    old = sched_enter();
 
     /*
         We will only do something if we have processes waiting in the queue
     */
+    pthread_mutex_lock(&waiting_lock);
     if (!queue_empty(q_waiting)) {
+        ready = dequeue ( q_waiting ) ;
+    }
+    pthread_mutex_unlock(&waiting_lock);
+
+    if (ready != NULL) {
         /*
             We will change the state of the thread to ready, and
             insert it in its corresponding queue (according to priority)
         */
-        TCB * ready = dequeue ( q_waiting ) ;
         printf("*** THREAD READY %d\n", ready->tid);
         ready->state = INIT;
-        if (ready->priority==HIGH_PRIORITY){
-            /*
-                If the current thread has low priority and the new one has high,
-                we should preempt the former.
-            */
-            if (mythread_gettid() != -1 && mythread_getpriority() == LOW_PRIORITY){
-                TCB* aux = running;
-                printf("*** THREAD %d PREEMTED : SETCONTEXT OF %d\n", running->tid, ready->tid);
-                running = ready;
-                current = running->tid;
-                aux->ticks = QUANTUM_TICKS;
-                enqueue (q_low , aux);
-                if(swapcontext (&(aux->run_env), &(running->run_env)) == -1){
-                  perror("*** ERROR: swapcontext in disk_interrupt");
-                  exit(-1);
-                }
-            /*
-                Otherwise, just enqueue it in the high prior. ready threads queue
-            */
-            } else {
-                enqueue(q_high, ready);
-            }
+        /*
+            If the current thread has low priority and the new one has high,
+            we should preempt the former.
+        */
+        if (ready->priority==HIGH_PRIORITY && mythread_gettid() != -1 && mythread_getpriority() == LOW_PRIORITY){
+            printf("*** THREAD %d PREEMTED : SETCONTEXT OF %d\n", self->running->tid, ready->tid);
+            self->running->ticks = QUANTUM_TICKS;
+            self->running->state = INIT;
+            activator(ready);
+        /*
+            Otherwise, just enqueue it in the ready queue of its priority
+        */
         } else {
-            enqueue(q_low, ready);
+            make_ready(ready);
         }
         /*
             If the current thread is the idle one, we should swap
             context by calling scheduler. This function, obviously,
-            will return the thread that we have just stored, because
-            we only run the idle process when no other process is ready.
+            will return the thread that we have just stored, unless
+            another worker took it first.
         */
         if(mythread_gettid() == -1){
-            TCB* next = scheduler();
-            printf("*** THREAD READY : SET CONTEXT TO %d\n", next->tid);
-            activator(next);
+            TCB* next = pick_next(1);
+            if (next != NULL) {
+              printf("*** THREAD READY : SET CONTEXT TO %d\n", next->tid);
+              activator(next);
+            }
         }
     }
-    enable_disk_interrupt ();
+    sched_leave(old);
 }
 
 
@@ -239,9 +576,13 @@ void disk_interrupt(int sig)
 void mythread_exit() {
   int tid = mythread_gettid();
 
+  sched_enter();
   printf("*** THREAD %d FINISHED\n", tid);
-  t_state[tid].state = FREE;
-  free(t_state[tid].run_env.uc_stack.ss_sp);
+  /*
+    The stack is freed once the next thread runs on its own
+  */
+  self->running->state = EXITING;
+  __atomic_sub_fetch(&alive, 1, __ATOMIC_SEQ_CST);
 
   /*
     Find the next thread in the scheduler and activate it
@@ -252,66 +593,78 @@ void mythread_exit() {
 
 /* Sets the priority of the calling thread */
 void mythread_setpriority(int priority) {
-  int tid = mythread_gettid();
-  t_state[tid].priority = priority;
+  mythread_gettid();
+  self->running->priority = priority;
 }
 
 /* Returns the priority of the calling thread */
 int mythread_getpriority() {
-  int tid = mythread_gettid();
-  return t_state[tid].priority;
+  mythread_gettid();
+  return self->running->priority;
 }
 
 
 /* Get the current thread id.  */
 int mythread_gettid(){
   if (!init) { init_mythreadlib(); init=1;}
-  return current;
+  return self->running->tid;
+}
+
+
+/* Tells whether a thread has not finished yet. A tid of a finished thread is
+   not confused with the next thread of its slot, which has another generation */
+int mythread_alive(int tid){
+  int index = tid & TID_INDEX_MASK;
+  TCB* chunk;
+  int alive_thread = 0;
+  int old;
+
+  if (tid < 0) return 0;
+  old = sched_enter();
+  pthread_mutex_lock(&t_state_lock);
+  chunk = index < t_used ? t_state[index / TCB_CHUNK] : NULL;
+  if (chunk != NULL) {
+    TCB* t = &chunk[index % TCB_CHUNK];
+    alive_thread = t->tid == tid && t->state != FREE && t->state != EXITING;
+  }
+  pthread_mutex_unlock(&t_state_lock);
+  sched_leave(old);
+  return alive_thread;
 }
 
 
-/* FIFO para alta prioridad, RR para baja*/
+/* FIFO para alta prioridad, RR para baja. Called with the interrupts disabled */
 TCB* scheduler(){
+  int i;
 
-  disable_interrupt ();
   /*
-    We first check if there are elements in the high priority,
-    queue, as they are more important
+    We first check the high priority queue of the worker, as they are
+    more important, then the low priority one, and then the other workers.
     We do not need to check that it is in INIT, because being in
     the queue implies that the thread is ready to continue execution.
   */
-  if (!queue_empty(q_high)) {
-      TCB * candidate = dequeue ( q_high ) ;
-      current = candidate->tid;
-      enable_interrupt();
-      return candidate;
-  }
-
-    /*
-       Otherwise, we move to the low priority queue
-       We do not need to check that it is in INIT, because being in
-       the queue implies that the thread is ready to continue execution.
-    */
-  if (!queue_empty(q_low)) {
-      TCB * candidate = dequeue ( q_low ) ;
-      current = candidate->tid;
-      enable_interrupt();
+  TCB * candidate = pick_next(1);
+  if (candidate != NULL) {
       return candidate;
   }
 
   /*
-    Otherwise, if all the threads are waiting, run the idle thread
+    Otherwise, if some thread is waiting or running on another worker, run the idle thread
   */
-  if (!queue_empty(q_waiting)) {
-      current = idle.tid;
-      return &idle;
+  if (__atomic_load_n(&alive, __ATOMIC_SEQ_CST) > 0) {
+      return &self->idle;
   }
 
   printf("*** FINISH\n");
-  free(idle.run_env.uc_stack.ss_sp);
-  free(q_low);
-  free(q_high);
+  stack_free(&workers[0].idle);
+  for (i = 0; i < n_workers; i++) {
+    free(workers[i].q_low);
+    free(workers[i].q_high);
+  }
   free(q_waiting);
+  for (i = 0; i * TCB_CHUNK < t_used; i++) {
+    free(t_state[i]);
+  }
   exit(1);
 }
 
@@ -319,59 +672,72 @@ TCB* scheduler(){
 /* Timer interrupt  */
 void timer_interrupt(int sig)
 {
+    int old;
+
+    if (sched_defer(PENDING_TIMER)) return;
     /*
         We disable the interrupts to perform an atomic action
     */
-    disable_interrupt ();
+    old = sched_enter();
     /*
         Round Robin is only used for low priority threads
     */
     if (mythread_gettid() != -1 && mythread_getpriority() == LOW_PRIORITY) {
-        running->ticks--;
+        self->running->ticks--;
         /*
             If the number of ticks is zero, we need to swap to the next thread (Round Robin)
         */
-        if (running->ticks<=0){
-            running->ticks = QUANTUM_TICKS;
-            running->state = INIT;
+        if (self->running->ticks<=0){
+            self->running->ticks = QUANTUM_TICKS;
             /*
-                We will enqueue the current thread and find the next one with the scheduler
+                The next thread of this worker goes first, the current one is
+                queued after it. If there is none, we do not need to swap
             */
-            enqueue (q_low , running);
-            TCB* next = scheduler();
-            /*
-                If the current and next thread are the same, we do not need to swap
-            */
-            if (next != running) {
+            TCB* next = pick_next(0);
+            if (next != NULL) {
                 /*
                     Swap the context to the next thread
                 */
-                printf("*** SWAPCONTEXT FROM %d TO %d\n", running->tid, next->tid);
+                self->running->state = INIT;
+                printf("*** SWAPCONTEXT FROM %d TO %d\n", self->running->tid, next->tid);
                 activator(next);
             }
         }
     }
-    enable_interrupt();
+    sched_leave(old);
 }
 
-/* Activator */
+/* Activator. Called with the interrupts disabled */
 void activator(TCB* next){
     /*
-        We update the 'running' and 'current' variables, and set the context to the next thread
+        We update the running thread of the worker, and set the context to the next thread
     */
-    TCB * aux = running;
-    running = next;
-    current = running->tid;
-    if (aux->state != FREE) {
-        if(swapcontext (&(aux->run_env), &(running->run_env)) == -1){
+    TCB * aux = self->running;
+    self->prev = aux->state == IDLE ? NULL : aux;
+    self->running = next;
+    if (aux->state != EXITING) {
+#ifdef FAST_CONTEXT
+        context_switch(&aux->sp, next->sp);
+#else
+        if(swapcontext (&(aux->run_env), &(next->run_env)) == -1){
           perror("*** ERROR: swapcontext in activator");
           exit(-1);
         }
+#endif
     } else {
-        printf("*** THREAD %d TERMINATED : SETCONTEXT OF %d\n", aux->tid, running->tid);
+        printf("*** THREAD %d TERMINATED : SETCONTEXT OF %d\n", aux->tid, next->tid);
+#ifdef FAST_CONTEXT
+        void *discard;
+        context_switch(&discard, next->sp);
+#else
         if(setcontext (&(next->run_env)) == -1){
           perror("*** ERROR: setcontext in activator");
           exit(-1);
         }
+#endif
     }
+    /*
+        Back on a worker, maybe another one: place the thread switched out there
+    */
+    finish_switch();
 }
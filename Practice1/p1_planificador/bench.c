@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "mythread.h"
+
+#define BENCH_THREADS 8 /* CPU-bound threads sharing the work */
+#define BENCH_LOOPS 400000000L /* Iterations of all the threads together */
+#define CHURN_THREADS 200000 /* Threads created and finished one after another */
+
+
+void worker_fun (int global_index)
+{
+  volatile long b;
+
+  for (b=0; b<BENCH_LOOPS / BENCH_THREADS; ++b);
+  mythread_exit();
+}
+
+void churn_fun (int global_index)
+{
+  mythread_exit();
+}
+
+/* Runs the threads on workers_number kernel threads, in a child process
+   because the library ends the process with the last thread. With churn
+   set, short threads are created and finished instead */
+double run(int workers_number, int churn)
+{
+  struct timespec start, end;
+  int i, status;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    mythread_setworkers(workers_number);
+    if (churn) {
+      /*
+        Each new thread preempts main and finishes at once, so its
+        stack is released before the next one is created
+      */
+      for (i = 0; i < CHURN_THREADS; i++) {
+        if (mythread_create(churn_fun, HIGH_PRIORITY) == -1) {
+          exit(-1);
+        }
+      }
+      mythread_exit();
+    }
+    for (i = 0; i < BENCH_THREADS; i++) {
+      if (mythread_create(worker_fun, LOW_PRIORITY) == -1) {
+        exit(-1);
+      }
+    }
+    mythread_exit();
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 1) {
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  int cores = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN); /* Most workers tried */
+  int n;
+  double one = 0;
+
+  printf("%d threads, %ld iterations, up to %d workers\n", BENCH_THREADS, BENCH_LOOPS, cores);
+  for (n = 1; n <= cores && n <= MAX_WORKERS; n = (n * 2 > cores && n < cores) ? cores : n * 2) {
+    double t = run(n, 0);
+    if (t < 0) {
+      printf("run with %d workers failed\n", n);
+      return -1;
+    }
+    if (n == 1) one = t;
+    printf("%2d workers: %6.2f s, speedup %5.2f\n", n, t, one / t);
+  }
+
+  double t = run(1, 1);
+  if (t < 0) {
+    printf("churn run failed\n");
+    return -1;
+  }
+  printf("churn: %d threads created and finished in %.2f s, %.0f per second\n", CHURN_THREADS, t, CHURN_THREADS / t);
+
+  return 0;
+}
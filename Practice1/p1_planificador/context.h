@@ -0,0 +1,20 @@
+#ifndef _CONTEXT_H_
+#define _CONTEXT_H_
+
+#include <stddef.h>
+
+/* Switch between threads that saves only what a function call preserves and
+   leaves the signal mask alone. x86-64 only, the others use swapcontext.
+   Define MYTHREAD_UCONTEXT to use swapcontext everywhere */
+#if defined(__x86_64__) && !defined(MYTHREAD_UCONTEXT)
+#define FAST_CONTEXT
+
+/* Saves the callee-saved registers on the stack and the stack pointer in
+   *from_sp, then resumes the thread whose stack pointer is to_sp */
+void context_switch(void **from_sp, void *to_sp);
+
+/* Prepares a stack so that switching to the returned pointer calls entry */
+void *context_make(void *stack, size_t size, void (*entry)());
+#endif
+
+#endif
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <ucontext.h>
@@ -7,6 +9,10 @@
 #include <interrupt.h>
 #include <time.h>
 
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 static sigset_t maskval_interrupt,oldmask_interrupt;
 
 
@@ -59,6 +65,44 @@ void init_interrupt()
    reset_timer(TICK_TIME) ;
 }
 
+void my_thread_handler ()
+{
+   timer_interrupt() ;
+}
+
+
+/* Interrupts the calling thread alone every TICK_TIME of its own CPU time,
+   so that every kernel thread running user threads is preempted. The handler
+   may switch to another thread and not return for a long time, so the kernel
+   does not block SIGVTALRM while it runs: the library defers it instead */
+void init_thread_interrupt()
+{
+  struct sigaction sigdat;
+  struct sigevent event;
+  struct itimerspec quantum;
+  timer_t timer_id;
+
+  sigdat.sa_handler = my_thread_handler;
+  sigemptyset(&sigdat.sa_mask);
+  sigdat.sa_flags = SA_RESTART | SA_NODEFER;
+  if(sigaction(SIGVTALRM, &sigdat, (struct sigaction *)0) == -1){
+    perror("signal set error");
+    exit(2);
+  }
+
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGVTALRM;
+  event.sigev_notify_thread_id = syscall(SYS_gettid);
+  quantum.it_interval.tv_sec = TICK_TIME / 1000000;
+  quantum.it_interval.tv_nsec = (TICK_TIME % 1000000) * 1000;
+  quantum.it_value = quantum.it_interval;
+  if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_id) == -1
+     || timer_settime(timer_id, 0, &quantum, NULL) == -1){
+    perror("timer_create");
+    exit(3);
+  }
+}
+
 static sigset_t maskval_net_interrupt,oldmask_net_interrupt;
 
 void reset_disk_timer(long usec) {
@@ -19,6 +19,7 @@
 
 void timer_interrupt ();
 void init_interrupt();
+void init_thread_interrupt();
 void disable_interrupt();
 void enable_interrupt();
 
@@ -6,15 +6,22 @@
 #include <unistd.h>
 
 #include "interrupt.h"
+#include "queue.h"
 
 #define N 10
 #define FREE 0
 #define INIT 1
 #define WAITING 2
 #define IDLE 3
+#define EXITING 4 /* finished, its stack is freed once it is switched out */
 
-#define STACKSIZE 10000
+#define STACKSIZE 10000 /* default stack size of a thread, rounded up to whole pages */
+#define STACK_POOL_SIZES 8 /* stack sizes whose released stacks are kept for new threads */
+#define STACK_POOL_MAX 1024 /* most released stacks kept for each size */
 #define QUANTUM_TICKS 40
+#define MAX_WORKERS 64 /* most kernel threads running the user threads */
+#define TID_INDEX_BITS 20 /* low bits of a tid: slot of the thread, so at most 2^20 threads */
+#define TCB_CHUNK 256 /* thread control blocks allocated together when the table grows */
 
 #define LOW_PRIORITY 0
 #define HIGH_PRIORITY 1
@@ -22,18 +29,26 @@
 /* Structure containing thread state  */
 typedef struct tcb{
   int state; /* the state of the current block: FREE or INIT */
-  int tid; /* thread id*/
+  int tid; /* thread id: generation of the slot and slot in the table */
   int priority; /* thread priority*/
   int ticks;
   void (*function)(int);  /* the code of the thread */
-  ucontext_t run_env; /* Context of the running environment*/
+  struct tcb *next_free; /* next free slot of the table */
+  struct queue_link link; /* links of the ready or waiting queue holding the thread */
+  void *stack; /* stack of the thread, NULL if it runs on a kernel thread stack */
+  size_t stack_size; /* usable bytes of the stack, a guard page lies below them */
+  void *sp; /* stack pointer saved by the fast context switch */
+  ucontext_t run_env; /* Context of the running environment, used by the swapcontext switch */
 }TCB;
 
+int mythread_setworkers(int workers_number); /* Sets the kernel threads running the threads, 0 for one per core, before any other call */
 int mythread_create (void (*fun_addr)(), int priority); /* Creates a new thread with one argument */
+int mythread_create_stack (void (*fun_addr)(), int priority, size_t stack_size); /* Same with a stack of stack_size bytes, 0 for STACKSIZE */
 void mythread_setpriority(int priority); /* Sets the thread priority */
 int mythread_getpriority(); /* Returns the priority of calling thread*/
 void mythread_exit(); /* Frees the thread structure and exits the thread */
 int mythread_gettid(); /* Returns the thread id */
+int mythread_alive(int tid); /* Returns 1 if the thread has not finished yet, 0 otherwise */
 int read_disk(); /* */
 
 static inline int data_in_page_cache() { return rand() & 0x01; }
@@ -4,166 +4,113 @@
 
 #include "queue.h"
 
+/* The links live in the elements, so no operation allocates memory and
+   they may be used from the signal handlers */
+#define LINK(s, data) ((struct queue_link *) ((char *) (data) + (s)->offset))
+#define DATA(s, link) ((void *) ((char *) (link) - (s)->offset))
+
 struct queue* enqueue(struct queue* s, void * i)
 {
-  struct my_struct* p = malloc(sizeof(struct my_struct) );
+  struct queue_link* p;
 
-  if( NULL == p )
-    {
-      fprintf(stderr, "IN %s, %s: malloc() failed\n", __FILE__, "list_add");
-      return s; 
-    }
-  p->data = i;
-  p->next = NULL;
   if( NULL == s )
     {
       printf("Queue not initialized\n");
-      free(p);
-      return s;
-    }
-  else if( NULL == s->head && NULL == s->tail )
-    {
-      /* printf("Empty list, adding p->data: %d\n\n", p->data);  */
-      s->head = s->tail = p;
       return s;
     }
-  else if( NULL == s->head || NULL == s->tail )
+  p = LINK(s, i);
+  if( NULL != p->queue )
     {
-      fprintf(stderr, "There is something seriously wrong with your assignment of head/tail to the list\n");
-      free(p);
+      fprintf(stderr, "IN %s, %s: element already queued\n", __FILE__, "enqueue");
       return NULL;
     }
-  else
-    {
-      /* printf("List not empty, adding element to tail\n"); */
-      s->tail->next = p;
-      s->tail = p;
-    }
+  p->queue = s;
+  p->next = &s->head;
+  p->prev = s->head.prev;
+  s->head.prev->next = p;
+  s->head.prev = p;
   return s;
 }
 
+/* Unlinks an element from the queue holding it */
+static void unlink_element(struct queue_link* p)
+{
+  p->prev->next = p->next;
+  p->next->prev = p->prev;
+  p->next = p->prev = NULL;
+  p->queue = NULL;
+}
+
 
 /* Remove the first element */
 void* dequeue( struct queue* s )
 {
-  struct my_struct* h = NULL;
-  struct my_struct* p = NULL;
-  void * ret;
+  struct queue_link* h;
 
-  if( NULL == s )
+  if( NULL == s || queue_empty(s) )
     {
-      //printf("List is empty\n");
       return NULL;
     }
-  else if( NULL == s->head && NULL == s->tail )
+  h = s->head.next;
+  unlink_element(h);
+  return DATA(s, h);
+}
+
+/* Remove an element from the queue if it is there, in constant time */
+void* queue_find_remove(struct queue* s, void * data )
+{
+  struct queue_link* p;
+
+  if( NULL == s )
     {
-      //printf("Well, List is empty\n");
       return NULL;
     }
-  else if( NULL == s->head || NULL == s->tail )
+  p = LINK(s, data);
+  if( p->queue != s )
     {
-      printf("There is something seriously wrong with your list\n");
-      printf("One of the head/tail is empty while other is not \n");
       return NULL;
     }
-  h = s->head;
-  p = h->next;
-  ret = h->data;
-  free(h);
-  s->head = p;
-  if( NULL == s->head )  s->tail = s->head;   /* The element tail was pointing to is free(), so we need an update */
-  return ret;
-}
-
-/* Search an element and remove it from queue if found 
-   This function can be specialized for comparing the contents of structures s->data and data instead of pointers to structures 
-*/
-void* queue_find_remove(struct queue* s, void * data )
-{
-  void * ret;
- 
- if( NULL == s )
-   {
-     //printf("List is empty\n");
-     return NULL;
-   }
- else 
-   if( NULL == s->head && NULL == s->tail )
-     {
-       //printf("Well, List is empty\n");
-       return NULL;
-     }
-   else if( NULL == s->head || NULL == s->tail )
-     {
-       printf("There is something seriously wrong with your list\n");
-       printf("One of the head/tail is empty while other is not \n");
-       return NULL;
-     }
- 
- if ( s->head->data == data) {
-   ret = data;
-   if (s->head == s->tail){
-     free(s->head);
-     s->head = s->tail = NULL;
-   }
-   else {
-     struct my_struct* aux = s->head;
-     s->head = s->head->next;
-     free(aux);
-   }
-   return ret; 
- }
- else {
-   struct my_struct* aux;
-   
-   for ( aux = s->head; aux->next && (aux->next->data != data); aux = aux->next);
-   if (aux->next == NULL)
-     return NULL;
-   else {
-     struct my_struct* aux2 =  aux->next;
-     ret = aux->next->data; 
-     if (aux->next->next == NULL )  // last element contains the searched data
-       s->tail = aux;
-     aux->next = aux->next->next;
-     free(aux2);
-     return ret;
-   }
- } 
+  unlink_element(p);
+  return data;
 }
 
-int queue_empty ( struct queue* s ) { return (s->head == NULL); }
+int queue_empty ( struct queue* s ) { return (s->head.next == &s->head); }
 
-struct queue* queue_new(void)
+struct queue* queue_new(size_t offset)
 {
   struct queue* p = malloc(sizeof(struct queue));
   if( NULL == p )
+    {
       fprintf(stderr, "LINE: %d, malloc() failed\n", __LINE__);
-  p->head = p->tail = NULL;
+      return NULL;
+    }
+  p->head.next = p->head.prev = &p->head;
+  p->head.queue = p;
+  p->offset = offset;
   return p;
 }
 
 
 void queue_print(struct queue* ps )
 {
-  struct my_struct* p = NULL;
+  struct queue_link* p = NULL;
   printf("Queue contents:\n");
   if( ps )
     {
       if (queue_empty(ps))
 	printf("\t\tEmpty QUEUE\n");
       else
-	for( p = ps->head; p; p = p->next )
-	  queue_print_element(p);
+	for( p = ps->head.next; p != &ps->head; p = p->next )
+	  queue_print_element(DATA(ps, p));
     }
 }
 
 
-/* This function needs to be specialized depending on the content of p->data */
-void queue_print_element(struct my_struct* p )
+/* This function needs to be specialized depending on the content of data */
+void queue_print_element(void * data )
 {
-  if( p ) 
-    printf("\t\tp->data pointer=%ld \n", (long) (p->data));
+  if( data )
+    printf("\t\tp->data pointer=%ld \n", (long) (data));
   else
       printf("Can not print NULL struct \n");
 }
-
@@ -3,19 +3,22 @@
 
 #include  <stdio.h>
 #include  <stdlib.h>
+#include  <stddef.h>
 #include  <string.h>
 
-struct my_struct
+/* Links of an element, embedded in it: an element is in one queue at most */
+struct queue_link
 {
-  void *data;
-  struct my_struct* next;
+  struct queue_link* next;
+  struct queue_link* prev;
+  struct queue* queue; /* Queue holding the element, NULL if none */
 };
 
 
 struct queue
 {
-  struct my_struct* head;
-  struct my_struct* tail;
+  struct queue_link head; /* Sentinel: head.next is the first element and head.prev the last */
+  size_t offset; /* Offset of the links inside the elements */
 };
 
 /* Enqueue an element */
@@ -26,12 +29,10 @@ void* dequeue( struct queue*);
 int queue_empty ( struct queue* s );
 /* If it finds the data in the queue it removes it and returns it. Otherwise it returns NULL */
 void* queue_find_remove(struct queue* s, void * data );
-/* Create an empty queue */
-struct queue* queue_new(void);
+/* Create an empty queue of elements with their links at offset, from offsetof */
+struct queue* queue_new(size_t offset);
 
 void queue_print(struct queue* );
-void queue_print_element(struct my_struct* );
+void queue_print_element(void * data);
 
 #endif
-
-
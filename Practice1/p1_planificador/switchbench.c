@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <time.h>
+
+#include "mythread.h"
+#include "context.h"
+
+#define SWITCHES 10000000L /* Switches of each kind, half of them back to main */
+
+static ucontext_t main_env, peer_env;
+#ifdef FAST_CONTEXT
+static void *main_sp, *peer_sp;
+#endif
+
+/* Peer of the swapcontext switches: returns to main every time */
+static void peer_ucontext(){
+  while(1){
+    swapcontext(&peer_env, &main_env);
+  }
+}
+
+#ifdef FAST_CONTEXT
+/* Peer of the fast switches: returns to main every time */
+static void peer_fast(){
+  while(1){
+    context_switch(&peer_sp, main_sp);
+  }
+}
+#endif
+
+static double now(){
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  long switches = argc > 1 ? atol(argv[1]) : SWITCHES;
+  long i;
+  double start;
+  sigset_t signals, old;
+  void *stack = malloc(STACKSIZE);
+
+  if (stack == NULL || switches < 2) {
+    printf("usage: %s [switches]\n", argv[0]);
+    return -1;
+  }
+
+  getcontext(&peer_env);
+  peer_env.uc_stack.ss_sp = stack;
+  peer_env.uc_stack.ss_size = STACKSIZE;
+  peer_env.uc_stack.ss_flags = 0;
+  makecontext(&peer_env, peer_ucontext, 0);
+  start = now();
+  for (i = 0; i < switches / 2; i++) {
+    swapcontext(&main_env, &peer_env);
+  }
+  printf("swapcontext:    %6.1f ns per switch\n", (now() - start) * 1e9 / (switches / 2 * 2));
+
+#ifdef FAST_CONTEXT
+  peer_sp = context_make(stack, STACKSIZE, peer_fast);
+  start = now();
+  for (i = 0; i < switches / 2; i++) {
+    context_switch(&main_sp, peer_sp);
+  }
+  printf("context_switch: %6.1f ns per switch\n", (now() - start) * 1e9 / (switches / 2 * 2));
+#else
+  printf("context_switch: not available on this architecture\n");
+#endif
+
+  /* What masking the interrupts cost each scheduling event before the library
+     used a flag of the worker instead */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGVTALRM);
+  sigaddset(&signals, SIGPROF);
+  start = now();
+  for (i = 0; i < switches / 2; i++) {
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+  printf("sigmask pair:   %6.1f ns per scheduling event, saved by the busy flag\n", (now() - start) * 1e9 / (switches / 2));
+
+  free(stack);
+  return 0;
+}
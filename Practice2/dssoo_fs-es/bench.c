@@ -0,0 +1,215 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	bench.c
+ * @brief 	Micro-benchmarks of the file system internals.
+ * @date	01/03/2017
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "include/filesystem.h"
+
+#define BENCH_DEV_SIZE (1024L * 1024 * 1024) // Device size, in bytes (sparse)
+#define BENCH_ALLOCS 200000                        // Allocations timed per fill level
+#define BENCH_THREADS 8                            // Most threads reading at the same time
+#define BENCH_FILE_SIZE (16 * 1024 * 1024)         // Size of the file read by each thread
+#define BENCH_CHUNK (64 * 1024)                    // Bytes of each read
+#define BENCH_PASSES 4                             // Times each thread reads its file
+
+/* Allocator of libfs (include/auxiliary.h needs the file system metadata) */
+int allocRun(int goal, int want, int *got);
+int bfree(int block_id);
+
+/*
+ * @brief	Current time in nanoseconds.
+ * @return	Nanoseconds from an arbitrary point.
+ */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * @brief	Formats a new device, fills <percent> of its data blocks at random places
+ *          and times the allocation of a block followed by its release.
+ * @return	0 if success, -1 otherwise.
+ */
+static int benchAlloc(int percent)
+{
+	int *blocks = malloc(sizeof(int) * (BENCH_DEV_SIZE / BLOCK_SIZE));
+	int numBlocks = 0, got, i, b;
+
+	if (blocks == NULL || mkFS(BENCH_DEV_SIZE) < 0 || mountFS() < 0) {
+		free(blocks);
+		return -1;
+	}
+
+	/* Take every block, then free a random subset of them */
+	while ((b = allocRun(0, 1, &got)) >= 0) {
+		blocks[numBlocks++] = b;
+	}
+	srand(percent);
+	for (i = numBlocks - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		int tmp = blocks[i];
+		blocks[i] = blocks[j];
+		blocks[j] = tmp;
+	}
+	int numFree = numBlocks - (long) numBlocks * percent / 100;
+	for (i = 0; i < numFree; i++) {
+		bfree(blocks[i]);
+	}
+
+	/* Every allocation searches from the block following the previous one */
+	double start = now();
+	for (i = 0; i < BENCH_ALLOCS; i++) {
+		if ((b = allocRun(0, 1, &got)) < 0 || bfree(b) < 0) {
+			break;
+		}
+	}
+	double elapsed = now() - start;
+
+	/* Once the device is full, allocations fail at once */
+	for (i = 0; i < numFree; i++) {
+		allocRun(0, 1, &got);
+	}
+	double startFull = now();
+	for (i = 0; i < BENCH_ALLOCS; i++) {
+		allocRun(0, 1, &got);
+	}
+	double elapsedFull = now() - startFull;
+
+	fprintf(stdout, "%3d%% full: %8.1f ns per allocation, %6.1f ns per failed allocation\n",
+		percent, elapsed / BENCH_ALLOCS, elapsedFull / BENCH_ALLOCS);
+
+	free(blocks);
+	return unmountFS();
+}
+
+/*
+ * @brief	Reads the file of a thread BENCH_PASSES times, BENCH_CHUNK bytes at a time,
+ *          through a descriptor of its own.
+ * @return	NULL if success, the argument otherwise.
+ */
+static void *benchReader(void *arg)
+{
+	char path[16];
+	char *buffer = malloc(BENCH_CHUNK);
+	int pass, fd;
+	long offset;
+
+	sprintf(path, "/bench%d", *(int *) arg);
+	if (buffer == NULL || (fd = openFileMode(path, FS_OPEN_READ)) < 0) {
+		free(buffer);
+		return arg;
+	}
+	for (pass = 0; pass < BENCH_PASSES; pass++) {
+		for (offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_CHUNK) {
+			if (readAt(fd, buffer, BENCH_CHUNK, offset) != BENCH_CHUNK) {
+				closeFile(fd);
+				free(buffer);
+				return arg;
+			}
+		}
+	}
+
+	free(buffer);
+	return closeFile(fd) < 0 ? arg : NULL;
+}
+
+/*
+ * @brief	Writes a file per thread, then times 1 to BENCH_THREADS threads reading
+ *          their files at the same time.
+ * @return	0 if success, -1 otherwise.
+ */
+static int benchThreads(void)
+{
+	pthread_t threads[BENCH_THREADS];
+	int ids[BENCH_THREADS];
+	char path[16];
+	char *buffer = malloc(BENCH_CHUNK);
+	long offset;
+	int i, n, fd, ret = 0;
+
+	if (buffer == NULL || mkFS(BENCH_DEV_SIZE) < 0 || mountFS() < 0) {
+		free(buffer);
+		return -1;
+	}
+	memset(buffer, 'x', BENCH_CHUNK);
+	for (i = 0; i < BENCH_THREADS && ret == 0; i++) {
+		sprintf(path, "/bench%d", i);
+		if (createFile(path) < 0 || (fd = openFile(path)) < 0) {
+			ret = -1;
+			break;
+		}
+		for (offset = 0; offset < BENCH_FILE_SIZE && ret == 0; offset += BENCH_CHUNK) {
+			ret = writeFile(fd, buffer, BENCH_CHUNK) == BENCH_CHUNK ? 0 : -1;
+		}
+		ret += closeFile(fd);
+	}
+	free(buffer);
+
+	/* The same bytes are read by every run, each thread from its own file */
+	for (n = 1; n <= BENCH_THREADS && ret == 0; n *= 2) {
+		double start = now();
+		for (i = 0; i < n; i++) {
+			ids[i] = i;
+			if (pthread_create(&threads[i], NULL, benchReader, &ids[i]) != 0) {
+				n = i;
+				ret = -1;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			void *result;
+			if (pthread_join(threads[i], &result) != 0 || result != NULL) {
+				ret = -1;
+			}
+		}
+		double elapsed = now() - start;
+
+		if (ret == 0) {
+			fprintf(stdout, "%d thread%s: %8.1f MB/s reading files of their own\n", n, n > 1 ? "s" : " ",
+				(double) n * BENCH_PASSES * BENCH_FILE_SIZE / (1024 * 1024) / (elapsed / 1e9));
+		}
+	}
+
+	return unmountFS() < 0 ? -1 : ret;
+}
+
+int main()
+{
+	char dir[] = "/tmp/fsbench.XXXXXX";
+	int percents[] = {10, 50, 95};
+	int i, ret = 0;
+
+	/* Run on a scratch device, the device of the tests is left untouched */
+	if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+		fprintf(stderr, "Error in bench: can't create a scratch directory\n");
+		return -1;
+	}
+	int fd = open(DEVICE_IMAGE, O_CREAT | O_RDWR | O_TRUNC, 0666);
+	if (fd < 0 || ftruncate(fd, BENCH_DEV_SIZE) < 0) {
+		fprintf(stderr, "Error in bench: can't create %s\n", DEVICE_IMAGE);
+		return -1;
+	}
+	close(fd);
+
+	for (i = 0; i < sizeof(percents) / sizeof(percents[0]) && ret == 0; i++) {
+		ret = benchAlloc(percents[i]);
+	}
+	if (ret == 0) {
+		ret = benchThreads();
+	}
+
+	unlink(DEVICE_IMAGE);
+	rmdir(dir);
+	return ret;
+}
@@ -5,75 +5,1933 @@
  * order to read or read to and from the device.
  */
 
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_URING 1
+#undef BLOCK_SIZE /* From linux/fs.h, the block size of the device is ours */
+#endif
+#endif
+
 #include "blocks_cache.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/* Device opened by bopen, kept until bclose */
+static struct {
+	char name[256]; /* Path of the opened device */
+	int fd;         /* Descriptor, -1 if no device is opened */
+	off_t size;     /* Size of the device in bytes */
+	int backend;    /* BACKEND_PREAD or BACKEND_MMAP */
+	char *map;      /* Mapping of the device with BACKEND_MMAP, NULL otherwise */
+} device = { "", -1, 0, BACKEND_PREAD, NULL };
+
+/* Lock of the block layer: the functions of the interface take it, so that
+ * they serve one caller at a time, and call each other through their
+ * *Locked versions, which expect it taken */
+static pthread_mutex_t blockLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads left running by dreadUnlocked without blockLock. Device writes and
+ * bcloseLocked wait for them under readLock, keeping blockLock, so no new
+ * one starts meanwhile; the reads finish without blockLock */
+static pthread_mutex_t readLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readDone = PTHREAD_COND_INITIALIZER;
+static int readers = 0;
+
+/* Blocks moved by a single preadv/pwritev, the IOV_MAX of Linux */
+#define BVEC_MAX 1024
+
+/* Backend used by the next bopen */
+static int nextBackend = BACKEND_PREAD;
+
+/* Block returned by bget when the cache is disabled */
+static char getBuffer[BLOCK_SIZE];
+
+/* Slot of the block cache */
+typedef struct {
+	int block; /* Cached block number, -1 if the slot is empty */
+	int dirty; /* 1 if the block must be written back */
+	int prev;  /* Previous slot in LRU order (more recently used) */
+	int next;  /* Next slot in LRU order (less recently used) */
+	int chain; /* Next slot in the same hash bucket */
+	int loading; /* 1 while a read ahead fills the slot */
+	int lo;    /* First byte of the block held by the slot */
+	int hi;    /* Byte following the last one held, lo and hi span the
+	            * whole block unless it was written in part by bwritepart */
+} bslot_t;
+
+/* Block cache: slots are kept in LRU order, lookups go through a hash */
+static struct {
+	int capacity;   /* Number of slots */
+	int numBuckets; /* Number of hash buckets, power of two */
+	char *data;     /* capacity * BLOCK_SIZE bytes */
+	bslot_t *slots;
+	int *buckets;   /* First slot of each bucket, -1 if empty */
+	int mru;        /* Most recently used slot */
+	int lru;        /* Least recently used slot */
+	int loading;    /* Slots being filled by read ahead */
+	bstats_t stats;
+} cache = { BCACHE_BLOCKS, 0, NULL, NULL, NULL, -1, -1, 0, { 0 } };
+
+/* Worker threads of BENGINE_THREADS, at most */
+#define BQUEUE_WORKERS 4
+
+/* States of an entry of the queue */
+#define AIO_FREE 0
+#define AIO_QUEUED 1  /* Waiting for a worker */
+#define AIO_RUNNING 2 /* Being transferred */
+#define AIO_DONE 3    /* Transferred, to be completed by the caller */
+
+/* Owners of a request, who learns of its completion */
+#define AIO_CALLER 0 /* The function of the block layer that waits for it */
+#define AIO_USER 1   /* The user, through bwait */
+#define AIO_CACHE 2  /* The cache, whose slots it fills; freed once completed */
+
+/* Entry of the queue of asynchronous requests */
+typedef struct {
+	breq_t *req;                    /* Request served */
+	int state;                      /* AIO_* */
+	int owner;                      /* AIO_CALLER, AIO_USER or AIO_CACHE */
+	ssize_t done;                   /* Bytes transferred, -1 in case of error */
+	int calls;                      /* Read and write calls issued by a worker */
+	struct iovec iov[BREQ_BLOCKS];  /* Buffers of the request */
+} aioentry_t;
+
+/* Queue of asynchronous requests */
+static struct {
+	int depth;           /* Entries of the queue, 0 to serve requests synchronously */
+	int engine;          /* Engine asked for by bsetqueue */
+	int running;         /* Engine started, 0 if none */
+	int inflight;        /* Entries in use */
+	int pending;         /* Requests submitted by bsubmit and not waited for yet */
+	aioentry_t *entries;
+	breq_t *doneFirst;   /* Completed requests, in completion order */
+	breq_t *doneLast;
+
+	/* BENGINE_URING */
+	int ring;            /* io_uring descriptor */
+	void *sqMap, *cqMap; /* Mapped submission and completion rings */
+	size_t sqSize, cqSize, sqesSize;
+	unsigned *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+	void *sqes;          /* Submission entries */
+	void *cqes;          /* Completion entries */
+
+	/* BENGINE_THREADS */
+	pthread_t workers[BQUEUE_WORKERS];
+	int numWorkers;
+	int stop;            /* 1 when the workers must exit */
+	pthread_mutex_t lock;
+	pthread_cond_t queued; /* Signaled when an entry is queued or stop set */
+	pthread_cond_t done;   /* Signaled when an entry is done */
+} aio = { BQUEUE_DEPTH, BENGINE_AUTO, 0, 0, 0, NULL, NULL, NULL, -1 };
+
+static int dread(int blockNumber, char *buffer);
+static int dwrite(int blockNumber, char *buffer);
+static int dwritepart(int blockNumber, int offset, int length, char *buffer);
+static int dvec(int write, bvec_t *vec, int count);
+static int dvecAsync(int write, bvec_t *vec, int count);
+static int dreadUnlocked(bvec_t *vec, int count);
+static void dreadWait(void);
+static int dtransfer(int write, struct iovec *iov, int n, off_t offset, ssize_t done);
+static void cacheFree(void);
+static int aioStop(void);
+static int aioReap(void);
+static int bopenLocked(char *deviceName);
+static int bcloseLocked(void);
+static int bflushLocked(char *deviceName);
+
+/*
+ * Makes sure that deviceName is the opened device.
+ * Returns 0 or -1 in case of error.
+ */
+static int bcheck(char *deviceName) {
+	if (device.fd >= 0 && strcmp(device.name, deviceName) == 0) {
+		return 0;
+	}
+	return bopenLocked(deviceName);
+}
+
+/*
+ * Opens the device once and caches its descriptor and size.
+ * Returns 0 or -1 in case of error.
+ */
+static int bopenLocked(char *deviceName) {
+	if (deviceName == NULL || strlen(deviceName) >= sizeof(device.name)) {
+		return -1;
+	}
+
+	if (device.fd >= 0) {
+		if (strcmp(device.name, deviceName) == 0) {
+			return 0;
+		}
+		bcloseLocked();
+	}
+
+	int fd = open(deviceName, O_RDWR);
+
+	if(fd < 0){
+		/* fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE %s \n", deviceName); */
+		return -1;
+	}
+
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		close(fd);
+		return -1;
+	}
+
+	char *map = NULL;
+	if (nextBackend == BACKEND_MMAP) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (size == 0 || map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	strcpy(device.name, deviceName);
+	device.fd = fd;
+	device.size = size;
+	device.backend = nextBackend;
+	device.map = map;
+
+	return 0;
+}
+
+/*
+ * Releases the device opened by bopen.
+ * Returns 0 or -1 in case of error.
+ */
+static int bcloseLocked(void) {
+	if (device.fd < 0) {
+		return 0;
+	}
+
+	dreadWait();
+	int ret = bflushLocked(device.name);
+	cacheFree();
+	if (aioStop() < 0) {
+		ret = -1;
+	}
+
+	if (device.map != NULL && munmap(device.map, device.size) < 0) {
+		ret = -1;
+	}
+	if (close(device.fd) < 0) {
+		ret = -1;
+	}
+
+	device.map = NULL;
+	device.fd = -1;
+	device.name[0] = '\0';
+	device.size = 0;
+
+	return ret;
+}
+
+/*
+ * Returns the size of the device in bytes or -1 in case of error.
+ */
+static long bsizeLocked(char *deviceName) {
+	if (bcheck(deviceName) < 0) {
+		return -1;
+	}
+	return device.size;
+}
+
+/*
+ * Selects the backend used by the next bopen.
+ * Returns 0 or -1 in case of error.
+ */
+int bsetbackend(int backend) {
+	if (backend != BACKEND_PREAD && backend != BACKEND_MMAP) {
+		return -1;
+	}
+	pthread_mutex_lock(&blockLock);
+	nextBackend = backend;
+	pthread_mutex_unlock(&blockLock);
+	return 0;
+}
+
+/*
+ * Checks that a block lies inside the opened device.
+ * Returns 0 or -1 if it does not.
+ */
+static int bvalid(int blockNumber) {
+	if (blockNumber < 0 || (off_t) BLOCK_SIZE * blockNumber + BLOCK_SIZE > device.size) {
+		return -1;
+	}
+	return 0;
+}
+
+/****************/
+/* Block cache. */
+/****************/
+
+/*
+ * Allocates the slots of the cache, all of them empty.
+ * Returns 0 or -1 in case of error.
+ */
+static int cacheAlloc(void) {
+	int i;
+
+	cache.numBuckets = 1;
+	while (cache.numBuckets < 2 * cache.capacity) {
+		cache.numBuckets <<= 1;
+	}
+
+	cache.data = malloc((size_t) cache.capacity * BLOCK_SIZE);
+	cache.slots = malloc(cache.capacity * sizeof(bslot_t));
+	cache.buckets = malloc(cache.numBuckets * sizeof(int));
+	if (cache.data == NULL || cache.slots == NULL || cache.buckets == NULL) {
+		cacheFree();
+		return -1;
+	}
+
+	for (i = 0; i < cache.numBuckets; i++) {
+		cache.buckets[i] = -1;
+	}
+
+	/* Every slot starts empty and chained in LRU order */
+	for (i = 0; i < cache.capacity; i++) {
+		cache.slots[i].block = -1;
+		cache.slots[i].dirty = 0;
+		cache.slots[i].prev = i - 1;
+		cache.slots[i].next = (i + 1 < cache.capacity) ? i + 1 : -1;
+		cache.slots[i].chain = -1;
+		cache.slots[i].loading = 0;
+		cache.slots[i].lo = 0;
+		cache.slots[i].hi = BLOCK_SIZE;
+	}
+	cache.mru = 0;
+	cache.lru = cache.capacity - 1;
+
+	return 0;
+}
+
+/*
+ * Drops every slot of the cache without writing them back.
+ */
+static void cacheFree(void) {
+	/* The engine still writes into the slots read ahead */
+	while (cache.loading > 0 && aioReap() == 0);
+
+	free(cache.data);
+	free(cache.slots);
+	free(cache.buckets);
+	cache.data = NULL;
+	cache.slots = NULL;
+	cache.buckets = NULL;
+	cache.mru = cache.lru = -1;
+}
+
+static int cacheHash(int blockNumber) {
+	return (unsigned int) (blockNumber * 2654435761u) & (cache.numBuckets - 1);
+}
+
+/*
+ * Returns the slot holding blockNumber, -1 if it is not cached.
+ */
+static int cacheLookup(int blockNumber) {
+	int s;
+
+	for (s = cache.buckets[cacheHash(blockNumber)]; s >= 0; s = cache.slots[s].chain) {
+		if (cache.slots[s].block == blockNumber) {
+			return s;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Moves a slot to the most recently used position.
+ */
+static void cacheTouch(int s) {
+	bslot_t *slot = &cache.slots[s];
+
+	if (cache.mru == s) {
+		return;
+	}
+
+	/* Unlink */
+	cache.slots[slot->prev].next = slot->next;
+	if (slot->next >= 0) {
+		cache.slots[slot->next].prev = slot->prev;
+	} else {
+		cache.lru = slot->prev;
+	}
+
+	/* Link as head */
+	slot->prev = -1;
+	slot->next = cache.mru;
+	cache.slots[cache.mru].prev = s;
+	cache.mru = s;
+}
+
+/*
+ * Removes a slot from its hash bucket.
+ */
+static void cacheUnhash(int s) {
+	int *link;
+
+	for (link = &cache.buckets[cacheHash(cache.slots[s].block)]; *link != s; link = &cache.slots[*link].chain);
+	*link = cache.slots[s].chain;
+}
+
+/*
+ * Empties a slot without writing it back and moves it to the least
+ * recently used position, so that it is the next one replaced.
+ */
+static void cacheDrop(int s) {
+	bslot_t *slot = &cache.slots[s];
+
+	cacheUnhash(s);
+	slot->block = -1;
+	slot->dirty = 0;
+
+	if (cache.lru == s) {
+		return;
+	}
+
+	/* Unlink */
+	if (slot->prev >= 0) {
+		cache.slots[slot->prev].next = slot->next;
+	} else {
+		cache.mru = slot->next;
+	}
+	cache.slots[slot->next].prev = slot->prev;
+
+	/* Link as tail */
+	slot->next = -1;
+	slot->prev = cache.lru;
+	cache.slots[cache.lru].next = s;
+	cache.lru = s;
+}
+
+/*
+ * Waits until a slot being filled by read ahead holds its block.
+ * Returns 0 or -1 in case of error.
+ */
+static int cacheWait(int s) {
+	while (cache.slots[s].loading) {
+		if (aioReap() < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Ends the read ahead of the slots of a request, emptying them if it
+ * failed, and frees it.
+ */
+static void cacheFilled(breq_t *req) {
+	int i;
+
+	for (i = 0; i < req->count; i++) {
+		int s = (req->vec[i].buffer - cache.data) / BLOCK_SIZE;
+		cache.slots[s].loading = 0;
+		cache.loading--;
+		if (req->result < 0) {
+			cacheDrop(s);
+		}
+	}
+	free(req);
+}
+
+/*
+ * Reads the bytes of a block written in part that the slot does not hold.
+ * Returns 0 or -1 in case of error.
+ */
+static int cacheComplete(int s) {
+	bslot_t *slot = &cache.slots[s];
+	char *data = cache.data + (size_t) s * BLOCK_SIZE;
+	char block[BLOCK_SIZE];
+
+	if (slot->lo == 0 && slot->hi == BLOCK_SIZE) {
+		return 0;
+	}
+	if (dread(slot->block, block) < 0) {
+		return -1;
+	}
+	memcpy(data, block, slot->lo);
+	memcpy(data + slot->hi, block + slot->hi, BLOCK_SIZE - slot->hi);
+	slot->lo = 0;
+	slot->hi = BLOCK_SIZE;
+
+	return 0;
+}
+
+/*
+ * Writes a dirty slot to the device, only the bytes it holds if the block
+ * was written in part.
+ * Returns 0 or -1 in case of error.
+ */
+static int cacheWriteback(int s) {
+	bslot_t *slot = &cache.slots[s];
+	char *data = cache.data + (size_t) s * BLOCK_SIZE;
+
+	if (slot->lo == 0 && slot->hi == BLOCK_SIZE) {
+		return dwrite(slot->block, data);
+	}
+	return dwritepart(slot->block, slot->lo, slot->hi - slot->lo, data + slot->lo);
+}
+
+/*
+ * Takes the least recently used slot, writing it back if dirty, and
+ * assigns it to blockNumber. The content of the slot is undefined.
+ * Returns the slot or -1 in case of error.
+ */
+static int cacheReplace(int blockNumber) {
+	if (cacheWait(cache.lru) < 0) {
+		return -1;
+	}
+
+	int s = cache.lru;
+	bslot_t *slot = &cache.slots[s];
+
+	if (slot->block >= 0) {
+		if (slot->dirty) {
+			if (cacheWriteback(s) < 0) {
+				return -1;
+			}
+			cache.stats.writebacks++;
+		}
+		cache.stats.evictions++;
+		cacheUnhash(s);
+	}
+
+	slot->block = blockNumber;
+	slot->dirty = 0;
+	slot->lo = 0;
+	slot->hi = BLOCK_SIZE;
+	slot->chain = cache.buckets[cacheHash(blockNumber)];
+	cache.buckets[cacheHash(blockNumber)] = s;
+	cacheTouch(s);
+
+	return s;
+}
+
+/*
+ * Returns the slot holding blockNumber, filling a new one on a miss. The
+ * block is read from the device only if load is 1.
+ * Returns the slot or -1 in case of error.
+ */
+static int cacheGet(int blockNumber, int load) {
+	if (cache.slots == NULL && cacheAlloc() < 0) {
+		return -1;
+	}
+
+	int s = cacheLookup(blockNumber);
+
+	if (s >= 0) {
+		cache.stats.hits++;
+		cacheTouch(s);
+		if (cacheWait(s) < 0 || (load && cacheComplete(s) < 0)) {
+			return -1;
+		}
+		return s;
+	}
+
+	cache.stats.misses++;
+	if ((s = cacheReplace(blockNumber)) < 0) {
+		return -1;
+	}
+	if (load && dread(blockNumber, cache.data + (size_t) s * BLOCK_SIZE) < 0) {
+		cacheDrop(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * Orders the entries of a vectored transfer by block.
+ */
+static int bveccmp(const void *a, const void *b) {
+	return ((const bvec_t *) a)->blockNumber - ((const bvec_t *) b)->blockNumber;
+}
+
+/*
+ * Writes every dirty block of the cache to the device.
+ * Returns 0 or -1 in case of error.
+ */
+static int bflushLocked(char *deviceName) {
+	int s;
+
+	if (bcheck(deviceName) < 0) {
+		return -1;
+	}
+	if (device.map != NULL) {
+		return msync(device.map, device.size, MS_SYNC);
+	}
+	if (cache.slots == NULL) {
+		return 0;
+	}
+
+	/* Dirty blocks in device order, so that neighbours are written together */
+	bvec_t *vec = malloc(cache.capacity * sizeof(bvec_t));
+	int count = 0, parts = 0;
+	if (vec == NULL) {
+		return -1;
+	}
+	for (s = 0; s < cache.capacity; s++) {
+		if (cache.slots[s].block < 0 || !cache.slots[s].dirty) {
+			continue;
+		}
+		/* Blocks written in part carry only their bytes */
+		if (cache.slots[s].lo != 0 || cache.slots[s].hi != BLOCK_SIZE) {
+			if (cacheWriteback(s) < 0) {
+				free(vec);
+				return -1;
+			}
+			cache.slots[s].dirty = 0;
+			parts++;
+		} else {
+			vec[count].blockNumber = cache.slots[s].block;
+			vec[count].buffer = cache.data + (size_t) s * BLOCK_SIZE;
+			count++;
+		}
+	}
+	cache.stats.writebacks += parts;
+	qsort(vec, count, sizeof(bvec_t), bveccmp);
+
+	if (dvec(1, vec, count) < 0) {
+		free(vec);
+		return -1;
+	}
+	for (s = 0; s < cache.capacity; s++) {
+		cache.slots[s].dirty = 0;
+	}
+	cache.stats.writebacks += count;
+
+	free(vec);
+	return 0;
+}
+
+/*
+ * Flushes the cache and waits until the device has stored every block.
+ * Returns 0 or -1 in case of error.
+ */
+static int bsyncLocked(char *deviceName) {
+	if (bflushLocked(deviceName) < 0) {
+		return -1;
+	}
+	/* msync already waited for the mapping */
+	if (device.map != NULL) {
+		return 0;
+	}
+	return fdatasync(device.fd);
+}
+
+/*
+ * Sets the capacity of the cache in blocks, 0 disables it.
+ * Returns 0 or -1 in case of error.
+ */
+static int bsetcacheLocked(int numBlocks) {
+	if (numBlocks < 0) {
+		return -1;
+	}
+
+	if (cache.slots != NULL) {
+		if (bflushLocked(device.name) < 0) {
+			return -1;
+		}
+		cacheFree();
+	}
+	cache.capacity = numBlocks;
+
+	return 0;
+}
+
+/*
+ * Copies the cache counters into stats.
+ */
+void bstats(bstats_t *stats) {
+	pthread_mutex_lock(&blockLock);
+	*stats = cache.stats;
+	pthread_mutex_unlock(&blockLock);
+}
+
+/*
+ * Resets the cache counters.
+ */
+void bresetstats(void) {
+	pthread_mutex_lock(&blockLock);
+	memset(&cache.stats, 0, sizeof(bstats_t));
+	pthread_mutex_unlock(&blockLock);
+}
+
+/*********************/
+/* Asynchronous I/O. */
+/*********************/
+
+#ifdef HAVE_URING
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, aio.ring, toSubmit, minComplete, flags, NULL, 0);
+}
+#endif
+
+/*
+ * Creates an io_uring with a place for every entry and maps its rings.
+ * Returns 0 or -1 if the kernel does not provide it.
+ */
+static int uringStart(void) {
+#ifdef HAVE_URING
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	if ((aio.ring = uringSetup(aio.depth, &params)) < 0) {
+		return -1;
+	}
+
+	aio.sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	aio.cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	aio.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	aio.sqMap = mmap(NULL, aio.sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio.ring, IORING_OFF_SQ_RING);
+	aio.cqMap = mmap(NULL, aio.cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio.ring, IORING_OFF_CQ_RING);
+	aio.sqes = mmap(NULL, aio.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio.ring, IORING_OFF_SQES);
+	if (aio.sqMap == MAP_FAILED || aio.cqMap == MAP_FAILED || aio.sqes == MAP_FAILED) {
+		if (aio.sqMap != MAP_FAILED) munmap(aio.sqMap, aio.sqSize);
+		if (aio.cqMap != MAP_FAILED) munmap(aio.cqMap, aio.cqSize);
+		if (aio.sqes != MAP_FAILED) munmap(aio.sqes, aio.sqesSize);
+		close(aio.ring);
+		aio.ring = -1;
+		return -1;
+	}
+
+	aio.sqTail = (unsigned *) ((char *) aio.sqMap + params.sq_off.tail);
+	aio.sqMask = (unsigned *) ((char *) aio.sqMap + params.sq_off.ring_mask);
+	aio.sqArray = (unsigned *) ((char *) aio.sqMap + params.sq_off.array);
+	aio.cqHead = (unsigned *) ((char *) aio.cqMap + params.cq_off.head);
+	aio.cqTail = (unsigned *) ((char *) aio.cqMap + params.cq_off.tail);
+	aio.cqMask = (unsigned *) ((char *) aio.cqMap + params.cq_off.ring_mask);
+	aio.cqes = (char *) aio.cqMap + params.cq_off.cqes;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Serves the queued entries until the queue is stopped.
+ */
+static void *aioWorker(void *arg) {
+	int e;
+
+	pthread_mutex_lock(&aio.lock);
+	for (;;) {
+		for (e = 0; e < aio.depth && aio.entries[e].state != AIO_QUEUED; e++);
+		if (e == aio.depth) {
+			if (aio.stop) {
+				break;
+			}
+			pthread_cond_wait(&aio.queued, &aio.lock);
+			continue;
+		}
+
+		aioentry_t *entry = &aio.entries[e];
+		entry->state = AIO_RUNNING;
+		pthread_mutex_unlock(&aio.lock);
+
+		off_t offset = (off_t) BLOCK_SIZE * entry->req->vec[0].blockNumber;
+		entry->calls = dtransfer(entry->req->write, entry->iov, entry->req->count, offset, 0);
+		entry->done = entry->calls < 0 ? -1 : (ssize_t) entry->req->count * BLOCK_SIZE;
+
+		pthread_mutex_lock(&aio.lock);
+		entry->state = AIO_DONE;
+		pthread_cond_broadcast(&aio.done);
+	}
+	pthread_mutex_unlock(&aio.lock);
+
+	return arg;
+}
+
+/*
+ * Starts the worker threads serving the queue.
+ * Returns 0 or -1 in case of error.
+ */
+static int threadsStart(void) {
+	aio.stop = 0;
+	if (pthread_mutex_init(&aio.lock, NULL) != 0) {
+		return -1;
+	}
+	pthread_cond_init(&aio.queued, NULL);
+	pthread_cond_init(&aio.done, NULL);
+
+	for (aio.numWorkers = 0; aio.numWorkers < BQUEUE_WORKERS && aio.numWorkers < aio.depth; aio.numWorkers++) {
+		if (pthread_create(&aio.workers[aio.numWorkers], NULL, aioWorker, NULL) != 0) {
+			break;
+		}
+	}
+	if (aio.numWorkers > 0) {
+		return 0;
+	}
+
+	pthread_cond_destroy(&aio.queued);
+	pthread_cond_destroy(&aio.done);
+	pthread_mutex_destroy(&aio.lock);
+	return -1;
+}
+
+/*
+ * Starts the engine serving the queue, if not started yet.
+ * Returns 0 or -1 in case of error.
+ */
+static int aioStart(void) {
+	if (aio.running) {
+		return 0;
+	}
+
+	aio.entries = calloc(aio.depth, sizeof(aioentry_t));
+	if (aio.entries == NULL) {
+		return -1;
+	}
+
+	if (aio.engine != BENGINE_THREADS && uringStart() == 0) {
+		aio.running = BENGINE_URING;
+	} else if (aio.engine != BENGINE_URING && threadsStart() == 0) {
+		aio.running = BENGINE_THREADS;
+	} else {
+		free(aio.entries);
+		aio.entries = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Appends a completed request to those returned by bwait.
+ */
+static void aioNotify(breq_t *req) {
+	req->next = NULL;
+	if (aio.doneLast != NULL) {
+		aio.doneLast->next = req;
+	} else {
+		aio.doneFirst = req;
+	}
+	aio.doneLast = req;
+}
+
+/*
+ * Ends a transferred entry: sets the result of its request and frees it.
+ */
+static void aioComplete(aioentry_t *entry) {
+	breq_t *req = entry->req;
+	ssize_t total = (ssize_t) req->count * BLOCK_SIZE;
+
+	cache.stats.requests += entry->calls;
+
+	/* Resume a short transfer */
+	if (entry->done >= 0 && entry->done < total) {
+		off_t offset = (off_t) BLOCK_SIZE * req->vec[0].blockNumber;
+		int calls = dtransfer(req->write, entry->iov, req->count, offset, entry->done);
+		entry->done = calls < 0 ? -1 : total;
+		cache.stats.requests += calls < 0 ? 0 : calls;
+	}
+
+	req->result = entry->done == total ? 0 : -1;
+	if (req->result == 0 && !req->write) {
+		cache.stats.reads += req->count;
+	}
+
+	entry->req = NULL;
+	entry->state = AIO_FREE;
+	aio.inflight--;
+
+	if (entry->owner == AIO_USER) {
+		aioNotify(req);
+	} else if (entry->owner == AIO_CACHE) {
+		cacheFilled(req);
+	}
+}
+
+/*
+ * Fails a request that could not be handed to the engine.
+ */
+static void aioRefuse(breq_t *req, int owner) {
+	req->result = -1;
+	if (owner == AIO_CACHE) {
+		cacheFilled(req);
+	}
+}
+
+/*
+ * Waits for at least one entry in flight to be transferred and completes it.
+ * Returns 0 or -1 in case of error.
+ */
+static int aioReap(void) {
+	int e;
+
+	if (aio.running == BENGINE_THREADS) {
+		pthread_mutex_lock(&aio.lock);
+		for (;;) {
+			for (e = 0; e < aio.depth && aio.entries[e].state != AIO_DONE; e++);
+			if (e < aio.depth) {
+				break;
+			}
+			pthread_cond_wait(&aio.done, &aio.lock);
+		}
+		pthread_mutex_unlock(&aio.lock);
+		aioComplete(&aio.entries[e]);
+		return 0;
+	}
+
+#ifdef HAVE_URING
+	unsigned head = *aio.cqHead;
+	while (head == __atomic_load_n(aio.cqTail, __ATOMIC_ACQUIRE)) {
+		if (uringEnter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+
+	struct io_uring_cqe *cqe = (struct io_uring_cqe *) aio.cqes + (head & *aio.cqMask);
+	aioentry_t *entry = &aio.entries[cqe->user_data];
+	entry->done = cqe->res < 0 ? -1 : cqe->res;
+	__atomic_store_n(aio.cqHead, head + 1, __ATOMIC_RELEASE);
+	aioComplete(entry);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Places a request in a free entry of the queue, waiting for one if it is
+ * full, and hands it to the engine.
+ * Returns 0 or -1 in case of error.
+ */
+static int aioSubmit(breq_t *req, int owner) {
+	int e, i;
+
+	if (aioStart() < 0) {
+		aioRefuse(req, owner);
+		return -1;
+	}
+	while (aio.inflight == aio.depth) {
+		if (aioReap() < 0) {
+			aioRefuse(req, owner);
+			return -1;
+		}
+	}
+
+	for (e = 0; aio.entries[e].state != AIO_FREE; e++);
+	aioentry_t *entry = &aio.entries[e];
+	for (i = 0; i < req->count; i++) {
+		entry->iov[i].iov_base = req->vec[i].buffer;
+		entry->iov[i].iov_len = BLOCK_SIZE;
+	}
+	if (req->write) {
+		dreadWait();
+	}
+	entry->req = req;
+	entry->owner = owner;
+	entry->calls = 0;
+	entry->done = 0;
+	req->result = BREQ_PENDING;
+	aio.inflight++;
+
+	if (aio.running == BENGINE_THREADS) {
+		pthread_mutex_lock(&aio.lock);
+		entry->state = AIO_QUEUED;
+		pthread_cond_signal(&aio.queued);
+		pthread_mutex_unlock(&aio.lock);
+		return 0;
+	}
+
+#ifdef HAVE_URING
+	unsigned tail = *aio.sqTail;
+	unsigned index = tail & *aio.sqMask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *) aio.sqes + index;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = device.fd;
+	sqe->addr = (unsigned long) entry->iov;
+	sqe->len = req->count;
+	sqe->off = (off_t) BLOCK_SIZE * req->vec[0].blockNumber;
+	sqe->user_data = e;
+	aio.sqArray[index] = index;
+	entry->state = AIO_RUNNING;
+	entry->calls = 1;
+	__atomic_store_n(aio.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	int ret;
+	while ((ret = uringEnter(1, 0, 0)) < 0 && errno == EINTR);
+	if (ret == 1) {
+		return 0;
+	}
+#endif
+
+	/* The entry can't be served */
+	entry->req = NULL;
+	entry->state = AIO_FREE;
+	aio.inflight--;
+	aioRefuse(req, owner);
+	return -1;
+}
+
+/*
+ * Waits for every entry in flight and releases the engine.
+ * Returns 0 or -1 in case of error.
+ */
+static int aioStop(void) {
+	int i, ret = 0;
+
+	while (aio.inflight > 0) {
+		if (aioReap() < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (aio.running == BENGINE_THREADS) {
+		pthread_mutex_lock(&aio.lock);
+		aio.stop = 1;
+		pthread_cond_broadcast(&aio.queued);
+		pthread_mutex_unlock(&aio.lock);
+		for (i = 0; i < aio.numWorkers; i++) {
+			pthread_join(aio.workers[i], NULL);
+		}
+		pthread_cond_destroy(&aio.queued);
+		pthread_cond_destroy(&aio.done);
+		pthread_mutex_destroy(&aio.lock);
+	}
+#ifdef HAVE_URING
+	if (aio.running == BENGINE_URING) {
+		munmap(aio.sqMap, aio.sqSize);
+		munmap(aio.cqMap, aio.cqSize);
+		munmap(aio.sqes, aio.sqesSize);
+		close(aio.ring);
+		aio.ring = -1;
+	}
+#endif
+
+	free(aio.entries);
+	aio.entries = NULL;
+	aio.running = 0;
+	aio.inflight = 0;
+	return ret;
+}
+
+/*
+ * Sets the number of requests in flight and the engine serving them.
+ * Returns 0 or -1 in case of error.
+ */
+static int bsetqueueLocked(int depth, int engine) {
+	if (depth < 0 || depth > 4096 || engine < BENGINE_AUTO || engine > BENGINE_THREADS) {
+		return -1;
+	}
+
+	int ret = aioStop();
+	aio.depth = depth;
+	aio.engine = engine;
+	return ret;
+}
+
+/*
+ * Returns the engine serving the requests or -1 if none was started.
+ */
+int bqueueengine(void) {
+	pthread_mutex_lock(&blockLock);
+	int engine = aio.running ? aio.running : -1;
+	pthread_mutex_unlock(&blockLock);
+	return engine;
+}
+
+/*
+ * Submits a request for consecutive blocks.
+ * Returns 0 or -1 in case of error.
+ */
+static int bsubmitLocked(char *deviceName, breq_t *req) {
+	int i;
+
+	if (bcheck(deviceName) < 0 || req == NULL || req->count < 1 || req->count > BREQ_BLOCKS) {
+		return -1;
+	}
+	for (i = 0; i < req->count; i++) {
+		if (bvalid(req->vec[i].blockNumber) < 0 || req->vec[i].blockNumber != req->vec[0].blockNumber + i) {
+			return -1;
+		}
+	}
+
+	/* Served at once, completed for the next bwait */
+	if (device.map != NULL || aio.depth == 0) {
+		req->result = BREQ_PENDING;
+		aio.pending++;
+		if (device.map != NULL) {
+			for (i = 0; i < req->count; i++) {
+				char *block = device.map + (size_t) req->vec[i].blockNumber * BLOCK_SIZE;
+				memcpy(req->write ? block : req->vec[i].buffer, req->write ? req->vec[i].buffer : block, BLOCK_SIZE);
+			}
+			req->result = 0;
+		} else {
+			req->result = dvec(req->write, req->vec, req->count);
+		}
+		aioNotify(req);
+		return 0;
+	}
+
+	if (aioSubmit(req, AIO_USER) < 0) {
+		return -1;
+	}
+	aio.pending++;
+	return 0;
+}
+
+/*
+ * Waits for a submitted request.
+ * Returns the request or NULL if none is pending.
+ */
+static breq_t *bwaitLocked(void) {
+	if (aio.pending == 0) {
+		return NULL;
+	}
+	while (aio.doneFirst == NULL) {
+		if (aioReap() < 0) {
+			return NULL;
+		}
+	}
+
+	breq_t *req = aio.doneFirst;
+	aio.doneFirst = req->next;
+	if (aio.doneFirst == NULL) {
+		aio.doneLast = NULL;
+	}
+	req->next = NULL;
+	aio.pending--;
+	return req;
+}
+
+/*
+ * Waits for every submitted request.
+ * Returns 0 or -1 if any failed.
+ */
+static int bwaitallLocked(void) {
+	breq_t *req;
+	int ret = 0;
+
+	while (aio.pending > 0) {
+		if ((req = bwaitLocked()) == NULL || req->result < 0) {
+			ret = -1;
+		}
+		if (req == NULL) {
+			break;
+		}
+	}
+	return ret;
+}
+
+/****************/
+/* Disk access. */
+/****************/
+
+/*
+ * Reads a block from the device and stores it in a buffer.
+ * Returns 0 or -1 in case of error, including short
+ * read.
+ */
+static int breadLocked(char *deviceName, int blockNumber, char *buffer) {
+	if (bcheck(deviceName) < 0 || bvalid(blockNumber) < 0) {
+		return -1;
+	}
+
+	if (device.map != NULL) {
+		memcpy(buffer, device.map + (size_t) blockNumber * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+	if (cache.capacity == 0) {
+		return dread(blockNumber, buffer);
+	}
+
+	int s = cacheGet(blockNumber, 1);
+	if (s < 0) {
+		return -1;
+	}
+
+	memcpy(buffer, cache.data + (size_t) s * BLOCK_SIZE, BLOCK_SIZE);
+	return 0;
+}
+
+/*
+ * Reads length bytes of a block into a buffer, starting at offset.
+ * Returns 0 or -1 in case of error.
+ */
+static int breadpartLocked(char *deviceName, int blockNumber, int offset, int length, char *buffer) {
+	char block[BLOCK_SIZE];
 
-/****************/
-/* Disk access. */
-/****************/
+	if (bcheck(deviceName) < 0 || bvalid(blockNumber) < 0 || offset < 0 || length < 0 || offset + length > BLOCK_SIZE) {
+		return -1;
+	}
+
+	if (device.map != NULL) {
+		memcpy(buffer, device.map + (size_t) blockNumber * BLOCK_SIZE + offset, length);
+		return 0;
+	}
+	if (cache.capacity == 0) {
+		if (dread(blockNumber, block) < 0) {
+			return -1;
+		}
+		memcpy(buffer, block + offset, length);
+		return 0;
+	}
+
+	int s = cacheGet(blockNumber, 1);
+	if (s < 0) {
+		return -1;
+	}
+
+	memcpy(buffer, cache.data + (size_t) s * BLOCK_SIZE + offset, length);
+	return 0;
+}
 
 /*
- * Reads a block from the device and stores it in a buffer.
- * Returns 0 or -1 in case of error, including short
- * read.
+ * Writes a block from a buffer to the device.
+ * Returns 0 or -1 in case of error.
  */
-int bread(char *deviceName, int blockNumber, char *buffer) {
-	int fd = open(deviceName, O_RDONLY);
+static int bwriteLocked(char *deviceName, int blockNumber, char*buffer) {
+	if (bcheck(deviceName) < 0 || bvalid(blockNumber) < 0) {
+		return -1;
+	}
 
-	if(fd < 0){
-		/* fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE %s \n", deviceName); */
+	if (device.map != NULL) {
+		memcpy(device.map + (size_t) blockNumber * BLOCK_SIZE, buffer, BLOCK_SIZE);
+		return 0;
+	}
+	if (cache.capacity == 0) {
+		return dwrite(blockNumber, buffer);
+	}
+
+	/* The whole block is overwritten, no need to read it on a miss */
+	int s = cacheGet(blockNumber, 0);
+	if (s < 0) {
 		return -1;
 	}
 
-	int len = lseek(fd, 0, SEEK_END) + 1;
-	if((BLOCK_SIZE*blockNumber+BLOCK_SIZE) > len) {
-		close(fd);
+	memcpy(cache.data + (size_t) s * BLOCK_SIZE, buffer, BLOCK_SIZE);
+	cache.slots[s].dirty = 1;
+	cache.slots[s].lo = 0;
+	cache.slots[s].hi = BLOCK_SIZE;
+
+	return 0;
+}
+
+/*
+ * Writes length bytes of a buffer into a block, starting at offset. The
+ * rest of the block is not read: the cache keeps the bytes written and
+ * writes back only them, unless the block is read before.
+ * Returns 0 or -1 in case of error.
+ */
+static int bwritepartLocked(char *deviceName, int blockNumber, int offset, int length, char *buffer) {
+	int s;
+
+	if (bcheck(deviceName) < 0 || bvalid(blockNumber) < 0 || offset < 0 || length < 0 || offset + length > BLOCK_SIZE) {
+		return -1;
+	}
+
+	if (device.map != NULL) {
+		memcpy(device.map + (size_t) blockNumber * BLOCK_SIZE + offset, buffer, length);
+		return 0;
+	}
+	if (cache.capacity == 0) {
+		return dwritepart(blockNumber, offset, length, buffer);
+	}
+	if (cache.slots == NULL && cacheAlloc() < 0) {
 		return -1;
 	}
 
-	lseek(fd, BLOCK_SIZE*blockNumber, SEEK_SET);
+	if ((s = cacheLookup(blockNumber)) >= 0) {
+		cache.stats.hits++;
+		cacheTouch(s);
+		if (cacheWait(s) < 0) {
+			return -1;
+		}
+		/* A single run of bytes is kept, the block is read to join two apart */
+		bslot_t *slot = &cache.slots[s];
+		if (offset > slot->hi || offset + length < slot->lo) {
+			if (cacheComplete(s) < 0) {
+				return -1;
+			}
+		}
+		slot->lo = (offset < slot->lo) ? offset : slot->lo;
+		slot->hi = (offset + length > slot->hi) ? offset + length : slot->hi;
+	} else {
+		cache.stats.misses++;
+		if ((s = cacheReplace(blockNumber)) < 0) {
+			return -1;
+		}
+		cache.slots[s].lo = offset;
+		cache.slots[s].hi = offset + length;
+	}
 
-	int total_read, read_result;
+	memcpy(cache.data + (size_t) s * BLOCK_SIZE + offset, buffer, length);
+	cache.slots[s].dirty = 1;
 
-	total_read = 0;
-	do{
-		read_result = read(fd, buffer+total_read, BLOCK_SIZE-total_read);
-		total_read = total_read + read_result;
-	} while(total_read < BLOCK_SIZE && read_result >= 0);
+	return 0;
+}
 
-	close(fd);
+/*
+ * Reads a list of blocks, copying the cached ones and reading the others
+ * from the device, consecutive blocks with a single preadv.
+ * Returns 0 or -1 in case of error.
+ */
+static int breadvLocked(char *deviceName, bvec_t *vec, int count) {
+	int i, j, s;
+
+	if (bcheck(deviceName) < 0) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (bvalid(vec[i].blockNumber) < 0) {
+			return -1;
+		}
+	}
+
+	if (device.map != NULL) {
+		for (i = 0; i < count; i++) {
+			memcpy(vec[i].buffer, device.map + (size_t) vec[i].blockNumber * BLOCK_SIZE, BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < count; i = j) {
+		/* The cache may hold a newer version than the device */
+		if (cache.slots != NULL && (s = cacheLookup(vec[i].blockNumber)) >= 0) {
+			if (cacheWait(s) < 0 || cacheComplete(s) < 0) {
+				return -1;
+			}
+			memcpy(vec[i].buffer, cache.data + (size_t) s * BLOCK_SIZE, BLOCK_SIZE);
+			cache.stats.hits++;
+			j = i + 1;
+			continue;
+		}
+
+		/* Run of uncached entries, read without filling the cache. The lock is
+		 * left meanwhile, unless the run is spread over the queue */
+		for (j = i + 1; j < count && vec[j].blockNumber == vec[j - 1].blockNumber + 1
+			&& (cache.slots == NULL || cacheLookup(vec[j].blockNumber) < 0); j++);
+		if (aio.depth > 0 && j - i > BREQ_BLOCKS) {
+			if (dvec(0, vec + i, j - i) < 0) {
+				return -1;
+			}
+		} else if (dreadUnlocked(vec + i, j - i) < 0) {
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
 /*
- * Writes a block from a buffer to the device.
+ * Writes a list of blocks to the device, consecutive blocks with a single
+ * pwritev, and updates the cached copies.
  * Returns 0 or -1 in case of error.
  */
-int bwrite(char *deviceName, int blockNumber, char*buffer) {
-	int fd = open(deviceName, O_WRONLY);
+static int bwritevLocked(char *deviceName, bvec_t *vec, int count) {
+	int i, s;
 
-	if(fd < 0){
-		/* fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE %s \n", deviceName); */
+	if (bcheck(deviceName) < 0) {
 		return -1;
 	}
+	for (i = 0; i < count; i++) {
+		if (bvalid(vec[i].blockNumber) < 0) {
+			return -1;
+		}
+	}
 
-	int len = lseek(fd, 0, SEEK_END) + 1;
-	if((BLOCK_SIZE*blockNumber+BLOCK_SIZE) > len) {
-		close(fd);
+	if (device.map != NULL) {
+		for (i = 0; i < count; i++) {
+			memcpy(device.map + (size_t) vec[i].blockNumber * BLOCK_SIZE, vec[i].buffer, BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	if (dvec(1, vec, count) < 0) {
+		return -1;
+	}
+
+	/* The device holds now the latest version of the cached blocks */
+	for (i = 0; i < count && cache.slots != NULL; i++) {
+		if ((s = cacheLookup(vec[i].blockNumber)) >= 0) {
+			if (cacheWait(s) < 0) {
+				return -1;
+			}
+			memcpy(cache.data + (size_t) s * BLOCK_SIZE, vec[i].buffer, BLOCK_SIZE);
+			cache.slots[s].dirty = 0;
+			cache.slots[s].lo = 0;
+			cache.slots[s].hi = BLOCK_SIZE;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Reads consecutive blocks into a buffer.
+ * Returns 0 or -1 in case of error.
+ */
+int breadn(char *deviceName, int firstBlock, int count, char *buffer) {
+	bvec_t vec[BVEC_MAX];
+	int i, n;
+
+	for (; count > 0; firstBlock += n, buffer += (size_t) n * BLOCK_SIZE, count -= n) {
+		n = count < BVEC_MAX ? count : BVEC_MAX;
+		for (i = 0; i < n; i++) {
+			vec[i].blockNumber = firstBlock + i;
+			vec[i].buffer = buffer + (size_t) i * BLOCK_SIZE;
+		}
+		if (breadv(deviceName, vec, n) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Writes consecutive blocks from a buffer.
+ * Returns 0 or -1 in case of error.
+ */
+int bwriten(char *deviceName, int firstBlock, int count, char *buffer) {
+	bvec_t vec[BVEC_MAX];
+	int i, n;
+
+	for (; count > 0; firstBlock += n, buffer += (size_t) n * BLOCK_SIZE, count -= n) {
+		n = count < BVEC_MAX ? count : BVEC_MAX;
+		for (i = 0; i < n; i++) {
+			vec[i].blockNumber = firstBlock + i;
+			vec[i].buffer = buffer + (size_t) i * BLOCK_SIZE;
+		}
+		if (bwritev(deviceName, vec, n) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns a read-only pointer to the content of a block, NULL in case of
+ * error. The pointer is only valid until the next call to the block layer.
+ */
+static const char *bgetLocked(char *deviceName, int blockNumber) {
+	if (bcheck(deviceName) < 0 || bvalid(blockNumber) < 0) {
+		return NULL;
+	}
+
+	if (device.map != NULL) {
+		return device.map + (size_t) blockNumber * BLOCK_SIZE;
+	}
+	if (cache.capacity == 0) {
+		return dread(blockNumber, getBuffer) < 0 ? NULL : getBuffer;
+	}
+
+	int s = cacheGet(blockNumber, 1);
+	if (s < 0) {
+		return NULL;
+	}
+
+	return cache.data + (size_t) s * BLOCK_SIZE;
+}
+
+/*
+ * Takes slots for the blocks of a list missing from the cache and reads
+ * them. With wait 0 the reads are left to the queue, the slots marked as
+ * loading until they complete.
+ * Returns 0 or -1 in case of error.
+ */
+static int cacheFill(int *blocks, int count, int wait) {
+	int i, j, n = 0, s, ret = 0;
+
+	if (cache.slots == NULL && cacheAlloc() < 0) {
+		return -1;
+	}
+
+	/* The blocks taken must not replace each other */
+	if (count > cache.capacity / 2) {
+		count = cache.capacity / 2;
+	}
+	bvec_t *vec = malloc((count > 0 ? count : 1) * sizeof(bvec_t));
+	if (vec == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (bvalid(blocks[i]) < 0) {
+			ret = -1;
+			break;
+		}
+		if ((s = cacheLookup(blocks[i])) >= 0) {
+			cacheTouch(s);
+			continue;
+		}
+		if ((s = cacheReplace(blocks[i])) < 0) {
+			ret = -1;
+			break;
+		}
+		cache.stats.misses++;
+		vec[n].blockNumber = blocks[i];
+		vec[n].buffer = cache.data + (size_t) s * BLOCK_SIZE;
+		n++;
+	}
+
+	if (wait || aio.depth == 0 || aioStart() < 0) {
+		/* Slots are left empty if their blocks could not be read */
+		if (dvec(0, vec, n) < 0) {
+			for (i = 0; i < n; i++) {
+				cacheDrop(cacheLookup(vec[i].blockNumber));
+			}
+			ret = -1;
+		}
+		free(vec);
+		return ret;
+	}
+
+	/* One request per run, each one owning a copy of its entries */
+	for (i = 0; i < n; i += j) {
+		for (j = 1; i + j < n && j < BREQ_BLOCKS && vec[i + j].blockNumber == vec[i].blockNumber + j; j++);
+
+		breq_t *req = malloc(sizeof(breq_t) + j * sizeof(bvec_t));
+		if (req == NULL) {
+			for (; i < n; i++) {
+				cacheDrop(cacheLookup(vec[i].blockNumber));
+			}
+			ret = -1;
+			break;
+		}
+		req->write = 0;
+		req->vec = (bvec_t *) (req + 1);
+		req->count = j;
+		memcpy(req->vec, vec + i, j * sizeof(bvec_t));
+		for (s = 0; s < j; s++) {
+			cache.slots[(vec[i + s].buffer - cache.data) / BLOCK_SIZE].loading = 1;
+		}
+		cache.loading += j;
+		cache.stats.prefetches += j;
+
+		if (aioSubmit(req, AIO_CACHE) < 0) {
+			ret = -1;
+		}
+	}
+
+	free(vec);
+	return ret;
+}
+
+/*
+ * Brings a list of blocks into the cache, reading the missing ones together.
+ * Returns 0 or -1 in case of error.
+ */
+static int bprefetchLocked(char *deviceName, int *blocks, int count) {
+	if (bcheck(deviceName) < 0) {
+		return -1;
+	}
+	if (device.map != NULL || cache.capacity == 0) {
+		return 0;
+	}
+	return cacheFill(blocks, count, 1);
+}
+
+/*
+ * Starts bringing a list of blocks into the cache, without waiting.
+ * Returns 0 or -1 in case of error.
+ */
+static int breadaheadLocked(char *deviceName, int *blocks, int count) {
+	if (bcheck(deviceName) < 0) {
 		return -1;
 	}
+	if (device.map != NULL || cache.capacity == 0) {
+		return 0;
+	}
+	return cacheFill(blocks, count, 0);
+}
+
+/*
+ * Reads a block from the device, bypassing the cache.
+ * Returns 0 or -1 in case of error, including short read.
+ */
+static int dread(int blockNumber, char *buffer) {
+	off_t offset = (off_t) BLOCK_SIZE * blockNumber;
+
+	int total_read, read_result;
 
-	lseek(fd, BLOCK_SIZE*blockNumber, SEEK_SET);
+	cache.stats.reads++;
+
+	total_read = 0;
+	do{
+		cache.stats.requests++;
+		read_result = pread(device.fd, buffer+total_read, BLOCK_SIZE-total_read, offset+total_read);
+		if (read_result <= 0) {
+			return -1;
+		}
+		total_read = total_read + read_result;
+	} while(total_read < BLOCK_SIZE);
+
+	return 0;
+}
+
+/*
+ * Writes a block to the device, bypassing the cache.
+ * Returns 0 or -1 in case of error.
+ */
+static int dwrite(int blockNumber, char *buffer) {
+	off_t offset = (off_t) BLOCK_SIZE * blockNumber;
 
 	int total_write, write_result;
 
+	dreadWait();
 	total_write = 0;
 	do{
-		write_result = write(fd, buffer+total_write, BLOCK_SIZE-total_write);
+		cache.stats.requests++;
+		write_result = pwrite(device.fd, buffer+total_write, BLOCK_SIZE-total_write, offset+total_write);
+		if (write_result <= 0) {
+			return -1;
+		}
 		total_write = total_write + write_result;
-	} while(total_write < BLOCK_SIZE && write_result >= 0);
+	} while(total_write < BLOCK_SIZE);
+
+	return 0;
+}
+
+/*
+ * Writes part of a block to the device, bypassing the cache.
+ * Returns 0 or -1 in case of error.
+ */
+static int dwritepart(int blockNumber, int offset, int length, char *buffer) {
+	off_t start = (off_t) BLOCK_SIZE * blockNumber + offset;
+	int total_write = 0, write_result;
+
+	dreadWait();
+	while (total_write < length) {
+		cache.stats.requests++;
+		write_result = pwrite(device.fd, buffer + total_write, length - total_write, start + total_write);
+		if (write_result <= 0) {
+			return -1;
+		}
+		total_write += write_result;
+	}
+
+	return 0;
+}
+
+/*
+ * Moves n buffers between the device and memory, starting at offset and
+ * skipping the first done bytes, already transferred. The transfer is
+ * resumed while it is short.
+ * Returns the number of calls issued or -1 in case of error.
+ */
+static int dtransfer(int write, struct iovec *iov, int n, off_t offset, ssize_t done) {
+	int calls = 0;
+
+	if (write) {
+		dreadWait();
+	}
+	for (;;) {
+		offset += done;
+
+		/* Skip what was transferred */
+		while (n > 0 && done >= (ssize_t) iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n == 0) {
+			return calls;
+		}
+		iov->iov_base = (char *) iov->iov_base + done;
+		iov->iov_len -= done;
+
+		calls++;
+		done = write ? pwritev(device.fd, iov, n, offset) : preadv(device.fd, iov, n, offset);
+		if (done <= 0) {
+			return -1;
+		}
+	}
+}
 
-	close(fd);
+/*
+ * Transfers the entries of a list between the device and their buffers,
+ * bypassing the cache. Entries for consecutive blocks are moved with a
+ * single preadv/pwritev; several runs are submitted to the queue at once,
+ * so that they overlap.
+ * Returns 0 or -1 in case of error.
+ */
+static int dvec(int write, bvec_t *vec, int count) {
+	struct iovec iov[BVEC_MAX];
+	int i, n, calls;
+
+	/* A single run is not worth the queue */
+	if (aio.depth > 0 && count > 1 && (count > BREQ_BLOCKS || vec[count - 1].blockNumber != vec[0].blockNumber + count - 1)
+		&& aioStart() == 0) {
+		return dvecAsync(write, vec, count);
+	}
+
+	for (i = 0; i < count; i += n) {
+		/* Run of consecutive blocks */
+		iov[0].iov_base = vec[i].buffer;
+		iov[0].iov_len = BLOCK_SIZE;
+		for (n = 1; i + n < count && n < BVEC_MAX && vec[i + n].blockNumber == vec[i].blockNumber + n; n++) {
+			iov[n].iov_base = vec[i + n].buffer;
+			iov[n].iov_len = BLOCK_SIZE;
+		}
+
+		if ((calls = dtransfer(write, iov, n, (off_t) BLOCK_SIZE * vec[i].blockNumber, 0)) < 0) {
+			return -1;
+		}
+		cache.stats.requests += calls;
+		if (!write) {
+			cache.stats.reads += n;
+		}
+	}
 
 	return 0;
 }
+
+/*
+ * Reads a run of consecutive blocks into their buffers, bypassing the cache,
+ * with the lock of the block layer left: the blocks are not cached and the
+ * buffers belong to the caller, so other callers go on meanwhile. The read
+ * is counted in readers, so the device is neither written nor closed until
+ * it ends.
+ * Returns 0 or -1 in case of error.
+ */
+static int dreadUnlocked(bvec_t *vec, int count) {
+	struct iovec iov[BVEC_MAX];
+	int i, n, calls = 0, ret = 0;
+
+	pthread_mutex_lock(&readLock);
+	readers++;
+	pthread_mutex_unlock(&readLock);
+	pthread_mutex_unlock(&blockLock);
+	for (i = 0; i < count && ret == 0; i += n) {
+		for (n = 0; i + n < count && n < BVEC_MAX; n++) {
+			iov[n].iov_base = vec[i + n].buffer;
+			iov[n].iov_len = BLOCK_SIZE;
+		}
+		int c = dtransfer(0, iov, n, (off_t) BLOCK_SIZE * vec[i].blockNumber, 0);
+		if (c < 0) {
+			ret = -1;
+		} else {
+			calls += c;
+		}
+	}
+	pthread_mutex_lock(&readLock);
+	if (--readers == 0) {
+		pthread_cond_broadcast(&readDone);
+	}
+	pthread_mutex_unlock(&readLock);
+	pthread_mutex_lock(&blockLock);
+
+	cache.stats.requests += calls;
+	if (ret == 0) {
+		cache.stats.reads += count;
+	}
+	return ret;
+}
+
+/*
+ * Waits for the reads left running by dreadUnlocked, before the device is
+ * written or closed.
+ */
+static void dreadWait(void) {
+	pthread_mutex_lock(&readLock);
+	while (readers > 0) {
+		pthread_cond_wait(&readDone, &readLock);
+	}
+	pthread_mutex_unlock(&readLock);
+}
+
+/*
+ * Transfers the entries of a list as one queued request per run of
+ * consecutive blocks, and waits for all of them.
+ * Returns 0 or -1 in case of error.
+ */
+static int dvecAsync(int write, bvec_t *vec, int count) {
+	breq_t *reqs = malloc(count * sizeof(breq_t));
+	int numReqs = 0, i, n, ret = 0;
+
+	if (reqs == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i += n) {
+		for (n = 1; i + n < count && n < BREQ_BLOCKS && vec[i + n].blockNumber == vec[i].blockNumber + n; n++);
+		reqs[numReqs].write = write;
+		reqs[numReqs].vec = vec + i;
+		reqs[numReqs].count = n;
+		if (aioSubmit(&reqs[numReqs], AIO_CALLER) < 0) {
+			ret = -1;
+			break;
+		}
+		numReqs++;
+	}
+
+	/* The buffers belong to the caller: wait for every request submitted */
+	for (i = 0; i < numReqs; i++) {
+		while (reqs[i].result == BREQ_PENDING) {
+			if (aioReap() < 0) {
+				free(reqs);
+				return -1;
+			}
+		}
+		if (reqs[i].result < 0) {
+			ret = -1;
+		}
+	}
+
+	free(reqs);
+	return ret;
+}
+
+/*****************/
+/* Entry points. */
+/*****************/
+
+/*
+ * The functions of the interface run their *Locked version with the lock of
+ * the block layer taken.
+ */
+
+int bopen(char *deviceName) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bopenLocked(deviceName);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bclose(void) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bcloseLocked();
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+long bsize(char *deviceName) {
+	pthread_mutex_lock(&blockLock);
+	long ret = bsizeLocked(deviceName);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bread(char *deviceName, int blockNumber, char *buffer) {
+	pthread_mutex_lock(&blockLock);
+	int ret = breadLocked(deviceName, blockNumber, buffer);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int breadpart(char *deviceName, int blockNumber, int offset, int length, char *buffer) {
+	pthread_mutex_lock(&blockLock);
+	int ret = breadpartLocked(deviceName, blockNumber, offset, length, buffer);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bwrite(char *deviceName, int blockNumber, char*buffer) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bwriteLocked(deviceName, blockNumber, buffer);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bwritepart(char *deviceName, int blockNumber, int offset, int length, char *buffer) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bwritepartLocked(deviceName, blockNumber, offset, length, buffer);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int breadv(char *deviceName, bvec_t *vec, int count) {
+	pthread_mutex_lock(&blockLock);
+	int ret = breadvLocked(deviceName, vec, count);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bwritev(char *deviceName, bvec_t *vec, int count) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bwritevLocked(deviceName, vec, count);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+const char *bget(char *deviceName, int blockNumber) {
+	pthread_mutex_lock(&blockLock);
+	const char *ret = bgetLocked(deviceName, blockNumber);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bprefetch(char *deviceName, int *blocks, int count) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bprefetchLocked(deviceName, blocks, count);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int breadahead(char *deviceName, int *blocks, int count) {
+	pthread_mutex_lock(&blockLock);
+	int ret = breadaheadLocked(deviceName, blocks, count);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bflush(char *deviceName) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bflushLocked(deviceName);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bsync(char *deviceName) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bsyncLocked(deviceName);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bsetcache(int numBlocks) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bsetcacheLocked(numBlocks);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bsetqueue(int depth, int engine) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bsetqueueLocked(depth, engine);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bsubmit(char *deviceName, breq_t *req) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bsubmitLocked(deviceName, req);
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+breq_t *bwait(void) {
+	pthread_mutex_lock(&blockLock);
+	breq_t *ret = bwaitLocked();
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
+
+int bwaitall(void) {
+	pthread_mutex_lock(&blockLock);
+	int ret = bwaitallLocked();
+	pthread_mutex_unlock(&blockLock);
+	return ret;
+}
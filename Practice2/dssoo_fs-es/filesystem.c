@@ -6,13 +6,33 @@
  * @date	01/03/2017
  */
 
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
+
 #include "include/filesystem.h" // Headers for the core functionality
-#include "include/auxiliary.h"  // Headers for auxiliary functions
 #include "include/metadata.h"   // Type and structure declaration of the file system
+#include "include/auxiliary.h"  // Headers for auxiliary functions
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <libgen.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Locks are always taken in this order, so that no two threads wait for each other:
+ * descriptor, namespace_lock, inode, files_lock, journal.opLock, and last the
+ * locks of the maps, the journal changes and the block layer.
+ */
+static pthread_once_t locksOnce = PTHREAD_ONCE_INIT;
+static int inodeLocks; /* Entries of inodes_x whose lock is initialised */
+
+static int createFileLocked(char *path);
+static int removeFileLocked(char *path);
+static int mkDirLocked(char *path);
+static int rmDirLocked(char *path);
+static int writeFileLocked(int fileDescriptor, void *buffer, int numBytes);
+static int lseekFileLocked(int fileDescriptor, long offset, int whence);
 
 /*
  * @brief   Implementation of a math.ceil funcion of a division
@@ -27,15 +47,8 @@ int ceilOfDivision (long a, long b) {
  * @return  int with the number of entries that a specific inode has
  */
 int countNumberEntries (int inode_id){
-	int i, count = 0;
-
-	/* We check the number of inodes that have as father the input inode */
-    for (i = 0; i < sblock.numInodes; i++) {
-        if (inodes[i].father == inode_id) {
-            count ++;
-        }
-    }
-	return count;
+	/* The children of every directory are counted as they are linked */
+	return childrenOf(inode_id)->count;
 }
 
 /*
@@ -56,27 +69,46 @@ char * getFather(char * path) {
  */
 int mkFS(long deviceSize)
 {
+	/* Default geometry: MAX_FILES inodes and MAX_ENTRIES entries per directory */
+	geometry_t geometry = {deviceSize, MAX_FILES, 0, MAX_ENTRIES};
+
+	return mkFSGeometry(&geometry);
+}
+
+/*
+ * @brief 	Generates the file system structure in a storage device, with the given geometry.
+ * @return 	0 if success, -1 otherwise.
+ */
+int mkFSGeometry(geometry_t *geometry)
+{
+	long long deviceSize = geometry->deviceSize;
 
 	if (deviceSize < (50 * pow(2,10))){ // Minimum size is 50 KiB
 		fprintf(stderr, "Error in mkFS: device size too small\n");
 		return -1;
 	}
 
-	if (deviceSize > (10 * pow(2,20))){ // Maximum size is 10 MiB
+	if (deviceSize > MAX_DEVICE_SIZE){
 		fprintf(stderr, "Error in mkFS: device size too big\n");
 		return -1;
 	}
 
-	int fd; // Device descriptor
+	/* Either a number of inodes or a number of device bytes per inode */
+	long long numInodes = geometry->numInodes;
+	if (numInodes <= 0 && geometry->bytesPerInode > 0) {
+		numInodes = deviceSize / geometry->bytesPerInode;
+	}
+	if (numInodes <= 0 || numInodes > MAX_INODES || geometry->maxEntries <= 0) {
+		fprintf(stderr, "Error in mkFS: wrong number of inodes or entries per directory\n");
+		return -1;
+	}
 
-	/* Open disk image for read and write */
-    fd = open(DEVICE_IMAGE, O_RDWR);
-    if (fd < 0) {
+	/* Open disk image for read and write, the device keeps it opened */
+    if (bopen(DEVICE_IMAGE) < 0) {
         fprintf(stderr, "Error in mkFS: while opening %s\n", DEVICE_IMAGE);
         return -1;
     }
-    unsigned long diskSize = (unsigned long) lseek(fd, 0, SEEK_END);
-    close(fd);
+    long diskSize = bsize(DEVICE_IMAGE);
 
 	/* Check if the disk size is larger than the input device size */
     if (diskSize < deviceSize) {
@@ -87,17 +119,21 @@ int mkFS(long deviceSize)
 	/* No necesitamos bloque de arranque, por lo que no lo añadimos */
 	int superblocks = 1;
 
-	/* Blocks calculation */
-	int totalBlocks = ceilOfDivision(deviceSize, BLOCK_SIZE); // Maximum number of blocks --> 5120 --> int (already rounded if necessary)
-	int inodeBlocks = ceilOfDivision(sizeof(inode_t)*MAX_FILES, BLOCK_SIZE);
-	int inodeMapBlocks = ceilOfDivision(inodeBlocks, BLOCK_SIZE);
+	/* Blocks calculation, the maps hold one bit per inode or data block */
+	int totalBlocks = ceilOfDivision(deviceSize, BLOCK_SIZE); // Maximum number of blocks --> int (already rounded if necessary)
+	int inodeBlocks = ceilOfDivision(sizeof(inode_t)*numInodes, BLOCK_SIZE);
+	int inodeMapBlocks = ceilOfDivision(numInodes, 8*BLOCK_SIZE);
+
+	/* The journal holds twice the largest transaction: every byte of both maps
+	 * and JOURNAL_BLOCKS / 2 blocks of inodes */
+	int journalBlocks = JOURNAL_BLOCKS + 2 * journalMapBlocks(ceilOfDivision(numInodes, 8) + ceilOfDivision(totalBlocks, 8));
 
-	int dataMapBlocks = ceilOfDivision((totalBlocks-superblocks-inodeBlocks-inodeMapBlocks), BLOCK_SIZE); // Blocks represented per byte
+	int dataMapBlocks = ceilOfDivision((totalBlocks-superblocks-inodeBlocks-inodeMapBlocks-journalBlocks), 8*BLOCK_SIZE);
 
-	// total blocks minus those reserved (boot, superblock) and maps and inodes
-	int dataBlocks = totalBlocks - superblocks - inodeMapBlocks - dataMapBlocks - inodeBlocks;
+	// total blocks minus those reserved (boot, superblock) and maps, inodes and journal
+	int dataBlocks = totalBlocks - superblocks - inodeMapBlocks - dataMapBlocks - inodeBlocks - journalBlocks;
 
-	if (dataBlocks < 0) {
+	if (dataBlocks < 2) { // Data block 0 is reserved
 		fprintf(stderr, "Error in mkFS: not enough space available. Try with a bigger size image!\n");
 		return -1;
 	}
@@ -106,31 +142,63 @@ int mkFS(long deviceSize)
 	sblock.magicNumber = MAGIC_NUMBER; // Magic number --> 0x000D5500
 	sblock.numINodeMapBlocks = inodeMapBlocks; // Number of blocks of inode map
 	sblock.numDataMapBlocks = dataMapBlocks; // Number of blocks of data map
-	sblock.numInodes = MAX_FILES; // 1 inode per file
+	sblock.numInodes = numInodes; // 1 inode per file
+	sblock.maxEntries = geometry->maxEntries;
 	sblock.firstInodeBlock = superblocks + inodeMapBlocks + dataMapBlocks;
 	sblock.numDataBlocks = dataBlocks;
-	sblock.firstDataBlock = superblocks + inodeMapBlocks + dataMapBlocks + inodeBlocks;
+	sblock.firstJournalBlock = superblocks + inodeMapBlocks + dataMapBlocks + inodeBlocks;
+	sblock.numJournalBlocks = journalBlocks;
+	sblock.journalHead = 0; // Empty journal
+	sblock.journalSequence = 1;
+	sblock.inodeHint = 0;
+	sblock.dataHint = NULL_BLOCK + 1;
+	sblock.firstDataBlock = superblocks + inodeMapBlocks + dataMapBlocks + inodeBlocks + journalBlocks;
 	sblock.deviceSize = deviceSize;
 	memset(sblock.padding, '0', sizeof(sblock.padding)); // Fill with '0' remaining space after substracting busy space (size in metadata.h)
 
 	int i;
 
-	 /* Allocate space in memory for inodes map and initialize its elements to 0 */
-	i_map = (char *) malloc(sblock.numINodeMapBlocks*BLOCK_SIZE); /* Bits allocation */
-    for (i = 0; i < sblock.numInodes; i++) {
-        bitmap_setbit(i_map, i, 0); // Set bit i inside i_map
+	/* Allocate space in memory for the maps and tables of this geometry */
+    if (tablesAlloc() < 0) {
+        fprintf(stderr, "Error in mkFS: not enough memory for the metadata\n");
+        return -1;
     }
 
-	/* Allocate space in memory for data blocks map and initialize its elements to 0 */
-    b_map = (char *) malloc(sblock.numDataMapBlocks*BLOCK_SIZE);
-    for (i = 0; i < sblock.numDataBlocks; i++) {
-        bitmap_setbit(b_map, i, 0); // Set bit i inside b_map
+	/* Initialize the maps and the array of iNodes to 0 */
+    memset(i_map, 0, sblock.numINodeMapBlocks*BLOCK_SIZE);
+    memset(b_map, 0, sblock.numDataMapBlocks*BLOCK_SIZE);
+    bitmap_setbit(b_map, 0, 1); // Data block 0 is never allocated, a zero pointer means no block
+    bitmapCount();
+    memset(inodes, 0, sblock.numInodes * sizeof(inode_t));
+
+    /* Every metadata block is new, so all of them must be written */
+    sblock_dirty = 1;
+    memset(i_map_dirty, 1, sblock.numINodeMapBlocks);
+    memset(b_map_dirty, 1, sblock.numDataMapBlocks);
+    memset(inodes_dirty, 1, INODE_BLOCKS);
+
+    /* Clear the journal, so that no old transaction is replayed */
+    char zero[BLOCK_SIZE];
+    bvec_t *journalVec = malloc(sblock.numJournalBlocks * sizeof(bvec_t));
+    memset(zero, 0, BLOCK_SIZE);
+    for (i = 0; journalVec != NULL && i < sblock.numJournalBlocks; i++) {
+        journalVec[i].blockNumber = sblock.firstJournalBlock + i;
+        journalVec[i].buffer = zero;
     }
+    if (journalVec == NULL || bwritev(DEVICE_IMAGE, journalVec, sblock.numJournalBlocks) < 0) {
+        fprintf(stderr, "Error in mkFS: failed to clear the journal\n");
+        free(journalVec);
+        return -1;
+    }
+    free(journalVec);
+    journalReset();
 
-    /* Initialize array of iNodes to 0 */
-    for (i = 0; i < sblock.numInodes; i++) {
-        memset(&(inodes[i]), 0, sizeof(inode_t));
+    /* No file exists yet */
+    if (nameiBuild() < 0) {
+        fprintf(stderr, "Error in mkFS: not enough memory for the path index\n");
+        return -1;
     }
+    childrenBuild();
 
     /* Call syncFS() to write data in memory to the disk image */
     if (syncFS() < 0) {
@@ -141,42 +209,135 @@ int mkFS(long deviceSize)
 	return 0;
 }
 
+/*
+ * @brief   Initialises the locks not tied to the geometry of the device, once
+ */
+static void locksInit(void) {
+    pthread_rwlockattr_t attr;
+    int i;
+
+    pthread_rwlock_init(&namespace_lock, NULL);
+    pthread_mutex_init(&files_lock, NULL);
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_init(&files[i].lock, NULL);
+    }
+    pthread_mutex_init(&i_map_lock, NULL);
+    pthread_mutex_init(&b_map_lock, NULL);
+    pthread_mutex_init(&journal.lock, NULL);
+
+    /* A commit waiting for the operations in progress goes before the new ones */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&journal.opLock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+/*
+ * @brief   Sizes the maps, the inodes tables and their dirty flags for the geometry
+ *          in the superblock. No file is opened afterwards.
+ * @return  0 if success, -1 if there is not enough memory
+ */
+int tablesAlloc(void) {
+    int i;
+
+    pthread_once(&locksOnce, locksInit);
+    for (i = 0; i < inodeLocks; i++) {
+        pthread_rwlock_destroy(&inodes_x[i].lock);
+    }
+    inodeLocks = 0;
+
+    i_map = (char *) realloc(i_map, sblock.numINodeMapBlocks*BLOCK_SIZE);
+    b_map = (char *) realloc(b_map, sblock.numDataMapBlocks*BLOCK_SIZE);
+    i_map_dirty = (char *) realloc(i_map_dirty, sblock.numINodeMapBlocks);
+    b_map_dirty = (char *) realloc(b_map_dirty, sblock.numDataMapBlocks);
+    inodes = (inode_t *) realloc(inodes, INODE_BLOCKS * BLOCK_SIZE); // Whole blocks, read and written in place
+    inodes_dirty = (char *) realloc(inodes_dirty, INODE_BLOCKS);
+    inodes_x = (inode_x_t *) realloc(inodes_x, sblock.numInodes * sizeof(inode_x_t));
+    journal.inodeLogged = (char *) realloc(journal.inodeLogged, sblock.numInodes);
+    journal.imapLogged = (char *) realloc(journal.imapLogged, sblock.numINodeMapBlocks*BLOCK_SIZE);
+    journal.bmapLogged = (char *) realloc(journal.bmapLogged, sblock.numDataMapBlocks*BLOCK_SIZE);
+    if (i_map == NULL || b_map == NULL || i_map_dirty == NULL || b_map_dirty == NULL
+        || inodes == NULL || inodes_dirty == NULL || inodes_x == NULL || journal.inodeLogged == NULL
+        || journal.imapLogged == NULL || journal.bmapLogged == NULL) {
+        return -1;
+    }
+
+    memset((char *) inodes + sblock.numInodes * sizeof(inode_t), 0, INODE_BLOCKS * BLOCK_SIZE - sblock.numInodes * sizeof(inode_t));
+    memset(inodes_x, 0, sblock.numInodes * sizeof(inode_x_t));
+    for (i = 0; i < sblock.numInodes; i++) {
+        pthread_rwlock_init(&inodes_x[i].lock, NULL);
+    }
+    inodeLocks = sblock.numInodes;
+    journal.numChanges = 0; // Their flags are cleared here, for the new geometry
+    memset(journal.inodeLogged, 0, sblock.numInodes);
+    memset(journal.imapLogged, 0, sblock.numINodeMapBlocks*BLOCK_SIZE);
+    memset(journal.bmapLogged, 0, sblock.numDataMapBlocks*BLOCK_SIZE);
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        free(files[i].buffer);
+        files[i].buffer = NULL;
+        files[i].bufferBytes = 0;
+        files[i].opened = 0;
+    }
+    return 0;
+}
+
 /*
  * @brief 	Mounts a file system in the simulated device.
  * @return 	0 if success, -1 otherwise.
  */
 int mountFS(void)
 {
+    /* Open disk image once, every block access of the mounted FS reuses it */
+    if (bopen(DEVICE_IMAGE) < 0) {
+        fprintf(stderr, "Error in mountFS: while opening %s\n", DEVICE_IMAGE);
+        return -1;
+    }
+
     /* Read superblock (disk block 0) and store it into sblock */
     if (bread(DEVICE_IMAGE, 0, (char *) &sblock) < 0) {
         fprintf(stderr, "Error in mountFS: superblock cannot be read\n");
         return -1;
     }
 
-	int i;
-    /* Read from disk inode map */
-    for (i = 0; i < sblock.numINodeMapBlocks; i++) {
-        if (bread(DEVICE_IMAGE, 1 + i, ((char *) i_map + i * BLOCK_SIZE)) < 0) {
-            fprintf(stderr, "Error in mountFS: can't read inodes map\n");
-            return -1;
-        }
+    /* Allocate maps, tables and dirty flags for the geometry of the device */
+    if (sblock.magicNumber != MAGIC_NUMBER || tablesAlloc() < 0) {
+        fprintf(stderr, "Error in mountFS: no file system or not enough memory for its metadata\n");
+        return -1;
     }
 
-    /* Read disk block map */
-    for (i = 0; i < sblock.numDataMapBlocks; i++) {
-        if (bread(DEVICE_IMAGE, 1 + i + sblock.numINodeMapBlocks, ((char *) b_map + i * BLOCK_SIZE)) < 0) {
-            fprintf(stderr, "Error in mountFS: can't read data block map\n");
-            return -1;
-        }
+    /* Memory and disk hold the same metadata right after mounting */
+    sblock_dirty = 0;
+    memset(i_map_dirty, 0, sblock.numINodeMapBlocks);
+    memset(b_map_dirty, 0, sblock.numDataMapBlocks);
+    memset(inodes_dirty, 0, INODE_BLOCKS);
+
+    /* Read the inode map, the block map and the inodes, contiguous on the disk, at once */
+    bvec_t *vec = malloc(metadataBlocks(NULL, 0) * sizeof(bvec_t));
+    if (vec == NULL || breadv(DEVICE_IMAGE, vec, metadataBlocks(vec, 0)) < 0) {
+        fprintf(stderr, "Error in mountFS: can't read the maps and iNodes\n");
+        free(vec);
+        return -1;
     }
+    free(vec);
 
-    /* Read inodes from disk */
-    for (i = 0; i < ceilOfDivision(sblock.numInodes * sizeof(inode_t), BLOCK_SIZE); i++) {
-        if (bread(DEVICE_IMAGE, i + sblock.firstInodeBlock, ((char *) inodes + i * BLOCK_SIZE)) < 0) {
-            fprintf(stderr, "Error in mountFS: can't read iNodes\n");
-            return -1;
-        }
+    /* Apply the transactions committed to the journal but not checkpointed */
+    journalReset();
+    if (journal.maxInodes < JOURNAL_OP_INODES) {
+        fprintf(stderr, "Error in mountFS: the journal is too small for the file system\n");
+        return -1;
     }
+    if (journalReplay() < 0) {
+        fprintf(stderr, "Error in mountFS: can't replay the journal\n");
+        return -1;
+    }
+    bitmapCount();
+
+    /* Index the paths of the files and directories */
+    if (nameiBuild() < 0) {
+        fprintf(stderr, "Error in mountFS: not enough memory for the path index\n");
+        return -1;
+    }
+    childrenBuild();
 
     return 0;
 }
@@ -191,7 +352,7 @@ int unmountFS(void)
 
     /* Check if any file still opened */
     for (i = 0; i < sblock.numInodes; i++) {
-        if (inodes_x[i].opened == 1) {
+        if (inodes_x[i].opened != 0) {
             fprintf(stderr, "Error in unmountFS: file %s is opened\n", inodes[i].name);
             return -1;
         }
@@ -203,14 +364,34 @@ int unmountFS(void)
         return -1;
     }
 
+    /* Release the disk image */
+    if (bclose() < 0) {
+        fprintf(stderr, "Error in unmountFS: failed to close %s\n", DEVICE_IMAGE);
+        return -1;
+    }
+
     return 0;
 }
 
 /*
  * @brief	Creates a new file, provided that it doesn't exist in the file system.
+ *          The names are changed one at a time, with namespace_lock taken.
  * @return	0 if success, -1 if the file already exists, -2 in case of error.
  */
 int createFile(char *path)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	int ret = createFileLocked(path);
+	pthread_rwlock_unlock(&namespace_lock);
+
+	return ret;
+}
+
+/*
+ * @brief	Creates a new file, with namespace_lock taken.
+ * @return	0 if success, -1 if the file already exists, -2 in case of error.
+ */
+static int createFileLocked(char *path)
 {
 	/* Validate input path */
 	if (path == NULL)
@@ -273,26 +454,34 @@ int createFile(char *path)
 				return -2;
 			}
 
-			if (countNumberEntries(father_inode_id) >= MAX_ENTRIES) {
+			if (countNumberEntries(father_inode_id) >= sblock.maxEntries) {
 				fprintf(stderr, "Error in createFile: directory is full\n");
 				return -2;
 			}
 	}
 
 	// Allocate space for file
+	if (journalBegin() < 0) {
+		fprintf(stderr, "Error in createFile: failed to write data to the disk image\n");
+		return -2;
+	}
 	inode_id = ialloc(); // Returns id of available inode
 
 	if (inode_id < 0)
 	{
 		fprintf(stderr, "Error in createFile: no inodes available\n");
+		journalEnd();
 		return -2;
 	}
 
-	int b_id = alloc();
+	/* The block is not written until data arrives, reads stop at the size of the file */
+	int got;
+	int b_id = allocRun(0, 1, &got);
 
 	if (b_id < 0)
 	{
 		fprintf(stderr, "Error in createFile: no data blocks available\n");
+		journalEnd();
 		return -2;
 	}
 
@@ -300,13 +489,18 @@ int createFile(char *path)
 	inodes[inode_id].father = father_inode_id; // Inode_id of the father inode
 	inodes[inode_id].type = TYPE_FILE; // Inode points to a file
 	strcpy(inodes[inode_id].name, path);
-	inodes[inode_id].dataBlockPos = b_id;
-	inodes[inode_id].size = MAX_FILE_SIZE;
-	inodes_x[inode_id].position = 0;
+	inodes[inode_id].extents[0].start = b_id;
+	inodes[inode_id].extents[0].length = 1;
+	inodes[inode_id].numExtents = 1;
+	inodes[inode_id].numBlocks = 1;
+	inodes[inode_id].size = 0;
 	inodes_x[inode_id].opened = 0;
+	nameiInsert(inode_id);
+	childLink(inode_id);
+	markInode(inode_id);
 
-	/* Call syncFS() to write data in memory to the disk image */
-    if (syncFS() < 0) {
+	/* Log the changes in the journal, committed together with other operations */
+    if (journalEnd() < 0) {
         fprintf(stderr, "Error in createFile: failed to write data to the disk image\n");
         return -2;
     }
@@ -319,6 +513,19 @@ int createFile(char *path)
  * @return	0 if success, -1 if the file does not exist, -2 in case of error..
  */
 int removeFile(char *path)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	int ret = removeFileLocked(path);
+	pthread_rwlock_unlock(&namespace_lock);
+
+	return ret;
+}
+
+/*
+ * @brief	Deletes a file, with namespace_lock taken.
+ * @return	0 if success, -1 if the file does not exist, -2 in case of error..
+ */
+static int removeFileLocked(char *path)
 {
 
 	/* Validate input path */
@@ -341,27 +548,41 @@ int removeFile(char *path)
 		return -2;
 	}
 
-	/* Check if file is opened */
+	/* Check if file is opened, openFile takes the lock of the file to open it */
+	pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
 	if (inodes_x[inode_id].opened != 0) {
+		pthread_rwlock_unlock(&inodes_x[inode_id].lock);
 		fprintf(stderr, "Error in removeFile: file is opened!\n");
 		return -2;
 	}
 
-	if (bfree(inodes[inode_id].dataBlockPos) < 0) { // Free data block
+	if (journalBegin() < 0) {
+		pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+		fprintf(stderr, "Error in removeFile: failed to write data to the disk image\n");
+		return -2;
+	}
+	if (freeBlocks(inode_id) < 0) { // Free data blocks
+		journalEnd();
+		pthread_rwlock_unlock(&inodes_x[inode_id].lock);
 		fprintf(stderr, "Error in removeFile: bfree operation could not be completed\n");
 		return -2;
 	}
 
 	/* Free data */
+	nameiRemove(inode_id);
+	childUnlink(inode_id);
 	memset(&(inodes[inode_id]), 0, sizeof(inode_t));
+	markInode(inode_id);
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
 
 	if (ifree(inode_id) < 0) { // Free data block
+		journalEnd();
 		fprintf(stderr, "Error in removeFile: ifree operation could not be completed\n");
 		return -2;
 	}
 
-	/* Call syncFS() to write data in memory to the disk image */
-    if (syncFS() < 0) {
+	/* Log the changes in the journal, committed together with other operations */
+    if (journalEnd() < 0) {
         fprintf(stderr, "Error in removeFile: failed to write data to the disk image\n");
         return -2;
     }
@@ -371,10 +592,18 @@ int removeFile(char *path)
 
 
 /*
- * @brief	Opens an existing file.
+ * @brief	Opens an existing file for reading and writing.
  * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
  */
 int openFile(char *path){
+	return openFileMode(path, FS_OPEN_RDWR);
+}
+
+/*
+ * @brief	Opens an existing file for reading, writing or both.
+ * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
+ */
+int openFileMode(char *path, int mode){
 
 	/* Validate input path */
 	if (path == NULL) {
@@ -382,11 +611,20 @@ int openFile(char *path){
         return -1;
 	}
 
-	/* Check if inode exists */
+	/* Validate mode */
+	if (mode == 0 || (mode & ~FS_OPEN_RDWR) != 0) {
+		fprintf(stderr, "Error in openFile: wrong mode\n");
+		return -2;
+	}
+
+	/* Check if inode exists. Files are opened at the same time, but not
+	 * while a name is added or removed */
+	pthread_rwlock_rdlock(&namespace_lock);
 	int inode_id = namei(path);
 
 	if (inode_id < 0)
 	{
+		pthread_rwlock_unlock(&namespace_lock);
 		fprintf(stderr, "Error in openFile: file does not exist\n");
 		return -1;
 	}
@@ -394,22 +632,40 @@ int openFile(char *path){
 	/* Check if inode is a file */
 	if (inodes[inode_id].type != TYPE_FILE)
 	{
+		pthread_rwlock_unlock(&namespace_lock);
 		fprintf(stderr, "Error openFile: not a file\n");
 		return -2;
 	}
+	pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
+	pthread_rwlock_unlock(&namespace_lock);
 
-	/* Check if file is opened */
-	if (inodes_x[inode_id].opened != 0)
+	/* Look for a free descriptor, a file may be opened many times */
+	int fd;
+	pthread_mutex_lock(&files_lock);
+	for (fd = 0; fd < MAX_OPEN_FILES && files[fd].opened != 0; fd++);
+
+	if (fd == MAX_OPEN_FILES)
 	{
-		fprintf(stderr, "Error openFile: file is already opened!\n");
+		pthread_mutex_unlock(&files_lock);
+		pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+		fprintf(stderr, "Error openFile: too many open files!\n");
 		return -2;
 	}
 
 	/* Open it */
-	inodes_x[inode_id].position = 0;
-	inodes_x[inode_id].opened = 1;
-
-	return inode_id;
+	files[fd].opened = 1;
+	files[fd].inode = inode_id;
+	files[fd].mode = mode;
+	files[fd].position = 0;
+	files[fd].raNext = 0;
+	files[fd].raWindow = 0;
+	files[fd].raEnd = 0;
+	files[fd].bufferBytes = 0;
+	pthread_mutex_unlock(&files_lock);
+	inodes_x[inode_id].opened++;
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+
+	return fd;
 
 }
 
@@ -420,30 +676,40 @@ int openFile(char *path){
 int closeFile(int fileDescriptor)
 {
 	/* Validate file descriptor */
-	if (fileDescriptor >= sblock.numInodes || fileDescriptor < 0) {
+	if (fileDescriptor >= MAX_OPEN_FILES || fileDescriptor < 0) {
         fprintf(stderr, "Error in closeFile: wrong file descriptor\n");
         return -1;
     }
 
-	/* Check if inode is a file */
-	if (inodes[fileDescriptor].type != TYPE_FILE)
-	{
-		fprintf(stderr, "Error closeFile: not a file\n");
-		return -1;
-	}
-
 	/* Check if file is opened */
-	if (inodes_x[fileDescriptor].opened == 0)
+	pthread_mutex_lock(&files[fileDescriptor].lock);
+	if (files[fileDescriptor].opened == 0)
 	{
+		pthread_mutex_unlock(&files[fileDescriptor].lock);
 		fprintf(stderr, "Error closeFile: file is not opened!\n");
 		return -1;
 	}
+	int inode_id = files[fileDescriptor].inode;
+
+	/* Write the bytes gathered in the buffer, the file is closed anyway */
+	pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
+	int ret = bufferFlush(fileDescriptor);
+	free(files[fileDescriptor].buffer);
+	files[fileDescriptor].buffer = NULL;
+	if (ret < 0) {
+		fprintf(stderr, "Error closeFile: failed to write data to the disk image\n");
+	}
 
 	/* Close file */
-    inodes_x[fileDescriptor].position = 0; /* Set seek descriptor to begin */
-    inodes_x[fileDescriptor].opened = 0;  /* Set file state to closed */
-
-    return 0;
+    files[fileDescriptor].position = 0; /* Set seek descriptor to begin */
+    pthread_mutex_lock(&files_lock);
+    files[fileDescriptor].opened = 0;  /* Set descriptor state to free */
+    pthread_mutex_unlock(&files_lock);
+    inodes_x[inode_id].opened--;
+    pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+    pthread_mutex_unlock(&files[fileDescriptor].lock);
+
+    return ret;
 }
 
 /*
@@ -453,60 +719,38 @@ int closeFile(int fileDescriptor)
 int readFile(int fileDescriptor, void *buffer, int numBytes)
 {
 	/* Validate file descriptor */
-	if (fileDescriptor >= sblock.numInodes || fileDescriptor < 0) {
+	if (fileDescriptor >= MAX_OPEN_FILES || fileDescriptor < 0) {
 		fprintf(stderr, "Error in readFile: wrong file descriptor\n");
 		return -1;
 	}
 
-	/* Check if inode is a file */
-	if (inodes[fileDescriptor].type != TYPE_FILE) {
-      fprintf(stderr, "Error in readFile: not a file\n");
-      return -1;
-    }
-
-	/* Check if file is opened */
-	if (inodes_x[fileDescriptor].opened == 0) {
+	/* Check if file is opened for reading */
+	pthread_mutex_lock(&files[fileDescriptor].lock);
+	if (files[fileDescriptor].opened == 0 || (files[fileDescriptor].mode & FS_OPEN_READ) == 0) {
+      pthread_mutex_unlock(&files[fileDescriptor].lock);
       fprintf(stderr, "Error in readFile: file not opened\n");
       return -1;
     }
+	int inode_id = files[fileDescriptor].inode;
 
-	char b[BLOCK_SIZE] ;
-	int b_id;
-
-	/* If number of bytes to read surpasses the file size, read until EOF */
-	if (inodes_x[fileDescriptor].position + numBytes > inodes[fileDescriptor].size) {
-		numBytes = inodes[fileDescriptor].size - inodes_x[fileDescriptor].position;
-	}
-	if (numBytes < 0) {
-		fprintf(stderr, "Error in readFile: Segmentation fault\n");
+	/* The bytes gathered in the buffers of the file are read from it */
+	if (fileLockRead(inode_id) < 0) {
+		pthread_mutex_unlock(&files[fileDescriptor].lock);
+		fprintf(stderr, "Error in readFile: failed to write data to the disk image\n");
 		return -1;
 	}
 
-	/* In this case, the seek pointer is located at EOF, so no bytes can be read */
-    if (numBytes == 0) {
-        return 0;
-    }
-
-	/* Get the number of block of file */
-	b_id = bmap(fileDescriptor, inodes_x[fileDescriptor].position);
-
-	if (b_id < 0) {
-		fprintf(stderr, "Error in readFile: error coming from bmap, could not allocate a data block\n");
-		return -1;
-	}
+	int done = fileRead(inode_id, files[fileDescriptor].position, buffer, numBytes);
+	if (done >= 0) {
+		readAhead(fileDescriptor, files[fileDescriptor].position, done);
 
-	/* Read block */
-	if (bread(DEVICE_IMAGE, sblock.firstDataBlock+b_id, b) < 0) {
-		fprintf(stderr, "Error in readFile: can't read data block\n");
-		return -1;
+		/* Increase file pointer */
+		files[fileDescriptor].position += done;
 	}
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+	pthread_mutex_unlock(&files[fileDescriptor].lock);
 
-	/* Write to buffer and increase file pointer */
-	memmove(buffer, b+inodes_x[fileDescriptor].position, numBytes);
-
-	inodes_x[fileDescriptor].position += strlen(buffer);
-
-	return strlen(buffer);
+	return done;
 }
 
 /*
@@ -516,71 +760,184 @@ int readFile(int fileDescriptor, void *buffer, int numBytes)
 int writeFile(int fileDescriptor, void *buffer, int numBytes)
 {
 	/* Validate file descriptor */
-	if (fileDescriptor >= sblock.numInodes || fileDescriptor < 0) {
+	if (fileDescriptor >= MAX_OPEN_FILES || fileDescriptor < 0) {
 		fprintf(stderr, "Error in writeFile: wrong file descriptor\n");
 		return -1;
 	}
 
-	/* Check if inode is a file */
-	if (inodes[fileDescriptor].type != TYPE_FILE) {
-      fprintf(stderr, "Error in writeFile: not a file\n");
-      return -1;
-    }
-
-	/* Check if file is opened */
-	if (inodes_x[fileDescriptor].opened == 0) {
+	/* Check if file is opened for writing */
+	pthread_mutex_lock(&files[fileDescriptor].lock);
+	if (files[fileDescriptor].opened == 0 || (files[fileDescriptor].mode & FS_OPEN_WRITE) == 0) {
+      pthread_mutex_unlock(&files[fileDescriptor].lock);
       fprintf(stderr, "Error in writeFile: file not opened\n");
       return -1;
     }
 
-	char b[BLOCK_SIZE] ;
-	int b_id;
+	int inode_id = files[fileDescriptor].inode;
+	pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
+	int done = writeFileLocked(fileDescriptor, buffer, numBytes);
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+	pthread_mutex_unlock(&files[fileDescriptor].lock);
 
-	/* If len of buffer is less than numBytes, decrease this number to len of buffer */
-	if (strlen(buffer) < numBytes) {
-		numBytes = strlen(buffer);
-	}
+	return done;
+}
 
-	/* If number of bytes to read surpasses the file size, write until EOF */
-	if (inodes_x[fileDescriptor].position + numBytes > inodes[fileDescriptor].size) {
-		numBytes = inodes[fileDescriptor].size - inodes_x[fileDescriptor].position;
+/*
+ * @brief	Writes a number of bytes into an open file, with the locks of the
+ *          descriptor and the file taken.
+ * @return	Number of bytes properly written, -1 in case of error.
+ */
+static int writeFileLocked(int fileDescriptor, void *buffer, int numBytes)
+{
+	/* The file grows with the writes past its end, up to the maximum file size */
+	if (files[fileDescriptor].position + numBytes > MAX_FILE_SIZE) {
+		numBytes = MAX_FILE_SIZE - files[fileDescriptor].position;
 	}
 	if (numBytes < 0) {
 		fprintf(stderr, "Error in writeFile: Segmentation fault\n");
 		return -1;
 	}
 
-	/* In this case, the seek pointer is located at EOF, so no bytes can be read */
+	/* In this case, the seek pointer is located at the maximum size, so no bytes can be written */
     if (numBytes == 0) {
         return 0;
     }
 
-	/* Get the number of block of file */
-	b_id = bmap(fileDescriptor, inodes_x[fileDescriptor].position);
+	/* The bytes gathered by the other descriptors of the file go first, this write may cover them */
+	if (bufferFlushInode(files[fileDescriptor].inode, fileDescriptor) < 0) {
+		fprintf(stderr, "Error in writeFile: failed to write data to the disk image\n");
+		return -1;
+	}
+
+	/* Writes smaller than a block are gathered in the buffer of the descriptor */
+	int done;
+	if (numBytes < BLOCK_SIZE) {
+		done = bufferWrite(fileDescriptor, buffer, numBytes);
+	} else if (bufferFlush(fileDescriptor) < 0) {
+		done = -1;
+	} else {
+		done = fileWrite(files[fileDescriptor].inode, files[fileDescriptor].position, buffer, numBytes);
+	}
+	if (done < 0) {
+		fprintf(stderr, "Error in writeFile: failed to write data to the disk image\n");
+		return -1;
+	}
+
+	/* Increase file pointer */
+	files[fileDescriptor].position += done;
+
+	return done;
+}
+
+/*
+ * @brief	Reads a number of bytes from an offset of a file, without moving its seek pointer.
+ * @return	Number of bytes properly read, -1 in case of error.
+ */
+int readAt(int fileDescriptor, void *buffer, int numBytes, long offset)
+{
+	/* Validate file descriptor */
+	if (fileDescriptor >= MAX_OPEN_FILES || fileDescriptor < 0) {
+		fprintf(stderr, "Error in readAt: wrong file descriptor\n");
+		return -1;
+	}
+
+	/* Check if file is opened for reading */
+	pthread_mutex_lock(&files[fileDescriptor].lock);
+	if (files[fileDescriptor].opened == 0 || (files[fileDescriptor].mode & FS_OPEN_READ) == 0) {
+      pthread_mutex_unlock(&files[fileDescriptor].lock);
+      fprintf(stderr, "Error in readAt: file not opened\n");
+      return -1;
+    }
+	int inode_id = files[fileDescriptor].inode;
 
-	if (b_id < 0) {
-		fprintf(stderr, "Error in writeFile: error coming from bmap, could not allocate a data block\n");
+	/* The bytes gathered in the buffers of the file are read from it */
+	if (fileLockRead(inode_id) < 0) {
+		pthread_mutex_unlock(&files[fileDescriptor].lock);
+		fprintf(stderr, "Error in readAt: failed to write data to the disk image\n");
 		return -1;
 	}
 
-	/* Read block */
-	if (bread(DEVICE_IMAGE, sblock.firstDataBlock+b_id, b) < 0) {
-		fprintf(stderr, "Error in writeFile: can't read data block\n");
+	int done = -1;
+	if (offset < 0 || offset > inodes[inode_id].size) {
+		fprintf(stderr, "Error in readAt: offset out of the file\n");
+	} else if ((done = fileRead(inode_id, offset, buffer, numBytes)) >= 0) {
+		readAhead(fileDescriptor, offset, done);
+	}
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+	pthread_mutex_unlock(&files[fileDescriptor].lock);
+
+	return done;
+}
+
+/*
+ * @brief	Writes a number of bytes from a buffer at an offset of a file, without moving its seek pointer.
+ * @return	Number of bytes properly written, -1 in case of error.
+ */
+int writeAt(int fileDescriptor, void *buffer, int numBytes, long offset)
+{
+	/* Validate file descriptor */
+	if (fileDescriptor >= MAX_OPEN_FILES || fileDescriptor < 0) {
+		fprintf(stderr, "Error in writeAt: wrong file descriptor\n");
 		return -1;
 	}
 
-	/* Write into buffer */
-	memmove(b+inodes_x[fileDescriptor].position, buffer, numBytes);
+	/* Check if file is opened for writing */
+	pthread_mutex_lock(&files[fileDescriptor].lock);
+	if (files[fileDescriptor].opened == 0 || (files[fileDescriptor].mode & FS_OPEN_WRITE) == 0) {
+      pthread_mutex_unlock(&files[fileDescriptor].lock);
+      fprintf(stderr, "Error in writeAt: file not opened\n");
+      return -1;
+    }
+	int inode_id = files[fileDescriptor].inode;
+	int done = -1;
+
+	/* The bytes gathered in the buffers of the file go first, this write may cover them */
+	pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
+	if (bufferFlushInode(inode_id, -1) < 0) {
+		fprintf(stderr, "Error in writeAt: failed to write data to the disk image\n");
+	} else if (offset < 0 || offset > inodes[inode_id].size) {
+		/* The file has no holes: a write starts at most at its end */
+		fprintf(stderr, "Error in writeAt: offset out of the file\n");
+	} else if ((done = fileWrite(inode_id, offset, buffer, numBytes)) < 0) {
+		fprintf(stderr, "Error in writeAt: failed to write data to the disk image\n");
+	}
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+	pthread_mutex_unlock(&files[fileDescriptor].lock);
+
+	return done;
+}
 
-	/* Write block and increase file pointer*/
-	if (bwrite(DEVICE_IMAGE, sblock.firstDataBlock+b_id, b) < 0) {
-		fprintf(stderr, "Error in writeFile: can't write data block\n");
+/*
+ * @brief	Writes the bytes gathered in the buffer of an open file.
+ * @return	0 if success, -1 in case of error.
+ */
+int flushFile(int fileDescriptor)
+{
+	/* Validate file descriptor */
+	if (fileDescriptor >= MAX_OPEN_FILES || fileDescriptor < 0) {
+		fprintf(stderr, "Error in flushFile: wrong file descriptor\n");
 		return -1;
 	}
 
-	inodes_x[fileDescriptor].position += numBytes;
+	/* Check if file is opened */
+	pthread_mutex_lock(&files[fileDescriptor].lock);
+	if (files[fileDescriptor].opened == 0) {
+      pthread_mutex_unlock(&files[fileDescriptor].lock);
+      fprintf(stderr, "Error in flushFile: file not opened\n");
+      return -1;
+    }
+	int inode_id = files[fileDescriptor].inode;
+
+	pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
+	int ret = bufferFlush(fileDescriptor);
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+	pthread_mutex_unlock(&files[fileDescriptor].lock);
+	if (ret < 0) {
+		fprintf(stderr, "Error in flushFile: failed to write data to the disk image\n");
+		return -1;
+	}
 
-	return numBytes;
+	return 0;
 }
 
 /*
@@ -590,46 +947,67 @@ int writeFile(int fileDescriptor, void *buffer, int numBytes)
 int lseekFile(int fileDescriptor, long offset, int whence)
 {
 	/* Validate file descriptor */
-	if (fileDescriptor >= sblock.numInodes || fileDescriptor < 0) {
+	if (fileDescriptor >= MAX_OPEN_FILES || fileDescriptor < 0) {
 		fprintf(stderr, "Error in lseekFile: wrong file descriptor\n");
 		return -1;
 	}
 
-	/* Check if inode is a file */
-	if (inodes[fileDescriptor].type != TYPE_FILE) {
-      fprintf(stderr, "Error in lseekFile: not a file\n");
-      return -1;
-    }
-
 	/* Check if file is opened */
-	if (inodes_x[fileDescriptor].opened == 0) {
+	pthread_mutex_lock(&files[fileDescriptor].lock);
+	if (files[fileDescriptor].opened == 0) {
+      pthread_mutex_unlock(&files[fileDescriptor].lock);
       fprintf(stderr, "Error in lseekFile: file not opened\n");
       return -1;
     }
 
+	int inode_id = files[fileDescriptor].inode;
+	pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
+	int ret = lseekFileLocked(fileDescriptor, offset, whence);
+	pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+	pthread_mutex_unlock(&files[fileDescriptor].lock);
+
+	return ret;
+}
+
+/*
+ * @brief	Modifies the position of the seek pointer of an open file, with the
+ *          locks of the descriptor and the file taken.
+ * @return	0 if succes, -1 otherwise.
+ */
+static int lseekFileLocked(int fileDescriptor, long offset, int whence)
+{
+	/* The bytes gathered in the buffers of the file are written before moving
+	 * away from them, and the size counts them */
+	if (bufferFlushInode(files[fileDescriptor].inode, -1) < 0) {
+		fprintf(stderr, "Error in lseekFile: failed to write data to the disk image\n");
+		return -1;
+	}
+
+	int size = inodes[files[fileDescriptor].inode].size;
+
 	/* Whence begin -> file pointer to beginning */
 	if (whence == FS_SEEK_BEGIN){
-		inodes_x[fileDescriptor].position = 0;
+		files[fileDescriptor].position = 0;
 		return 0;
 	}
 
 	/* Whence end -> file pointer to end */
 	if (whence == FS_SEEK_END) {
-		inodes_x[fileDescriptor].position = inodes[fileDescriptor].size;
+		files[fileDescriptor].position = size;
 		return 0;
 	}
 
 	/* Whence cur -> add offset */
 	if (whence == FS_SEEK_CUR){
-		if (inodes_x[fileDescriptor].position + offset > inodes[fileDescriptor].size) {
+		if (files[fileDescriptor].position + offset > size) {
 			fprintf(stderr, "Error in lseekFile: Te has pasado por alante\n");
 			return -1;
 		}
-		if (inodes_x[fileDescriptor].position + offset < 0) {
+		if (files[fileDescriptor].position + offset < 0) {
 			fprintf(stderr, "Error in lseekFile: Te has pasado por atras\n");
 			return -1;
 		}
-		inodes_x[fileDescriptor].position += offset;
+		files[fileDescriptor].position += offset;
 		return 0;
 	}
 
@@ -643,6 +1021,19 @@ int lseekFile(int fileDescriptor, long offset, int whence)
  * @return	0 if success, -1 if the directory already exists, -2 in case of error.
  */
 int mkDir(char *path)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	int ret = mkDirLocked(path);
+	pthread_rwlock_unlock(&namespace_lock);
+
+	return ret;
+}
+
+/*
+ * @brief	Creates a new directory, with namespace_lock taken.
+ * @return	0 if success, -1 if the directory already exists, -2 in case of error.
+ */
+static int mkDirLocked(char *path)
 {
 
 	/* Validate input path */
@@ -705,18 +1096,23 @@ int mkDir(char *path)
 				return -2;
 			}
 
-			if (countNumberEntries(father_inode_id) == MAX_ENTRIES) {
+			if (countNumberEntries(father_inode_id) >= sblock.maxEntries) {
 				fprintf(stderr, "Error in mkDir: directory is full\n");
 				return -2;
 			}
 	}
 
 	/* Allocate space: inode allocation but no data block is needed */
+	if (journalBegin() < 0) {
+		fprintf(stderr, "Error in mkDir: failed to write data to the disk image\n");
+		return -2;
+	}
 	inode_id = ialloc(); // Returns id of available inode
 
 	if (inode_id < 0)
 	{
 		fprintf(stderr, "Error in mkDir: no inodes available\n");
+		journalEnd();
 		return -2;
 	}
 
@@ -724,9 +1120,12 @@ int mkDir(char *path)
 	inodes[inode_id].father = father_inode_id; // Inode_id of the father inode
 	inodes[inode_id].type = TYPE_FOLDER; // Inode points to a folder
 	strcpy(inodes[inode_id].name, path);
+	nameiInsert(inode_id);
+	childLink(inode_id);
+	markInode(inode_id);
 
-	/* Call syncFS() to write data in memory to the disk image */
-    if (syncFS() < 0) {
+	/* Log the changes in the journal, committed together with other operations */
+    if (journalEnd() < 0) {
         fprintf(stderr, "Error in mkDir: failed to write data to the disk image\n");
         return -2;
     }
@@ -739,6 +1138,19 @@ int mkDir(char *path)
  * @return	0 if success, -1 if the directory does not exist, -2 in case of error..
  */
 int rmDir(char *path)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	int ret = rmDirLocked(path);
+	pthread_rwlock_unlock(&namespace_lock);
+
+	return ret;
+}
+
+/*
+ * @brief	Deletes a directory and its content, with namespace_lock taken.
+ * @return	0 if success, -1 if the directory does not exist, -2 in case of error..
+ */
+static int rmDirLocked(char *path)
 {
 
 	/* Validate input path */
@@ -761,34 +1173,39 @@ int rmDir(char *path)
 		return -2;
 	}
 
-	/* Remove the directory and all its content */
+	/* Remove the directory and all its content, each removal unlinks the child */
 	int i;
-	for (i = 0; i < sblock.numInodes; i++) { // Iterate over all inodes
-
-		if (inodes[i].father == inode_id) { // If father is directory to remove --> remove inode
-			if (inodes[i].type == TYPE_FOLDER){
-				rmDir(inodes[i].name);
-			} else {
-				removeFile(inodes[i].name);
-			}
+	while ((i = inodes_x[inode_id].children.first) >= 0) {
+		int ret;
+		if (inodes[i].type == TYPE_FOLDER){
+			ret = rmDirLocked(inodes[i].name);
+		} else {
+			ret = removeFileLocked(inodes[i].name);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "Error in rmDir: can't remove %s\n", inodes[i].name);
+			return -2;
 		}
 	}
 
-	// Once all inodes have been checked remove directory
-	if (bfree(inodes[inode_id].dataBlockPos) < 0) { // Free data block
-		fprintf(stderr, "Error in rmDir: bfree operation could not be completed\n");
+	// Once all inodes have been checked remove directory, which owns no data blocks
+	if (journalBegin() < 0) {
+		fprintf(stderr, "Error in rmDir: failed to write data to the disk image\n");
 		return -2;
 	}
-
+	nameiRemove(inode_id);
+	childUnlink(inode_id);
 	memset(&(inodes[inode_id]), 0, sizeof(inode_t));
+	markInode(inode_id);
 
 	if (ifree(inode_id) < 0) { // Free data block
+		journalEnd();
 		fprintf(stderr, "Error in rmDir: ifree operation could not be completed\n");
 		return -2;
 	}
 
-	/* Call syncFS() to write data in memory to the disk image */
-    if (syncFS() < 0) {
+	/* Log the changes in the journal, committed together with other operations */
+    if (journalEnd() < 0) {
         fprintf(stderr, "Error in rmDir: failed to write data to the disk image\n");
         return -2;
     }
@@ -801,6 +1218,15 @@ int rmDir(char *path)
  * @return	The number of items in the directory, -1 if the directory does not exist, -2 in case of error..
  */
 int lsDir(char *path, int inodesDir[10], char namesDir[10][33])
+{
+	return lsDirEx(path, inodesDir, namesDir, MAX_ENTRIES);
+}
+
+/*
+ * @brief	Lists up to maxItems entries of a directory and stores the inodes and names in arrays.
+ * @return	The number of items stored, -1 if the directory does not exist, -2 in case of error..
+ */
+int lsDirEx(char *path, int *inodesDir, char namesDir[][33], int maxItems)
 {
 
 	/* Validate input path */
@@ -809,34 +1235,36 @@ int lsDir(char *path, int inodesDir[10], char namesDir[10][33])
         return -1;
 	}
 
-	/* Check inode existance */
+	/* Check inode existance, the names are still while they are listed */
+	pthread_rwlock_rdlock(&namespace_lock);
 	int inode_id = namei(path);
 
 	if (inode_id < 0){
+		pthread_rwlock_unlock(&namespace_lock);
 		fprintf(stderr, "Error in lsDir: directory does not exist\n");
         return -1;
 	}
 
 	/* Check if inode is a folder */
 	if (inodes[inode_id].type != TYPE_FOLDER) {
+		pthread_rwlock_unlock(&namespace_lock);
 		fprintf(stderr, "Error in lsDir: not a directory\n");
 		return -2;
 	}
 
-	for (int i = 0; i < MAX_ENTRIES; i++) { // Fill all content with -1 by default
+	for (int i = 0; i < maxItems; i++) { // Fill all content with -1 by default
 		inodesDir[i] = -1;
 	}
 
 	int counter = 0;
 
-	/* Check all inodes and note down the children of or inode */
-	for (int i = 0; i < sblock.numInodes; i++) {
-		if (inodes[i].father == inode_id) {
-			inodesDir[counter] = i;									// Add to the first free position inode
-			strcpy(namesDir[counter], basename(inodes[i].name));	// Get name of element and copy to first free position
-			counter++;
-		}
+	/* Walk the children of our inode and note them down */
+	for (int i = inodes_x[inode_id].children.first; i >= 0 && counter < maxItems; i = inodes_x[i].nextSibling) {
+		inodesDir[counter] = i;									// Add to the first free position inode
+		strcpy(namesDir[counter], basename(inodes[i].name));	// Get name of element and copy to first free position
+		counter++;
 	}
+	pthread_rwlock_unlock(&namespace_lock);
 
 	return counter;
 }
@@ -847,20 +1275,33 @@ int lsDir(char *path, int inodesDir[10], char namesDir[10][33])
  * @return  ID of the inode available if any, -1 if not
  */
 int ialloc(void) {
-    int i;
-    /* To search for a free inode */
-    for (i = 0; i < sblock.numInodes; i++) {
-        if (bitmap_getbit(i_map, i) == 0) {
-            /* inode busy right now */
-            bitmap_setbit(i_map, i, 1);
-            /* Default values for the inode */
-            memset(&(inodes[i]), 0, sizeof(inode_t));
-            /* Return the inode identification */
-            return i;
-        }
+    pthread_mutex_lock(&i_map_lock);
+
+    /* The device has no free inode */
+    if (i_free == 0) {
+        pthread_mutex_unlock(&i_map_lock);
+        return -1;
     }
 
-    return -1;
+    /* To search for a free inode, from the one following the last allocated */
+    int i = bitmapFindFree(i_map, sblock.numInodes, sblock.inodeHint);
+    if (i < 0) {
+        pthread_mutex_unlock(&i_map_lock);
+        return -1;
+    }
+
+    /* inode busy right now */
+    bitmap_setbit(i_map, i, 1);
+    markInodeMap(i);
+    i_free--;
+    sblock.inodeHint = (i + 1) % sblock.numInodes;
+    markSuperblock();
+    pthread_mutex_unlock(&i_map_lock);
+    /* Default values for the inode */
+    memset(&(inodes[i]), 0, sizeof(inode_t));
+    markInode(i);
+    /* Return the inode identification */
+    return i;
 }
 
 /*
@@ -869,25 +1310,85 @@ int ialloc(void) {
  * @return  ID of the data block available if any, -1 if not
  */
 int alloc(void) {
-    int i;
+    int got;
     char buffer[BLOCK_SIZE];
 
-    for (i = 0; i < sblock.numDataBlocks; i++) {
-        if (bitmap_getbit(b_map, i) == 0) {
-            /* busy block right now */
-            bitmap_setbit(b_map, i, 1);
-
-            /* default values for the block */
-            memset(buffer, 0, BLOCK_SIZE);
-            if (bwrite(DEVICE_IMAGE, i + sblock.firstDataBlock, buffer) < 0) {
-				return -1;
-			};
-            /* it returns the block id */
-            return i;
-        }
+    int i = allocRun(sblock.dataHint, 1, &got);
+    if (i < 0) {
+        return -1;
     }
 
-    return -1;
+    /* default values for the block */
+    memset(buffer, 0, BLOCK_SIZE);
+    if (bwrite(DEVICE_IMAGE, i + sblock.firstDataBlock, buffer) < 0) {
+        return -1;
+    }
+    /* it returns the block id */
+    return i;
+}
+
+/*
+ * @brief   Search for a run of up to <want> free data blocks, preferably starting at
+ *          <goal>, and set their values in data blocks map to 1
+ * @return  ID of the first data block of the run and its length in <got>, -1 if none
+ */
+int allocRun(int goal, int want, int *got) {
+    int n = sblock.numDataBlocks;
+    int i, scanned, start = -1, length = 0;
+
+    pthread_mutex_lock(&b_map_lock);
+
+    /* The device has no free data block */
+    if (b_free == 0) {
+        pthread_mutex_unlock(&b_map_lock);
+        return -1;
+    }
+
+    if (goal <= NULL_BLOCK || goal >= n) {
+        goal = sblock.dataHint;
+    }
+
+    /* Continue at <goal> if it is free, else take the first run long enough or the
+     * longest one, searching from the block following the last allocated */
+    if (goal < n && bitmap_getbit(b_map, goal) == 0) {
+        start = goal;
+    } else {
+        for (i = (goal < n ? goal : 0), scanned = 0; scanned < n && length < want; ) {
+            int f = bitmapFindFree(b_map, n, i);
+            if (f < 0) {
+                break;
+            }
+            scanned += (f >= i) ? f - i : n - i + f;
+            if (scanned >= n) {
+                break;
+            }
+            int e = bitmapFindUsed(b_map, f + want < n ? f + want : n, f);
+            if (e - f > length) {
+                start = f;
+                length = e - f;
+            }
+            scanned += e - f;
+            i = e < n ? e : 0;
+        }
+        if (start < 0) {
+            pthread_mutex_unlock(&b_map_lock);
+            return -1;
+        }
+    }
+
+    /* busy blocks right now */
+    length = bitmapFindUsed(b_map, start + want < n ? start + want : n, start) - start;
+    for (i = start; i < start + length; i++) {
+        bitmap_setbit(b_map, i, 1);
+        markDataMap(i);
+    }
+    b_free -= length;
+    sblock.dataHint = (start + length) % n;
+    markSuperblock();
+    pthread_mutex_unlock(&b_map_lock);
+
+    *got = length;
+    return start;
 }
 
 /*
@@ -901,7 +1402,13 @@ int ifree(int inode_id) {
     }
 
     /* free inode */
+    pthread_mutex_lock(&i_map_lock);
+    if (bitmap_getbit(i_map, inode_id)) {
+        i_free++;
+    }
     bitmap_setbit(i_map, inode_id, 0);
+    markInodeMap(inode_id);
+    pthread_mutex_unlock(&i_map_lock);
 
     return 0;
 }
@@ -912,16 +1419,114 @@ int ifree(int inode_id) {
  */
 int bfree(int block_id) {
     /* to check the inode_id vality */
-    if (block_id >= sblock.numDataBlocks || block_id < 0) {
+    if (block_id >= sblock.numDataBlocks || block_id <= NULL_BLOCK) {
         return -1;
     }
 
     /* free data block */
+    pthread_mutex_lock(&b_map_lock);
+    if (bitmap_getbit(b_map, block_id)) {
+        b_free++;
+    }
     bitmap_setbit(b_map, block_id, 0);
+    markDataMap(block_id);
+    pthread_mutex_unlock(&b_map_lock);
 
     return 0;
 }
 
+/*
+ * @brief   Reads the word number <w> of a map, bit i of the word being entry 64*w+i
+ * @return  The 64 entries of the word
+ */
+static uint64_t bitmapWord(char *bitmap, int w) {
+    uint64_t word;
+
+    memcpy(&word, bitmap + w * sizeof(uint64_t), sizeof(uint64_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/*
+ * @brief   Search for a free entry in a map of <numBits> entries, a word at a time,
+ *          from entry <from> to the end and then from the beginning
+ * @return  Index of the free entry, -1 if the map is full
+ */
+int bitmapFindFree(char *bitmap, int numBits, int from) {
+    int numWords = (numBits + 63) / 64;
+    int i, w;
+
+    if (from < 0 || from >= numBits) {
+        from = 0;
+    }
+
+    /* The entries before <from> in its word are looked at last */
+    w = from / 64;
+    uint64_t bits = ~bitmapWord(bitmap, w) & (~(uint64_t) 0 << (from % 64));
+    for (i = 0; i <= numWords; i++) {
+        if (bits != 0) {
+            int bit = w * 64 + __builtin_ctzll(bits);
+            if (bit < numBits) {
+                return bit;
+            }
+        }
+        w = (w + 1) % numWords;
+        bits = ~bitmapWord(bitmap, w);
+    }
+
+    return -1;
+}
+
+/*
+ * @brief   Search for a used entry of a map between entries <from> and <limit>,
+ *          a word at a time
+ * @return  Index of the used entry, <limit> if all of them are free
+ */
+int bitmapFindUsed(char *bitmap, int limit, int from) {
+    int w = from / 64;
+    uint64_t used = bitmapWord(bitmap, w) & (~(uint64_t) 0 << (from % 64));
+
+    while (w * 64 < limit) {
+        if (used != 0) {
+            int bit = w * 64 + __builtin_ctzll(used);
+            return bit < limit ? bit : limit;
+        }
+        w++;
+        if (w * 64 < limit) {
+            used = bitmapWord(bitmap, w);
+        }
+    }
+
+    return limit;
+}
+
+/*
+ * @brief   Counts the free entries of the maps
+ */
+void bitmapCount(void) {
+    int w;
+
+    i_free = sblock.numInodes;
+    for (w = 0; w * 64 < sblock.numInodes; w++) {
+        uint64_t word = bitmapWord(i_map, w);
+        if (sblock.numInodes - w * 64 < 64) {
+            word &= ((uint64_t) 1 << (sblock.numInodes - w * 64)) - 1;
+        }
+        i_free -= __builtin_popcountll(word);
+    }
+
+    b_free = sblock.numDataBlocks;
+    for (w = 0; w * 64 < sblock.numDataBlocks; w++) {
+        uint64_t word = bitmapWord(b_map, w);
+        if (sblock.numDataBlocks - w * 64 < 64) {
+            word &= ((uint64_t) 1 << (sblock.numDataBlocks - w * 64)) - 1;
+        }
+        b_free -= __builtin_popcountll(word);
+    }
+}
+
 /*
  * @brief   Found the inode ID containing the file passed
  * @return  ID of the inode, -1 if not found
@@ -933,8 +1538,8 @@ int namei(char *fname) {
 	}
 
 	int i;
-    /* seek for the inode with name <fname> */
-    for (i = 0; i < sblock.numInodes; i++) {
+    /* seek for the inode with name <fname> in its bucket of the path index */
+    for (i = namei_buckets[pathHash(fname) & namei_mask]; i >= 0; i = inodes_x[i].hashNext) {
         if (!strcmp(inodes[i].name, fname)) {
             return i;
         }
@@ -943,54 +1548,1521 @@ int namei(char *fname) {
     return -1;
 }
 
+/*
+ * @brief   Hash of a full path for the path index
+ * @return  FNV-1a hash of the path
+ */
+unsigned int pathHash(char *path) {
+	unsigned int hash = 2166136261u;
+
+	while (*path != '\0') {
+		hash = (hash ^ (unsigned char) *path++) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * @brief   Builds the path index from the inodes in use
+ * @return  0 if success, -1 if error
+ */
+int nameiBuild(void) {
+	int i;
+	int numBuckets = 1;
+
+	/* Twice as many buckets as inodes keeps the chains short */
+	while (numBuckets < 2 * sblock.numInodes) {
+		numBuckets <<= 1;
+	}
+
+	int *buckets = (int *) realloc(namei_buckets, numBuckets * sizeof(int));
+	if (buckets == NULL) {
+		return -1;
+	}
+	namei_buckets = buckets;
+	namei_mask = numBuckets - 1;
+
+	for (i = 0; i < numBuckets; i++) {
+		namei_buckets[i] = -1;
+	}
+	for (i = 0; i < sblock.numInodes; i++) {
+		inodes_x[i].hashNext = -1;
+		if (bitmap_getbit(i_map, i)) {
+			nameiInsert(i);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * @brief   Adds an inode to the path index, under its current name
+ */
+void nameiInsert(int inode_id) {
+	int bucket = pathHash(inodes[inode_id].name) & namei_mask;
+
+	inodes_x[inode_id].hashNext = namei_buckets[bucket];
+	namei_buckets[bucket] = inode_id;
+}
+
+/*
+ * @brief   Removes an inode from the path index, before its name is cleared
+ */
+void nameiRemove(int inode_id) {
+	int *link = &namei_buckets[pathHash(inodes[inode_id].name) & namei_mask];
+
+	while (*link >= 0 && *link != inode_id) {
+		link = &inodes_x[*link].hashNext;
+	}
+	if (*link == inode_id) {
+		*link = inodes_x[inode_id].hashNext;
+	}
+	inodes_x[inode_id].hashNext = -1;
+}
+
+/*
+ * @brief   Gets the children of a directory, the root if inode_id is negative
+ * @return  Pointer to the list of children
+ */
+children_t * childrenOf(int inode_id) {
+	if (inode_id < 0) {
+		return &root_children;
+	}
+	return &inodes_x[inode_id].children;
+}
+
+/*
+ * @brief   Rebuilds the children of every directory from the inodes in use
+ */
+void childrenBuild(void) {
+	int i;
+
+	root_children.first = root_children.last = -1;
+	root_children.count = 0;
+	for (i = 0; i < sblock.numInodes; i++) {
+		inodes_x[i].children.first = inodes_x[i].children.last = -1;
+		inodes_x[i].children.count = 0;
+	}
+
+	for (i = 0; i < sblock.numInodes; i++) {
+		if (bitmap_getbit(i_map, i)) {
+			childLink(i);
+		}
+	}
+}
+
+/*
+ * @brief   Appends an inode to the children of its father
+ */
+void childLink(int inode_id) {
+	children_t *children = childrenOf((int) inodes[inode_id].father);
+
+	inodes_x[inode_id].nextSibling = -1;
+	inodes_x[inode_id].prevSibling = children->last;
+	if (children->last >= 0) {
+		inodes_x[children->last].nextSibling = inode_id;
+	} else {
+		children->first = inode_id;
+	}
+	children->last = inode_id;
+	children->count++;
+}
+
+/*
+ * @brief   Removes an inode from the children of its father
+ */
+void childUnlink(int inode_id) {
+	children_t *children = childrenOf((int) inodes[inode_id].father);
+	int prev = inodes_x[inode_id].prevSibling;
+	int next = inodes_x[inode_id].nextSibling;
+
+	if (prev >= 0) {
+		inodes_x[prev].nextSibling = next;
+	} else {
+		children->first = next;
+	}
+	if (next >= 0) {
+		inodes_x[next].prevSibling = prev;
+	} else {
+		children->last = prev;
+	}
+	children->count--;
+	inodes_x[inode_id].nextSibling = inodes_x[inode_id].prevSibling = -1;
+}
+
 /*
  * @brief   Return the index of the data block that contains the byte indicated by the offset
  * @return  Index of the block, -1 if not found
  */
 int bmap(int inode_id, int offset) {
+	return bmapRun(inode_id, offset, NULL);
+}
+
+/*
+ * @brief   Return the index of the data block that contains the byte indicated by the offset,
+ *          and in <run> the number of blocks from it to the end of its extent
+ * @return  Index of the block, -1 if not found
+ */
+int bmapRun(int inode_id, int offset, int *run) {
 	/* to check the inode_id vality */
     if (inode_id >= sblock.numInodes || inode_id < 0) {
         return -1;
     }
+	if (offset < 0 || offset / BLOCK_SIZE >= inodes[inode_id].numBlocks) {
+		return -1;
+	}
 
-	if (offset < BLOCK_SIZE) {
-		return inodes[inode_id].dataBlockPos;
+	/* Walk the extents up to the one holding the block */
+	int index = offset / BLOCK_SIZE;
+	extent_t extent;
+	int e;
+	for (e = 0; e < inodes[inode_id].numExtents; e++) {
+		if (extentGet(inode_id, e, &extent) < 0) {
+			return -1;
+		}
+		if (index < extent.length) {
+			if (run != NULL) {
+				*run = extent.length - index;
+			}
+			return extent.start + index;
+		}
+		index -= extent.length;
 	}
 
 	return -1;
 }
 
 /*
- * @brief   Writes data in memory to the disk image
- * @return  0 if success, -1 if error
+ * @brief   Reads the extent number <index> of an inode
+ * @return  0 if success, -1 otherwise
  */
-int syncFS(void) {
-    int i;
+int extentGet(int inode_id, int index, extent_t *extent) {
+	/* The first extents are stored in the inode itself */
+	if (index < N_DIRECT_EXTENTS) {
+		*extent = inodes[inode_id].extents[index];
+		return 0;
+	}
+	index -= N_DIRECT_EXTENTS;
+
+	/* Then in the indirect block, and the rest in the blocks pointed by the double indirect block */
+	int block_id = inodes[inode_id].indirectBlock;
+	if (index >= EXTENTS_PER_BLOCK) {
+		index -= EXTENTS_PER_BLOCK;
+		if (breadpart(DEVICE_IMAGE, sblock.firstDataBlock + inodes[inode_id].doubleIndirectBlock,
+				(index / EXTENTS_PER_BLOCK) * sizeof(unsigned int), sizeof(unsigned int), (char *) &block_id) < 0) {
+			return -1;
+		}
+		index %= EXTENTS_PER_BLOCK;
+	}
 
-    /* Write superblock into disk */
-    if (bwrite(DEVICE_IMAGE, 0, (char *) &sblock) < 0) {
+	if (breadpart(DEVICE_IMAGE, sblock.firstDataBlock + block_id, index * sizeof(extent_t), sizeof(extent_t), (char *) extent) < 0) {
 		return -1;
 	}
 
-    /* Write inode map to disk */
-    for (i = 0; i < sblock.numINodeMapBlocks; i++) {
-        if (bwrite(DEVICE_IMAGE, 1 + i, ((char *) i_map + i * BLOCK_SIZE)) < 0) {
+	return 0;
+}
+
+/*
+ * @brief   Reads a block of extents or of pointers, all zeros if it is not allocated yet
+ * @return  0 if success, -1 otherwise
+ */
+int extentBlockRead(unsigned int block_id, char *buffer) {
+	if (block_id == NULL_BLOCK) {
+		memset(buffer, 0, BLOCK_SIZE);
+		return 0;
+	}
+	return bread(DEVICE_IMAGE, sblock.firstDataBlock + block_id, buffer);
+}
+
+/*
+ * @brief   Tells if a block of extents was allocated after the last commit,
+ *          so that no committed inode points to it and it is changed in place
+ * @return  1 if so, 0 otherwise
+ */
+int extentBlockFresh(unsigned int block_id) {
+	pthread_mutex_lock(&journal.lock);
+	int fresh = block_id != NULL_BLOCK && blockListFind(&journal.fresh, block_id) >= 0;
+	pthread_mutex_unlock(&journal.lock);
+
+	return fresh;
+}
+
+/*
+ * @brief   Allocates a new place for a block of extents, near its old one
+ * @return  0 if success, the new block in <block_id>, -1 otherwise
+ */
+int extentBlockNew(unsigned int *block_id) {
+	int got;
+
+	int i = allocRun(*block_id, 1, &got);
+	if (i < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	int ret = blockListAdd(&journal.fresh, i);
+	pthread_mutex_unlock(&journal.lock);
+	if (ret < 0) {
+		bfree(i);
+		return -1;
+	}
+
+	*block_id = i;
+	return 0;
+}
+
+/*
+ * @brief   Frees a block of extents the inodes no longer point to. One the last
+ *          commit points to is freed by the next commit, so that it is not
+ *          reused before.
+ * @return  0 if success, -1 otherwise
+ */
+int extentBlockRelease(unsigned int block_id) {
+	if (block_id == NULL_BLOCK) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	int i = blockListFind(&journal.fresh, block_id);
+	if (i >= 0) {
+		journal.fresh.blocks[i] = journal.fresh.blocks[--journal.fresh.count];
+	} else {
+		/* Without memory the block is lost, but never reused while pointed to */
+		blockListAdd(&journal.stale, block_id);
+	}
+	pthread_mutex_unlock(&journal.lock);
+
+	return i >= 0 ? bfree(block_id) : 0;
+}
+/*
+ * @brief   Writes the extent number <index> of an inode, allocating the blocks of
+ *          extents needed to hold it. A block of extents the last commit points
+ *          to is not changed: the new content goes to a new block, and the inode
+ *          or the double indirect block point to it once the change is committed.
+ * @return  0 if success, -1 otherwise
+ */
+int extentSet(int inode_id, int index, extent_t *extent) {
+	char b[BLOCK_SIZE], d[BLOCK_SIZE];
+
+	/* The first extents are stored in the inode itself */
+	if (index < N_DIRECT_EXTENTS) {
+		inodes[inode_id].extents[index] = *extent;
+		markInode(inode_id);
+		return 0;
+	}
+	index -= N_DIRECT_EXTENTS;
+
+	/* Then in the indirect block, and the rest in the blocks pointed by the double indirect block */
+	unsigned int *pointer = &inodes[inode_id].indirectBlock;
+	unsigned int *doublePointer = NULL;
+	if (index >= EXTENTS_PER_BLOCK) {
+		index -= EXTENTS_PER_BLOCK;
+		doublePointer = &inodes[inode_id].doubleIndirectBlock;
+		if (extentBlockRead(*doublePointer, d) < 0) {
 			return -1;
 		}
-    }
+		pointer = (unsigned int *) d + index / EXTENTS_PER_BLOCK;
+		index %= EXTENTS_PER_BLOCK;
+	}
 
-    /* Write block map to disk */
-    for (i = 0; i < sblock.numDataMapBlocks; i++) {
-        if (bwrite(DEVICE_IMAGE, 1 + i + sblock.numINodeMapBlocks, ((char *) b_map + i * BLOCK_SIZE)) < 0) {
+	if (extentBlockRead(*pointer, b) < 0) {
+		return -1;
+	}
+	memcpy(b + index * sizeof(extent_t), extent, sizeof(extent_t));
+
+	/* Both blocks are placed before any pointer to them is written */
+	unsigned int old = *pointer;
+	unsigned int doubleOld = doublePointer != NULL ? *doublePointer : NULL_BLOCK;
+	int moved = !extentBlockFresh(old);
+	int doubleMoved = doublePointer != NULL && moved && !extentBlockFresh(doubleOld);
+	if (moved && extentBlockNew(pointer) < 0) {
+		return -1;
+	}
+	if (doubleMoved && extentBlockNew(doublePointer) < 0) {
+		extentBlockRelease(*pointer);
+		return -1;
+	}
+
+	if (bwrite(DEVICE_IMAGE, sblock.firstDataBlock + *pointer, b) < 0) {
+		return -1;
+	}
+	if (doublePointer != NULL && moved
+		&& bwrite(DEVICE_IMAGE, sblock.firstDataBlock + *doublePointer, d) < 0) {
+		return -1;
+	}
+	if ((doublePointer == NULL && moved) || doubleMoved) {
+		markInode(inode_id);
+	}
+
+	/* The old blocks are freed once the new ones are committed */
+	if (moved && extentBlockRelease(old) < 0) {
+		return -1;
+	}
+	if (doubleMoved && extentBlockRelease(doubleOld) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief   Adds <numBlocks> data blocks at the end of a file, lengthening its last
+ *          extent when the blocks following it are free
+ * @return  0 if success, -1 if not all the blocks could be allocated
+ */
+int fileGrow(int inode_id, int numBlocks) {
+	extent_t last;
+	int got;
+
+	while (numBlocks > 0) {
+		/* The block following the last extent is the best place for the new ones */
+		int goal = 0;
+		int e = inodes[inode_id].numExtents - 1;
+		if (e >= 0) {
+			if (extentGet(inode_id, e, &last) < 0) {
+				return -1;
+			}
+			goal = last.start + last.length;
+		}
+
+		int start = allocRun(goal, numBlocks, &got);
+		if (start < 0) {
+			return -1;
+		}
+
+		if (e >= 0 && start == goal) {
+			last.length += got;
+		} else {
+			e++;
+			last.start = start;
+			last.length = got;
+		}
+		if (extentSet(inode_id, e, &last) < 0) {
+			return -1;
+		}
+		inodes[inode_id].numExtents = e + 1;
+		inodes[inode_id].numBlocks += got;
+		markInode(inode_id);
+		numBlocks -= got;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief   Frees every data block of an inode, including its blocks of extents
+ * @return  0 if success, -1 otherwise
+ */
+int freeBlocks(int inode_id) {
+	extent_t extent;
+	int e, i;
+
+	for (e = 0; e < inodes[inode_id].numExtents; e++) {
+		if (extentGet(inode_id, e, &extent) < 0) {
+			return -1;
+		}
+		for (i = 0; i < extent.length; i++) {
+			if (bfree(extent.start + i) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	/* The blocks of extents the last commit points to stay intact until the removal is committed */
+	if (extentBlockRelease(inodes[inode_id].indirectBlock) < 0) {
+		return -1;
+	}
+	if (inodes[inode_id].doubleIndirectBlock != NULL_BLOCK) {
+		unsigned int pointers[POINTERS_PER_BLOCK];
+		if (bread(DEVICE_IMAGE, sblock.firstDataBlock + inodes[inode_id].doubleIndirectBlock, (char *) pointers) < 0) {
+			return -1;
+		}
+		for (i = 0; i < POINTERS_PER_BLOCK; i++) {
+			if (extentBlockRelease(pointers[i]) < 0) {
+				return -1;
+			}
+		}
+		if (extentBlockRelease(inodes[inode_id].doubleIndirectBlock) < 0) {
 			return -1;
 		}
+	}
+
+	return 0;
+}
+
+/*
+ * @brief   Reads bytes from an offset of a file, up to its end
+ * @return  Number of bytes read, -1 in case of error
+ */
+int fileRead(int inode_id, int start, char *buffer, int numBytes) {
+	int b_id;
+
+	/* If number of bytes to read surpasses the file size, read until EOF */
+	if (start + numBytes > inodes[inode_id].size) {
+		numBytes = inodes[inode_id].size - start;
+	}
+	if (numBytes < 0) {
+		fprintf(stderr, "Error in fileRead: Segmentation fault\n");
+		return -1;
+	}
+
+	/* In this case, the seek pointer is located at EOF, so no bytes can be read */
+    if (numBytes == 0) {
+        return 0;
     }
 
-    /* Write inodes to disk */
-    for (i = 0; i < ceilOfDivision(sblock.numInodes * sizeof(inode_t), BLOCK_SIZE); i++) {
-        if (bwrite(DEVICE_IMAGE, i + sblock.firstInodeBlock, ((char *) inodes + i * BLOCK_SIZE)) < 0) {
+	/* Copy the bytes batch by batch: the whole blocks of a batch are read
+	 * together, straight into the buffer, so that the device reads its runs
+	 * at the same time. Only the partial blocks at the ends go through the cache. */
+	int blocks[READ_BATCH];
+	bvec_t vec[READ_BATCH];
+	int done = 0, run, n, i, j;
+	while (done < numBytes) {
+		int offset = start + done;
+		int end = start + numBytes;
+
+		for (n = 0; n < READ_BATCH && offset < end; ) {
+			/* Get the number of block of file */
+			b_id = bmapRun(inode_id, offset, &run);
+
+			if (b_id < 0) {
+				fprintf(stderr, "Error in fileRead: error coming from bmap, could not allocate a data block\n");
+				return -1;
+			}
+
+			for (; run > 0 && n < READ_BATCH && offset < end; run--, b_id++) {
+				blocks[n++] = sblock.firstDataBlock + b_id;
+				offset += BLOCK_SIZE - offset % BLOCK_SIZE;
+			}
+		}
+
+		for (i = 0; i < n; i = j) {
+			offset = start + done;
+
+			/* Whole blocks, from the cache or the device without an intermediate copy */
+			for (j = i; j < n && offset % BLOCK_SIZE == 0 && numBytes - done - (j - i) * BLOCK_SIZE >= BLOCK_SIZE; j++) {
+				vec[j - i].blockNumber = blocks[j];
+				vec[j - i].buffer = (char *) buffer + done + (j - i) * BLOCK_SIZE;
+			}
+			if (j > i) {
+				if (breadv(DEVICE_IMAGE, vec, j - i) < 0) {
+					fprintf(stderr, "Error in fileRead: can't read data block\n");
+					return -1;
+				}
+				done += (j - i) * BLOCK_SIZE;
+				continue;
+			}
+			j = i + 1;
+
+			int chunk = BLOCK_SIZE - offset % BLOCK_SIZE;
+			if (chunk > numBytes - done) {
+				chunk = numBytes - done;
+			}
+
+			/* Read the bytes of the block straight into the buffer */
+			if (breadpart(DEVICE_IMAGE, blocks[i], offset % BLOCK_SIZE, chunk, (char *) buffer + done) < 0) {
+				fprintf(stderr, "Error in fileRead: can't read data block\n");
+				return -1;
+			}
+			done += chunk;
+		}
+	}
+
+	return done;
+}
+
+/*
+ * @brief   Writes bytes at an offset of a file, growing it if needed
+ * @return  Number of bytes written, -1 in case of error
+ */
+int fileWrite(int inode_id, int start, char *buffer, int numBytes) {
+	char b[BLOCK_SIZE] ;
+	bvec_t vec[WRITE_BATCH];
+	int b_id;
+
+	/* The file grows with the writes past its end, up to the maximum file size */
+	if (start + numBytes > MAX_FILE_SIZE) {
+		numBytes = MAX_FILE_SIZE - start;
+	}
+	if (numBytes < 0) {
+		fprintf(stderr, "Error in fileWrite: Segmentation fault\n");
+		return -1;
+	}
+
+	/* In this case, the seek pointer is located at the maximum size, so no bytes can be written */
+    if (numBytes == 0) {
+        return 0;
+    }
+
+	/* Allocate at once the blocks the write adds to the file, in as few extents as possible */
+	int needed = ceilOfDivision(start + numBytes, BLOCK_SIZE) - inodes[inode_id].numBlocks;
+	if (needed > 0) {
+		if (journalBegin() < 0) {
+			fprintf(stderr, "Error in fileWrite: failed to write data to the disk image\n");
+			return -1;
+		}
+		int grown = fileGrow(inode_id, needed);
+		if (journalEnd() < 0) {
+			fprintf(stderr, "Error in fileWrite: failed to write data to the disk image\n");
+			return -1;
+		}
+		if (grown < 0) {
+			/* The device is full, write only what fits in the blocks of the file */
+			numBytes = inodes[inode_id].numBlocks * BLOCK_SIZE - start;
+			if (numBytes <= 0) {
+				fprintf(stderr, "Error in fileWrite: error coming from bmap, could not allocate a data block\n");
+				return -1;
+			}
+		}
+	}
+
+	/* Copy the bytes run by run, a run being blocks contiguous on the device */
+	int done = 0, run;
+	while (done < numBytes) {
+		/* Get the number of block of file */
+		b_id = bmapRun(inode_id, start + done, &run);
+
+		if (b_id < 0) {
+			fprintf(stderr, "Error in fileWrite: error coming from bmap, could not allocate a data block\n");
+			return -1;
+		}
+
+		while (run > 0 && done < numBytes) {
+			int offset = start + done;
+
+			/* Whole blocks, straight from the buffer to the device and the cached copies */
+			int n;
+			for (n = 0; n < run && n < WRITE_BATCH && offset % BLOCK_SIZE == 0 && numBytes - done - n * BLOCK_SIZE >= BLOCK_SIZE; n++) {
+				vec[n].blockNumber = sblock.firstDataBlock + b_id + n;
+				vec[n].buffer = (char *) buffer + done + n * BLOCK_SIZE;
+			}
+			if (n > 0) {
+				if (bwritev(DEVICE_IMAGE, vec, n) < 0) {
+					fprintf(stderr, "Error in fileWrite: can't write data block\n");
+					return -1;
+				}
+				done += n * BLOCK_SIZE;
+				run -= n;
+				b_id += n;
+				continue;
+			}
+
+			int chunk = BLOCK_SIZE - offset % BLOCK_SIZE;
+			if (chunk > numBytes - done) {
+				chunk = numBytes - done;
+			}
+
+			/* Part of a block: past the end of the file it was never written, so it is
+			 * zeros around the bytes; otherwise the cache keeps just the bytes, the
+			 * block is not read */
+			if (offset - offset % BLOCK_SIZE >= inodes[inode_id].size) {
+				memset(b, 0, BLOCK_SIZE);
+				memmove(b + offset % BLOCK_SIZE, (char *) buffer + done, chunk);
+				if (bwrite(DEVICE_IMAGE, sblock.firstDataBlock+b_id, b) < 0) {
+					fprintf(stderr, "Error in fileWrite: can't write data block\n");
+					return -1;
+				}
+			} else if (bwritepart(DEVICE_IMAGE, sblock.firstDataBlock+b_id, offset % BLOCK_SIZE, chunk, (char *) buffer + done) < 0) {
+				fprintf(stderr, "Error in fileWrite: can't write data block\n");
+				return -1;
+			}
+			done += chunk;
+			run--;
+			b_id++;
+		}
+	}
+
+	/* Increase the file size when writing past the end */
+	if (start + done > inodes[inode_id].size) {
+		if (journalBegin() < 0) {
+			fprintf(stderr, "Error in fileWrite: failed to write data to the disk image\n");
+			return -1;
+		}
+		inodes[inode_id].size = start + done;
+		markInode(inode_id);
+
+		/* Log the new size in the journal, committed together with other operations */
+		if (journalEnd() < 0) {
+			fprintf(stderr, "Error in fileWrite: failed to write data to the disk image\n");
+			return -1;
+		}
+	}
+
+	return done;
+}
+
+/*
+ * @brief   Gathers a small write in the buffer of a descriptor, at its seek
+ *          pointer. The buffer holds contiguous bytes of one block at most and
+ *          is written once the block is complete or a write lands elsewhere.
+ * @return  Number of bytes written, -1 in case of error
+ */
+int bufferWrite(int fd, char *buffer, int numBytes) {
+	file_t *f = &files[fd];
+	int done = 0;
+
+	/* Take the blocks now, so that a full device is reported by this write */
+	int needed = ceilOfDivision(f->position + numBytes, BLOCK_SIZE) - inodes[f->inode].numBlocks;
+	if (needed > 0) {
+		if (journalBegin() < 0) {
+			return -1;
+		}
+		int grown = fileGrow(f->inode, needed);
+		if (journalEnd() < 0 || grown < 0) {
+			return bufferFlush(fd) < 0 ? -1 : fileWrite(f->inode, f->position, buffer, numBytes);
+		}
+	}
+	if (f->buffer == NULL && (f->buffer = malloc(BLOCK_SIZE)) == NULL) {
+		return bufferFlush(fd) < 0 ? -1 : fileWrite(f->inode, f->position, buffer, numBytes);
+	}
+
+	while (done < numBytes) {
+		int offset = f->position + done;
+
+		/* Only bytes following the gathered ones join them */
+		if (f->bufferBytes > 0 && f->bufferStart + f->bufferBytes != offset && bufferFlush(fd) < 0) {
+			return -1;
+		}
+		if (f->bufferBytes == 0) {
+			f->bufferStart = offset;
+			inodes_x[f->inode].buffered++;
+		}
+
+		int end = f->bufferStart % BLOCK_SIZE + f->bufferBytes;
+		int chunk = BLOCK_SIZE - end;
+		if (chunk > numBytes - done) {
+			chunk = numBytes - done;
+		}
+		memcpy(f->buffer + end, buffer + done, chunk);
+		f->bufferBytes += chunk;
+		done += chunk;
+
+		/* The block is complete */
+		if (end + chunk == BLOCK_SIZE && bufferFlush(fd) < 0) {
+			return -1;
+		}
+	}
+
+	return done;
+}
+
+/*
+ * @brief   Writes the bytes gathered in the buffer of a descriptor
+ * @return  0 if success, -1 in case of error
+ */
+int bufferFlush(int fd) {
+	file_t *f = &files[fd];
+
+	if (f->bufferBytes == 0) {
+		return 0;
+	}
+
+	int written = fileWrite(f->inode, f->bufferStart, f->buffer + f->bufferStart % BLOCK_SIZE, f->bufferBytes);
+	int ret = (written == f->bufferBytes) ? 0 : -1;
+	f->bufferBytes = 0;
+	inodes_x[f->inode].buffered--;
+
+	return ret;
+}
+
+/*
+ * @brief   Writes the bytes gathered in the buffers of every descriptor of a
+ *          file but <except>, -1 for none
+ * @return  0 if success, -1 in case of error
+ */
+int bufferFlushInode(int inode_id, int except) {
+	int fd, ret = 0;
+
+	/* A file opened once has nothing to flush but the buffer excepted */
+	if (inodes_x[inode_id].buffered == 0 || (except >= 0 && inodes_x[inode_id].opened == 1)) {
+		return 0;
+	}
+
+	/* The buffers of the file are only used with its lock taken, the table
+	 * lock keeps the other entries still while they are looked at */
+	pthread_mutex_lock(&files_lock);
+	for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
+		if (fd != except && files[fd].opened != 0 && files[fd].inode == inode_id && bufferFlush(fd) < 0) {
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&files_lock);
+
+	return ret;
+}
+
+/*
+ * @brief   Takes the lock of a file to read it, once the bytes gathered in the
+ *          buffers of its descriptors are written
+ * @return  0 if success, -1 in case of error, the lock is not taken then
+ */
+int fileLockRead(int inode_id) {
+	pthread_rwlock_rdlock(&inodes_x[inode_id].lock);
+
+	/* Writing the buffers changes the file: the lock is taken exclusive meanwhile */
+	while (inodes_x[inode_id].buffered > 0) {
+		pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+		pthread_rwlock_wrlock(&inodes_x[inode_id].lock);
+		int ret = bufferFlushInode(inode_id, -1);
+		pthread_rwlock_unlock(&inodes_x[inode_id].lock);
+		if (ret < 0) {
+			return -1;
+		}
+		pthread_rwlock_rdlock(&inodes_x[inode_id].lock);
+	}
+
+	return 0;
+}
+
+/*
+ * @brief   Follows a read of a descriptor, reading ahead of sequential readers
+ */
+void readAhead(int fd, int offset, int numBytes) {
+	file_t *x = &files[fd];
+	int inode_id = x->inode;
+	int blocks[READAHEAD_MAX];
+	int n = 0, run, b_id;
+
+	/* A random read stops reading ahead, a sequential one doubles the window */
+	if (offset != x->raNext) {
+		x->raNext = offset + numBytes;
+		x->raWindow = 0;
+		x->raEnd = 0;
+		return;
+	}
+	x->raNext = offset + numBytes;
+	x->raWindow = (x->raWindow == 0) ? READAHEAD_MIN : 2 * x->raWindow;
+	if (x->raWindow > READAHEAD_MAX) {
+		x->raWindow = READAHEAD_MAX;
+	}
+
+	/* Read the next window once less than half of the previous one is left */
+	int next = ceilOfDivision(x->raNext, BLOCK_SIZE);
+	int first = (x->raEnd > next) ? x->raEnd : next;
+	int last = next + x->raWindow;
+	if (first - next >= x->raWindow / 2) {
+		return;
+	}
+	if (last > ceilOfDivision(inodes[inode_id].size, BLOCK_SIZE)) {
+		last = ceilOfDivision(inodes[inode_id].size, BLOCK_SIZE);
+	}
+
+	while (first < last) {
+		if ((b_id = bmapRun(inode_id, first * BLOCK_SIZE, &run)) < 0) {
+			break;
+		}
+		for (; run > 0 && first < last; run--, b_id++, first++) {
+			blocks[n++] = sblock.firstDataBlock + b_id;
+		}
+	}
+	x->raEnd = first;
+
+	/* Only a hint: errors show up when the blocks are read */
+	if (n > 0) {
+		breadahead(DEVICE_IMAGE, blocks, n);
+	}
+}
+
+/*
+ * @brief	Fragmentation of the files: average number of extents of the files holding data.
+ * @return	Average extents per file (1 meaning no fragmentation), 0 if no file holds data.
+ */
+double fragmentationFS(void)
+{
+	int i, files = 0;
+	long extents = 0;
+
+	for (i = 0; i < sblock.numInodes; i++) {
+		if (bitmap_getbit(i_map, i) && inodes[i].type == TYPE_FILE && inodes[i].numExtents > 0) {
+			files++;
+			extents += inodes[i].numExtents;
+		}
+	}
+
+	if (files == 0) {
+		return 0;
+	}
+	return (double) extents / files;
+}
+
+/*
+ * @brief   Marks the superblock to be written by the next checkpoint
+ */
+void markSuperblock(void) {
+	pthread_mutex_lock(&journal.lock);
+	sblock_dirty = 1;
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+ * @brief   Marks the inode map block holding the bit of an inode to be
+ *          written by the next checkpoint, and logs the change in the journal
+ */
+void markInodeMap(int inode_id) {
+	pthread_mutex_lock(&journal.lock);
+	i_map_dirty[(inode_id / 8) / BLOCK_SIZE] = 1;
+	journalChange(JOURNAL_IMAP, inode_id);
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+ * @brief   Marks the data map block holding the bit of a data block to be
+ *          written by the next checkpoint, and logs the change in the journal
+ */
+void markDataMap(int block_id) {
+	pthread_mutex_lock(&journal.lock);
+	b_map_dirty[(block_id / 8) / BLOCK_SIZE] = 1;
+	journalChange(JOURNAL_BMAP, block_id);
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+ * @brief   Marks the blocks of the inodes table holding an inode to be
+ *          written by the next checkpoint, and logs the change in the journal
+ */
+void markInode(int inode_id) {
+	/* An inode may be split between two blocks */
+	pthread_mutex_lock(&journal.lock);
+	inodes_dirty[(inode_id * sizeof(inode_t)) / BLOCK_SIZE] = 1;
+	inodes_dirty[((inode_id + 1) * sizeof(inode_t) - 1) / BLOCK_SIZE] = 1;
+	journalChange(JOURNAL_INODE, inode_id);
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+ * @brief   Lists the blocks of the inode map, the block map and the inodes table,
+ *          in device order, with their place in memory. Only the dirty ones if
+ *          <dirty> is 1. With a NULL <vec> they are only counted.
+ * @return  Number of blocks listed
+ */
+int metadataBlocks(bvec_t *vec, int dirty) {
+    int i, count = 0;
+
+    for (i = 0; i < sblock.numINodeMapBlocks; i++) {
+        if (!dirty || i_map_dirty[i]) {
+            if (vec != NULL) {
+                vec[count].blockNumber = 1 + i;
+                vec[count].buffer = (char *) i_map + i * BLOCK_SIZE;
+            }
+            count++;
+        }
+    }
+    for (i = 0; i < sblock.numDataMapBlocks; i++) {
+        if (!dirty || b_map_dirty[i]) {
+            if (vec != NULL) {
+                vec[count].blockNumber = 1 + i + sblock.numINodeMapBlocks;
+                vec[count].buffer = (char *) b_map + i * BLOCK_SIZE;
+            }
+            count++;
+        }
+    }
+    for (i = 0; i < INODE_BLOCKS; i++) {
+        if (!dirty || inodes_dirty[i]) {
+            if (vec != NULL) {
+                vec[count].blockNumber = i + sblock.firstInodeBlock;
+                vec[count].buffer = (char *) inodes + i * BLOCK_SIZE;
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * @brief   Writes data in memory to the disk image: commits the pending
+ *          changes to the journal and checkpoints them
+ * @return  0 if success, -1 if error
+ */
+int syncFS(void) {
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&journal.opLock);
+	if (journalCommit() < 0 || journalCheckpoint() < 0) {
+		ret = -1;
+	}
+	pthread_rwlock_unlock(&journal.opLock);
+
+	return ret;
+}
+
+/*
+ * @brief   Current time in milliseconds, used by the group commit
+ * @return  Milliseconds from an arbitrary point
+ */
+long journalNow(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * @brief   Size of a record of the journal
+ * @return  Number of bytes of a record of the given kind
+ */
+int journalRecordSize(int kind) {
+	/* kind + id + value */
+	return 1 + sizeof(int) + (kind == JOURNAL_INODE ? sizeof(inode_t) : 1);
+}
+
+/*
+ * @brief   Checksum of a journal block, computed with its checksum field set to 0
+ * @return  FNV-1a hash of the block
+ */
+unsigned int journalChecksum(char *block) {
+	journal_header_t *header = (journal_header_t *) block;
+	unsigned int saved = header->checksum;
+	unsigned int hash = 2166136261u;
+	int i;
+
+	header->checksum = 0;
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		hash = (hash ^ (unsigned char) block[i]) * 16777619u;
+	}
+	header->checksum = saved;
+
+	return hash;
+}
+
+/*
+ * @brief   Forgets the changes not committed and places the journal at
+ *          the head stored in the superblock
+ */
+void journalReset(void) {
+	journalForget();
+	journal.nextBlock = sblock.journalHead;
+	journal.nextSequence = sblock.journalSequence;
+	journal.maxInodes = journalMaxInodes();
+}
+
+/*
+ * @brief   Empties the group of changes waiting to be committed, and the
+ *          blocks of extents kept for them
+ */
+void journalForget(void) {
+	int i;
+
+	for (i = 0; i < journal.numChanges; i++) {
+		journalLogged(journal.changes[i].kind)[journal.changes[i].id] = 0;
+	}
+	journal.numChanges = 0;
+	journal.numInodes = 0;
+	journal.fresh.count = 0;
+	journal.stale.count = 0;
+	journal.numBytes = 0;
+	journal.firstChange = -1;
+}
+
+/*
+ * @brief   Flags of the inodes or map bytes already in the group of changes
+ * @return  Pointer to the flags for changes of the given kind
+ */
+char *journalLogged(int kind) {
+	return kind == JOURNAL_INODE ? journal.inodeLogged : (kind == JOURNAL_IMAP ? journal.imapLogged : journal.bmapLogged);
+}
+
+/*
+ * @brief   Adds a metadata change to the group waiting to be committed.
+ *          The record is built from the metadata in memory at commit time.
+ */
+void journalChange(int kind, int id) {
+	/* A single record per inode or map byte is enough, it carries the last content */
+	if (kind != JOURNAL_INODE) {
+		id /= 8;
+	}
+	if (journalLogged(kind)[id]) {
+		return;
+	}
+
+	if (journal.numChanges == journal.maxChanges) {
+		int maxChanges = journal.maxChanges ? 2 * journal.maxChanges : 64;
+		journal_change_t *changes = realloc(journal.changes, maxChanges * sizeof(journal_change_t));
+		if (changes == NULL) {
+			/* The change is still written by the next checkpoint */
+			return;
+		}
+		journal.changes = changes;
+		journal.maxChanges = maxChanges;
+	}
+
+	if (journal.numChanges == 0) {
+		journal.firstChange = journalNow();
+	}
+	journal.changes[journal.numChanges].kind = kind;
+	journal.changes[journal.numChanges].id = id;
+	journal.numChanges++;
+	journal.numInodes += kind == JOURNAL_INODE;
+	journal.numBytes += kind == JOURNAL_INODE ? journalRecordSize(kind) : JOURNAL_MAP_RECORD(1);
+	journalLogged(kind)[id] = 1;
+}
+
+/*
+ * @brief   Adds a data block to a list kept by the journal
+ * @return  0 if success, -1 if there is not enough memory
+ */
+int blockListAdd(block_list_t *list, unsigned int block_id) {
+	if (list->count == list->max) {
+		int max = list->max ? 2 * list->max : 64;
+		unsigned int *blocks = realloc(list->blocks, max * sizeof(unsigned int));
+		if (blocks == NULL) {
+			return -1;
+		}
+		list->blocks = blocks;
+		list->max = max;
+	}
+	list->blocks[list->count++] = block_id;
+	return 0;
+}
+
+/*
+ * @brief   Searches a data block in a list kept by the journal
+ * @return  Position of the block in the list, -1 if not found
+ */
+int blockListFind(block_list_t *list, unsigned int block_id) {
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (list->blocks[i] == block_id) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * @brief   Begins a metadata operation: the changes of the operations in
+ *          progress are not committed until they end. The pending changes
+ *          are committed first if the inodes of this operation and those in
+ *          progress might not fit in the same transaction.
+ * @return  0 if success, -1 if error, the operation must not go on
+ */
+int journalBegin(void) {
+	pthread_rwlock_rdlock(&journal.opLock);
+	pthread_mutex_lock(&journal.lock);
+	while (journal.numInodes + (journal.active + 1) * JOURNAL_OP_INODES > journal.maxInodes) {
+		pthread_mutex_unlock(&journal.lock);
+		pthread_rwlock_unlock(&journal.opLock);
+
+		pthread_rwlock_wrlock(&journal.opLock);
+		int ret = journalCommit();
+		pthread_rwlock_unlock(&journal.opLock);
+		if (ret < 0) {
+			return -1;
+		}
+
+		pthread_rwlock_rdlock(&journal.opLock);
+		pthread_mutex_lock(&journal.lock);
+	}
+	journal.active++;
+	pthread_mutex_unlock(&journal.lock);
+	return 0;
+}
+
+/*
+ * @brief   Ends a metadata operation. Its changes are committed along with
+ *          those of other operations once they fill a journal block or the
+ *          oldest one is JOURNAL_COMMIT_MS old.
+ * @return  0 if success, -1 if error
+ */
+int journalEnd(void) {
+	int due, ret = 0;
+
+	pthread_mutex_lock(&journal.lock);
+	journal.active--;
+	pthread_mutex_unlock(&journal.lock);
+	pthread_rwlock_unlock(&journal.opLock);
+
+	pthread_mutex_lock(&journal.lock);
+	due = journal.numChanges > 0
+		&& (journal.numBytes >= JOURNAL_PAYLOAD || journalNow() - journal.firstChange >= JOURNAL_COMMIT_MS);
+	pthread_mutex_unlock(&journal.lock);
+
+	/* The records are built once no operation is halfway, another thread may
+	 * have committed the changes in the meantime */
+	if (due) {
+		pthread_rwlock_wrlock(&journal.opLock);
+		ret = journalCommit();
+		pthread_rwlock_unlock(&journal.opLock);
+	}
+	return ret;
+}
+
+/*
+ * @brief   Journal blocks holding records for every byte of the maps, as
+ *          runs split between blocks, used by mkFS to size the journal
+ * @return  Number of journal blocks
+ */
+int journalMapBlocks(long long mapBytes) {
+	/* Each block may lose a header for a run continued from the previous one
+	 * and the end too short for another record, each map a first header */
+	return ceilOfDivision(mapBytes + 2 * JOURNAL_MAP_RECORD(0), JOURNAL_PAYLOAD - 2 * JOURNAL_MAP_RECORD(1)) + 1;
+}
+
+/*
+ * @brief   Most journal blocks of a transaction: the journal is never full,
+ *          so that its head and its end only meet when it is empty
+ * @return  Number of journal blocks
+ */
+int journalMaxBlocks(void) {
+	return sblock.numJournalBlocks - sblock.numJournalBlocks / 2;
+}
+
+/*
+ * @brief   Most inode records of a transaction, so that it fits in
+ *          journalMaxBlocks: the changed bytes of both maps take up to
+ *          journalMapBlocks of them, the inodes the rest
+ * @return  Number of inode records, less than JOURNAL_OP_INODES if the
+ *          journal is too small for the file system
+ */
+int journalMaxInodes(void) {
+	long long mapBytes = ceilOfDivision(sblock.numInodes, 8) + ceilOfDivision(sblock.numDataBlocks, 8);
+
+	return (journalMaxBlocks() - journalMapBlocks(mapBytes)) * (int) (JOURNAL_PAYLOAD / journalRecordSize(JOURNAL_INODE));
+}
+
+/* Place of the records of a transaction being laid out in journal blocks */
+typedef struct {
+	char *blocks; /* Journal blocks, NULL to only count them */
+	int count;    /* Blocks used */
+	int used;     /* Bytes of records in the last block */
+} journal_layout_t;
+
+/*
+ * @brief   Takes room for a record in the last block of a transaction, or in
+ *          a new block if it does not fit
+ * @return  Pointer to the record, NULL if the blocks are only counted
+ */
+static char *journalPlace(journal_layout_t *layout, int size) {
+	if (layout->used + size > JOURNAL_PAYLOAD) {
+		if (layout->blocks != NULL) {
+			((journal_header_t *) (layout->blocks + (layout->count - 1) * BLOCK_SIZE))->numBytes = layout->used;
+		}
+		layout->count++;
+		layout->used = 0;
+	}
+	layout->used += size;
+	if (layout->blocks == NULL) {
+		return NULL;
+	}
+	return layout->blocks + (layout->count - 1) * BLOCK_SIZE + sizeof(journal_header_t) + layout->used - size;
+}
+
+/*
+ * @brief   Lays out records for the changed bytes of a map, sorted: runs of
+ *          them joined over up to JOURNAL_GAP unchanged bytes
+ */
+static void journalPlaceMap(journal_layout_t *layout, int kind, char *map, int *bytes, int numBytes) {
+	int i = 0;
+
+	while (i < numBytes) {
+		int first = bytes[i], last = bytes[i];
+		while (i + 1 < numBytes && bytes[i + 1] - last <= JOURNAL_GAP + 1) {
+			last = bytes[++i];
+		}
+		i++;
+
+		/* Runs longer than the room left in a block continue in the next one */
+		while (first <= last) {
+			int room = (int) JOURNAL_PAYLOAD - layout->used - JOURNAL_MAP_RECORD(0);
+			if (room < 1) {
+				room = (int) JOURNAL_PAYLOAD - JOURNAL_MAP_RECORD(0);
+			}
+			unsigned short length = last - first + 1 < room ? last - first + 1 : room;
+			char *record = journalPlace(layout, JOURNAL_MAP_RECORD(length));
+			if (record != NULL) {
+				record[0] = kind;
+				memcpy(record + 1, &first, sizeof(int));
+				memcpy(record + 1 + sizeof(int), &length, sizeof(unsigned short));
+				memcpy(record + JOURNAL_MAP_RECORD(0), map + first, length);
+			}
+			first += length;
+		}
+	}
+}
+
+/*
+ * @brief   Lays out the records of the pending changes in journal blocks:
+ *          the inodes, then the changed bytes of the maps. With NULL <blocks>
+ *          the blocks are only counted.
+ * @return  Number of journal blocks of the transaction
+ */
+static int journalLayout(char *blocks, int *imapBytes, int numImap, int *bmapBytes, int numBmap) {
+	journal_layout_t layout = {blocks, 1, 0};
+	int i;
+
+	for (i = 0; i < journal.numChanges; i++) {
+		int id = journal.changes[i].id;
+		if (journal.changes[i].kind != JOURNAL_INODE) {
+			continue;
+		}
+		char *record = journalPlace(&layout, journalRecordSize(JOURNAL_INODE));
+		if (record != NULL) {
+			record[0] = JOURNAL_INODE;
+			memcpy(record + 1, &id, sizeof(int));
+			memcpy(record + 1 + sizeof(int), &inodes[id], sizeof(inode_t));
+		}
+	}
+	journalPlaceMap(&layout, JOURNAL_IMAP_BYTES, i_map, imapBytes, numImap);
+	journalPlaceMap(&layout, JOURNAL_BMAP_BYTES, b_map, bmapBytes, numBmap);
+
+	if (blocks != NULL) {
+		((journal_header_t *) (blocks + (layout.count - 1) * BLOCK_SIZE))->numBytes = layout.used;
+	}
+	return layout.count;
+}
+
+static int compareInt(const void *a, const void *b) {
+	return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * @brief   Writes the pending changes to the journal as one transaction and
+ *          waits until it is stored. Checkpoints once the next transaction
+ *          might not fit in the journal.
+ * @return  0 if success, -1 if error
+ */
+int journalCommit(void) {
+	int i, count, numImap = 0, numBmap = 0;
+	int maxBlocks = journalMaxBlocks();
+
+	/* The blocks of extents replaced since the last commit are freed by this
+	 * one, which no longer points to them */
+	for (i = 0; i < journal.stale.count; i++) {
+		if (bfree(journal.stale.blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	journal.stale.count = 0;
+
+	if (journal.numChanges == 0) {
+		return 0;
+	}
+
+	/* Records are built from the metadata in memory, the map bytes in order */
+	int *imapBytes = malloc(journal.numChanges * sizeof(int));
+	int *bmapBytes = malloc(journal.numChanges * sizeof(int));
+	if (imapBytes == NULL || bmapBytes == NULL) {
+		free(imapBytes);
+		free(bmapBytes);
+		return -1;
+	}
+	for (i = 0; i < journal.numChanges; i++) {
+		if (journal.changes[i].kind == JOURNAL_IMAP) {
+			imapBytes[numImap++] = journal.changes[i].id;
+		} else if (journal.changes[i].kind == JOURNAL_BMAP) {
+			bmapBytes[numBmap++] = journal.changes[i].id;
+		}
+	}
+	qsort(imapBytes, numImap, sizeof(int), compareInt);
+	qsort(bmapBytes, numBmap, sizeof(int), compareInt);
+	count = journalLayout(NULL, imapBytes, numImap, bmapBytes, numBmap);
+
+	/* journalBegin keeps the inodes within journalMaxInodes, so that the
+	 * transaction fits; the changes are never written without it */
+	if (count > maxBlocks) {
+		free(imapBytes);
+		free(bmapBytes);
+		return -1;
+	}
+
+	char *blocks = calloc(count, BLOCK_SIZE);
+	bvec_t *vec = malloc(count * sizeof(bvec_t));
+	if (blocks == NULL || vec == NULL) {
+		free(imapBytes);
+		free(bmapBytes);
+		free(blocks);
+		free(vec);
+		return -1;
+	}
+	journalLayout(blocks, imapBytes, numImap, bmapBytes, numBmap);
+	free(imapBytes);
+	free(bmapBytes);
+
+	/* Data and indirect blocks reach the disk before the metadata pointing to them */
+	if (bsync(DEVICE_IMAGE) < 0) {
+		free(blocks);
+		free(vec);
+		return -1;
+	}
+
+	/* Seal and write every block of the transaction */
+	for (i = 0; i < count; i++) {
+		journal_header_t *header = (journal_header_t *) (blocks + i * BLOCK_SIZE);
+		header->magic = JOURNAL_MAGIC;
+		header->sequence = journal.nextSequence;
+		header->index = i;
+		header->count = count;
+		header->checksum = journalChecksum((char *) header);
+
+		vec[i].blockNumber = sblock.firstJournalBlock + (journal.nextBlock + i) % sblock.numJournalBlocks;
+		vec[i].buffer = (char *) header;
+	}
+	int ret = bwritev(DEVICE_IMAGE, vec, count);
+	free(blocks);
+	free(vec);
+	if (ret < 0 || bsync(DEVICE_IMAGE) < 0) {
+		return -1;
+	}
+
+	journal.nextBlock = (journal.nextBlock + count) % sblock.numJournalBlocks;
+	journal.nextSequence++;
+	journalForget();
+
+	/* Keep room for the next transaction. The journal never fills up, since
+	 * a full one could not be told from an empty one */
+	int used = (journal.nextBlock + sblock.numJournalBlocks - sblock.journalHead) % sblock.numJournalBlocks;
+	if (used + maxBlocks >= sblock.numJournalBlocks) {
+		return journalCheckpoint();
+	}
+
+	return 0;
+}
+
+/*
+ * @brief   Applies to the metadata in memory the transactions committed
+ *          after the last checkpoint, and checkpoints them
+ * @return  0 if success, -1 if error
+ */
+int journalReplay(void) {
+	int maxBlocks = journalMaxBlocks();
+	int replayed = 0;
+	char *blocks = malloc(maxBlocks * BLOCK_SIZE);
+	int i;
+
+	if (blocks == NULL) {
+		return -1;
+	}
+
+	while (1) {
+		/* The first block tells the size of the transaction */
+		if (bread(DEVICE_IMAGE, sblock.firstJournalBlock + journal.nextBlock, blocks) < 0) {
+			free(blocks);
+			return -1;
+		}
+		journal_header_t *header = (journal_header_t *) blocks;
+		if (header->magic != JOURNAL_MAGIC || header->sequence != journal.nextSequence
+			|| header->index != 0 || header->count < 1 || header->count > maxBlocks
+			|| header->checksum != journalChecksum(blocks)) {
+			break;
+		}
+		int count = header->count;
+
+		/* The transaction is only applied if all its blocks were stored */
+		for (i = 1; i < count; i++) {
+			char *block = blocks + i * BLOCK_SIZE;
+			if (bread(DEVICE_IMAGE, sblock.firstJournalBlock + (journal.nextBlock + i) % sblock.numJournalBlocks, block) < 0) {
+				free(blocks);
+				return -1;
+			}
+			header = (journal_header_t *) block;
+			if (header->magic != JOURNAL_MAGIC || header->sequence != journal.nextSequence
+				|| header->index != i || header->count != count || header->checksum != journalChecksum(block)) {
+				break;
+			}
+		}
+		if (i < count) {
+			break;
+		}
+
+		for (i = 0; i < count; i++) {
+			char *block = blocks + i * BLOCK_SIZE;
+			char *record = block + sizeof(journal_header_t);
+			char *end = record + ((journal_header_t *) block)->numBytes;
+
+			while (record < end) {
+				int kind = record[0];
+				int id;
+				memcpy(&id, record + 1, sizeof(int));
+
+				if (kind == JOURNAL_INODE && id >= 0 && id < sblock.numInodes) {
+					memcpy(&inodes[id], record + 1 + sizeof(int), sizeof(inode_t));
+					markInode(id);
+				} else if (kind == JOURNAL_IMAP && id >= 0 && id < sblock.numInodes) {
+					bitmap_setbit(i_map, id, record[1 + sizeof(int)]);
+					markInodeMap(id);
+				} else if (kind == JOURNAL_BMAP && id >= 0 && id < sblock.numDataBlocks) {
+					bitmap_setbit(b_map, id, record[1 + sizeof(int)]);
+					markDataMap(id);
+				} else if (kind == JOURNAL_IMAP_BYTES || kind == JOURNAL_BMAP_BYTES) {
+					unsigned short length;
+					memcpy(&length, record + 1 + sizeof(int), sizeof(unsigned short));
+					long mapBytes = (kind == JOURNAL_IMAP_BYTES ? sblock.numINodeMapBlocks : sblock.numDataMapBlocks) * BLOCK_SIZE;
+					if (id < 0 || length < 1 || id + length > mapBytes || record + JOURNAL_MAP_RECORD(length) > end) {
+						break;
+					}
+					/* A run of bytes spans two blocks of the map at most */
+					if (kind == JOURNAL_IMAP_BYTES) {
+						memcpy(i_map + id, record + JOURNAL_MAP_RECORD(0), length);
+						markInodeMap(id * 8);
+						markInodeMap((id + length - 1) * 8);
+					} else {
+						memcpy(b_map + id, record + JOURNAL_MAP_RECORD(0), length);
+						markDataMap(id * 8);
+						markDataMap((id + length - 1) * 8);
+					}
+					record += JOURNAL_MAP_RECORD(length);
+					continue;
+				} else {
+					break;
+				}
+				record += journalRecordSize(kind);
+			}
+		}
+
+		journal.nextBlock = (journal.nextBlock + count) % sblock.numJournalBlocks;
+		journal.nextSequence++;
+		replayed++;
+	}
+	free(blocks);
+
+	/* The replayed changes are already in the journal */
+	journalForget();
+
+	if (replayed > 0) {
+		return journalCheckpoint();
+	}
+	return 0;
+}
+
+/*
+ * @brief   Writes the metadata blocks marked as dirty to their place in the
+ *          disk image and frees the journal space of the committed transactions
+ * @return  0 if success, -1 if error
+ */
+int journalCheckpoint(void) {
+    /* Write the dirty blocks of the maps and the inodes table, neighbours at once */
+    int count = metadataBlocks(NULL, 1);
+    if (count > 0) {
+        bvec_t *vec = malloc(count * sizeof(bvec_t));
+        if (vec == NULL || bwritev(DEVICE_IMAGE, vec, metadataBlocks(vec, 1)) < 0) {
+            free(vec);
+            return -1;
+        }
+        free(vec);
+        memset(i_map_dirty, 0, sblock.numINodeMapBlocks);
+        memset(b_map_dirty, 0, sblock.numDataMapBlocks);
+        memset(inodes_dirty, 0, INODE_BLOCKS);
+    }
+
+    /* The metadata must be stored before the journal space is released */
+    if (bsync(DEVICE_IMAGE) < 0) {
+		return -1;
+	}
+
+    /* Write superblock into disk with the new head of the journal */
+    if (sblock.journalHead != journal.nextBlock || sblock.journalSequence != journal.nextSequence) {
+        sblock.journalHead = journal.nextBlock;
+        sblock.journalSequence = journal.nextSequence;
+        sblock_dirty = 1;
+    }
+    if (sblock_dirty) {
+        if (bwrite(DEVICE_IMAGE, 0, (char *) &sblock) < 0) {
+			return -1;
+		}
+        if (bsync(DEVICE_IMAGE) < 0) {
 			return -1;
 		}
+        sblock_dirty = 0;
     }
 
     return 0;
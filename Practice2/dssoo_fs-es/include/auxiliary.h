@@ -24,6 +24,13 @@ int countNumberEntries (int inode_id);
  */
 char * getFather(char * path);
 
+ /*
+  * @brief   Sizes the maps, the inodes tables and their dirty flags for the
+  *          geometry in the superblock. No file is opened afterwards.
+  * @return  0 if success, -1 if there is not enough memory
+  */
+ int tablesAlloc(void);
+
  /*
   * @brief   Search for a free inode and set its value in inodes map to 1
   * @return  ID of the inode available if any, -1 if not
@@ -37,6 +44,13 @@ char * getFather(char * path);
   */
  int alloc(void);
 
+ /*
+  * @brief   Search for a run of up to <want> free data blocks, preferably
+  *          starting at <goal>, and set their values in data blocks map to 1
+  * @return  ID of the first block of the run, its length in <got>, -1 if none
+  */
+ int allocRun(int goal, int want, int *got);
+
  /*
   * @brief   Sets the value of the inode provided to 0 in inodes map
   * @return  0 if success, -1 if inode not found
@@ -49,12 +63,74 @@ char * getFather(char * path);
   */
  int bfree(int block_id);
 
+ /*
+  * @brief   Search for a free entry in a map of <numBits> entries, a word at
+  *          a time, from entry <from> to the end and then from the beginning
+  * @return  Index of the free entry, -1 if the map is full
+  */
+ int bitmapFindFree(char *bitmap, int numBits, int from);
+
+ /*
+  * @brief   Search for a used entry of a map between entries <from> and
+  *          <limit>, a word at a time
+  * @return  Index of the used entry, <limit> if all of them are free
+  */
+ int bitmapFindUsed(char *bitmap, int limit, int from);
+
+ /*
+  * @brief   Counts the free entries of the maps
+  */
+ void bitmapCount(void);
+
  /*
   * @brief   Found the inode ID containing the file passed
   * @return  ID of the inode, -1 if not found
   */
  int namei(char *fname);
 
+ /*
+  * @brief   Hash of a full path for the path index
+  * @return  FNV-1a hash of the path
+  */
+ unsigned int pathHash(char *path);
+
+ /*
+  * @brief   Builds the path index from the inodes in use
+  * @return  0 if success, -1 if error
+  */
+ int nameiBuild(void);
+
+ /*
+  * @brief   Adds an inode to the path index, under its current name
+  */
+ void nameiInsert(int inode_id);
+
+ /*
+  * @brief   Removes an inode from the path index, before its name is cleared
+  */
+ void nameiRemove(int inode_id);
+
+ /*
+  * @brief   Gets the children of a directory, the root if inode_id is negative
+  * @return  Pointer to the list of children
+  */
+ children_t * childrenOf(int inode_id);
+
+ /*
+  * @brief   Rebuilds the children of every directory from the inodes in use
+  */
+ void childrenBuild(void);
+
+ /*
+  * @brief   Appends an inode to the children of its father
+  */
+ void childLink(int inode_id);
+
+ /*
+  * @brief   Removes an inode from the children of its father
+  */
+ void childUnlink(int inode_id);
+
  /*
   * @brief   Return the index of the data block that contains the byte indicated
   *          by the offset
@@ -63,7 +139,259 @@ char * getFather(char * path);
  int bmap(int inode_id, int offset);
 
  /*
-  * @brief   Writes data in memory to the disk image
+  * @brief   Like bmap, also returning in <run> the number of blocks from the
+  *          one found to the end of its extent
+  * @return  Index of the block, -1 if not found
+  */
+ int bmapRun(int inode_id, int offset, int *run);
+
+ /*
+  * @brief   Reads the extent number <index> of an inode
+  * @return  0 if success, -1 otherwise
+  */
+ int extentGet(int inode_id, int index, extent_t *extent);
+
+ /*
+  * @brief   Reads a block of extents or of pointers, all zeros if it is not
+  *          allocated yet
+  * @return  0 if success, -1 otherwise
+  */
+ int extentBlockRead(unsigned int block_id, char *buffer);
+
+ /*
+  * @brief   Tells if a block of extents was allocated after the last commit
+  * @return  1 if so, 0 otherwise
+  */
+ int extentBlockFresh(unsigned int block_id);
+
+ /*
+  * @brief   Allocates a new place for a block of extents, near its old one
+  * @return  0 if success, the new block in <block_id>, -1 otherwise
+  */
+ int extentBlockNew(unsigned int *block_id);
+
+ /*
+  * @brief   Frees a block of extents the inodes no longer point to, once the
+  *          next commit is done if the last one points to it
+  * @return  0 if success, -1 otherwise
+  */
+ int extentBlockRelease(unsigned int block_id);
+
+ /*
+  * @brief   Writes the extent number <index> of an inode, allocating the
+  *          blocks of extents needed to hold it. A block of extents the last
+  *          commit points to is written to a new block instead.
+  * @return  0 if success, -1 otherwise
+  */
+ int extentSet(int inode_id, int index, extent_t *extent);
+
+ /*
+  * @brief   Adds data blocks at the end of a file, in as few extents as possible
+  * @return  0 if success, -1 if not all the blocks could be allocated
+  */
+ int fileGrow(int inode_id, int numBlocks);
+
+ /*
+  * @brief   Frees every data block of an inode, including its blocks of extents
+  * @return  0 if success, -1 otherwise
+  */
+ int freeBlocks(int inode_id);
+
+ /*
+  * @brief   Follows a read of a descriptor: if it continues the previous one
+  *          the window grows and the blocks after it are read in the
+  *          background, otherwise the window collapses
+  */
+ void readAhead(int fd, int offset, int numBytes);
+
+ /*
+  * @brief   Reads bytes from an offset of a file, up to its end
+  * @return  Number of bytes read, -1 in case of error
+  */
+ int fileRead(int inode_id, int start, char *buffer, int numBytes);
+
+ /*
+  * @brief   Writes bytes at an offset of a file, growing it if needed
+  * @return  Number of bytes written, -1 in case of error
+  */
+ int fileWrite(int inode_id, int start, char *buffer, int numBytes);
+
+ /*
+  * @brief   Gathers a small write in the buffer of a descriptor, at its seek
+  *          pointer, until its block is complete or a write lands elsewhere
+  * @return  Number of bytes written, -1 in case of error
+  */
+ int bufferWrite(int fd, char *buffer, int numBytes);
+
+ /*
+  * @brief   Writes the bytes gathered in the buffer of a descriptor
+  * @return  0 if success, -1 in case of error
+  */
+ int bufferFlush(int fd);
+
+ /*
+  * @brief   Takes the lock of a file to read it, once the bytes gathered in
+  *          the buffers of its descriptors are written
+  * @return  0 if success, -1 in case of error, the lock is not taken then
+  */
+ int fileLockRead(int inode_id);
+
+ /*
+  * @brief   Writes the bytes gathered in the buffers of every descriptor of a
+  *          file but <except>, -1 for none
+  * @return  0 if success, -1 in case of error
+  */
+ int bufferFlushInode(int inode_id, int except);
+
+ /*
+  * @brief   Writes data in memory to the disk image: commits the pending
+  *          changes to the journal and checkpoints them
   * @return  0 if success, -1 if error
   */
  int syncFS(void);
+
+ /*
+  * @brief   Lists the blocks of the maps and the inodes table in device order
+  *          with their place in memory, only the dirty ones if <dirty> is 1
+  * @return  Number of blocks listed, only counted if <vec> is NULL
+  */
+ int metadataBlocks(bvec_t *vec, int dirty);
+
+ /*
+  * @brief   Marks the superblock to be written by the next checkpoint
+  */
+ void markSuperblock(void);
+
+ /*
+  * @brief   Marks the inode map block holding the bit of an inode to be
+  *          written by the next checkpoint, and logs the change in the journal
+  */
+ void markInodeMap(int inode_id);
+
+ /*
+  * @brief   Marks the data map block holding the bit of a data block to be
+  *          written by the next checkpoint, and logs the change in the journal
+  */
+ void markDataMap(int block_id);
+
+ /*
+  * @brief   Marks the blocks of the inodes table holding an inode to be
+  *          written by the next checkpoint, and logs the change in the journal
+  */
+ void markInode(int inode_id);
+
+ /*
+  * @brief   Current time in milliseconds, used by the group commit
+  * @return  Milliseconds from an arbitrary point
+  */
+ long journalNow(void);
+
+ /*
+  * @brief   Size of a record of the journal
+  * @return  Number of bytes of a record of the given kind
+  */
+ int journalRecordSize(int kind);
+
+ /*
+  * @brief   Checksum of a journal block, computed with its checksum field set to 0
+  * @return  FNV-1a hash of the block
+  */
+ unsigned int journalChecksum(char *block);
+
+ /*
+  * @brief   Empties the group of changes waiting to be committed, and the
+  *          blocks of extents kept for them
+  */
+ void journalForget(void);
+
+ /*
+  * @brief   Flags of the inodes or map bytes already in the group of changes
+  * @return  Pointer to the flags for changes of the given kind
+  */
+ char *journalLogged(int kind);
+
+ /*
+  * @brief   Journal blocks holding records for every byte of the maps, as
+  *          runs split between blocks, used by mkFS to size the journal
+  * @return  Number of journal blocks
+  */
+ int journalMapBlocks(long long mapBytes);
+
+ /*
+  * @brief   Most journal blocks of a transaction: the journal is never full,
+  *          so that its head and its end only meet when it is empty
+  * @return  Number of journal blocks
+  */
+ int journalMaxBlocks(void);
+
+ /*
+  * @brief   Most inode records of a transaction, so that it fits in
+  *          journalMaxBlocks: the changed bytes of both maps take up to
+  *          journalMapBlocks of them, the inodes the rest
+  * @return  Number of inode records, less than JOURNAL_OP_INODES if the
+  *          journal is too small for the file system
+  */
+ int journalMaxInodes(void);
+
+ /*
+  * @brief   Forgets the changes not committed and places the journal at
+  *          the head stored in the superblock
+  */
+ void journalReset(void);
+
+ /*
+  * @brief   Adds a metadata change to the group waiting to be committed.
+  *          The record is built from the metadata in memory at commit time.
+  */
+ void journalChange(int kind, int id);
+
+ /*
+  * @brief   Adds a data block to a list kept by the journal
+  * @return  0 if success, -1 if there is not enough memory
+  */
+ int blockListAdd(block_list_t *list, unsigned int block_id);
+
+ /*
+  * @brief   Searches a data block in a list kept by the journal
+  * @return  Position of the block in the list, -1 if not found
+  */
+ int blockListFind(block_list_t *list, unsigned int block_id);
+
+ /*
+  * @brief   Begins a metadata operation: the changes of the operations in
+  *          progress are not committed until they end. The pending changes
+  *          are committed first if the inodes of this operation and those in
+  *          progress might not fit in the same transaction.
+  * @return  0 if success, -1 if error, the operation must not go on
+  */
+ int journalBegin(void);
+
+ /*
+  * @brief   Ends a metadata operation. Its changes are committed along with
+  *          those of other operations once they fill a journal block or the
+  *          oldest one is JOURNAL_COMMIT_MS old.
+  * @return  0 if success, -1 if error
+  */
+ int journalEnd(void);
+
+ /*
+  * @brief   Writes the pending changes to the journal as one transaction and
+  *          waits until it is stored. Checkpoints once the next transaction
+  *          might not fit in the journal.
+  * @return  0 if success, -1 if error
+  */
+ int journalCommit(void);
+
+ /*
+  * @brief   Applies to the metadata in memory the transactions committed
+  *          after the last checkpoint, and checkpoints them
+  * @return  0 if success, -1 if error
+  */
+ int journalReplay(void);
+
+ /*
+  * @brief   Writes the metadata blocks marked as dirty to their place in the
+  *          disk image and frees the journal space of the committed transactions
+  * @return  0 if success, -1 if error
+  */
+ int journalCheckpoint(void);
@@ -17,12 +17,57 @@
 #include <unistd.h>
 
 #define BLOCK_SIZE 2048
+#define BCACHE_BLOCKS 64 /* Default capacity of the block cache, in blocks */
+
+#define BACKEND_PREAD 0 /* Positional I/O through the block cache (default) */
+#define BACKEND_MMAP 1  /* Device mapped in memory, blocks copied with memcpy */
+
+#define BQUEUE_DEPTH 32 /* Default number of asynchronous requests in flight */
+#define BREQ_BLOCKS 64  /* Most blocks moved by an asynchronous request */
+
+#define BENGINE_AUTO 0    /* io_uring if the kernel allows it, worker threads otherwise */
+#define BENGINE_URING 1   /* Requests submitted to an io_uring */
+#define BENGINE_THREADS 2 /* Requests served by a pool of worker threads */
+
+#define BREQ_PENDING 1 /* Result of a request not completed yet */
+
+/* Block of a vectored transfer */
+typedef struct {
+  int blockNumber; /* Block of the device */
+  char *buffer;    /* BLOCK_SIZE bytes to read into or write from */
+} bvec_t;
+
+/* Asynchronous request for consecutive blocks */
+typedef struct breq {
+  int write;         /* 1 to write the blocks, 0 to read them */
+  bvec_t *vec;       /* Consecutive blocks, each one with its own buffer */
+  int count;         /* Entries of vec, at most BREQ_BLOCKS */
+  int result;        /* BREQ_PENDING, then 0 if completed or -1 if it failed */
+  struct breq *next; /* Used by the block layer until the request is waited for */
+} breq_t;
+
+/* Counters of the block cache */
+typedef struct {
+  long hits;       /* Accesses served from memory */
+  long misses;     /* Accesses that needed a slot to be filled */
+  long evictions;  /* Valid blocks replaced to make room */
+  long writebacks; /* Dirty blocks written to the device */
+  long reads;      /* Blocks read from the device */
+  long requests;   /* Read and write calls issued to the device */
+  long prefetches; /* Blocks read ahead, in the background */
+} bstats_t;
 
 
 /****************/
 /* Disk access. */
 /****************/
 
+/*
+ * The functions of the block layer may be called from several threads: they
+ * serve one caller at a time, except for the device reads of blocks missing
+ * from the cache, which overlap.
+ */
+
 /*
  * Reads a block from the device and stores it in a buffer.
  * Returns 0 if correct or -1 in case of error, including short
@@ -35,4 +80,182 @@ int bread(char *deviceName, int blockNumber, char *buffer);
  * Returns 0 if correct or -1 in case of error.
  */
 int bwrite(char *deviceName, int blockNumber, char*buffer);
+
+/*
+ * Opens the device once and caches its descriptor and size, so that the
+ * following bread/bwrite calls are served with positional I/O and no
+ * path lookup. bread/bwrite open the device on demand if needed.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bopen(char *deviceName);
+
+/*
+ * Releases the device opened by bopen.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bclose(void);
+
+/*
+ * Returns the size in bytes of the device, opening it if needed,
+ * or -1 in case of error.
+ */
+long bsize(char *deviceName);
+
+/*
+ * Selects how the next bopen accesses the device, BACKEND_PREAD or
+ * BACKEND_MMAP. With BACKEND_MMAP the block cache is not used and
+ * bflush maps onto msync.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bsetbackend(int backend);
+
+/*
+ * Writes length bytes from a buffer into a block, starting at offset, without
+ * reading the rest of the block: the cache keeps only the bytes written and
+ * writes back only them, unless the block is read or written apart before.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bwritepart(char *deviceName, int blockNumber, int offset, int length, char *buffer);
+
+/*
+ * Reads a list of blocks. Entries for consecutive blocks are read from the
+ * device with a single preadv; blocks found in the cache are copied from it
+ * and the others bypass it.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int breadv(char *deviceName, bvec_t *vec, int count);
+
+/*
+ * Writes a list of blocks. Entries for consecutive blocks are written to the
+ * device with a single pwritev; cached copies are updated and left clean.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bwritev(char *deviceName, bvec_t *vec, int count);
+
+/*
+ * Reads count consecutive blocks, starting at firstBlock, into buffer.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int breadn(char *deviceName, int firstBlock, int count, char *buffer);
+
+/*
+ * Writes count consecutive blocks, starting at firstBlock, from buffer.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bwriten(char *deviceName, int firstBlock, int count, char *buffer);
+
+/*
+ * Reads length bytes of a block into a buffer, starting at offset.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int breadpart(char *deviceName, int blockNumber, int offset, int length, char *buffer);
+
+/*
+ * Returns a read-only pointer to the content of a block without copying
+ * it, NULL in case of error. The pointer is only valid until the next
+ * call to the block layer, from any thread: with several threads use
+ * breadpart instead.
+ */
+const char *bget(char *deviceName, int blockNumber);
+
+/*
+ * Brings a list of blocks into the cache. The missing ones are read from
+ * the device together, with overlapped requests; at most half of the cache
+ * is filled, the rest of the list is ignored.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bprefetch(char *deviceName, int *blocks, int count);
+
+/*
+ * Like bprefetch, but returns once the reads are submitted to the queue of
+ * asynchronous requests: the blocks are read in the background and an access
+ * to one of them waits for its read only. Without a queue it is bprefetch.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int breadahead(char *deviceName, int *blocks, int count);
+
+
+/****************/
+/* Block cache. */
+/****************/
+
+/*
+ * bread/bwrite are served by a write-back cache with LRU replacement.
+ * Written blocks stay dirty in memory until they are evicted, bflush is
+ * called or the device is closed.
+ */
+
+/*
+ * Writes every dirty block of the cache to the device.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bflush(char *deviceName);
+
+/*
+ * Flushes the cache and waits until the device has stored every block
+ * written so far.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bsync(char *deviceName);
+
+/*
+ * Sets the capacity of the cache in blocks, 0 disables it. Dirty blocks
+ * are flushed before resizing.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bsetcache(int numBlocks);
+
+/*
+ * Copies the cache counters into stats.
+ */
+void bstats(bstats_t *stats);
+
+/*
+ * Resets the cache counters.
+ */
+void bresetstats(void);
+
+
+/*********************/
+/* Asynchronous I/O. */
+/*********************/
+
+/*
+ * Requests are moved between the device and their buffers in the background
+ * and bypass the cache: dirty blocks must be flushed before reading them and
+ * buffers must not be used until the request is waited for. Vectored and
+ * cache transfers of several runs of blocks are also spread over requests,
+ * so that the device serves them at the same time.
+ */
+
+/*
+ * Sets the number of requests in flight, 0 serves them synchronously, and
+ * the engine serving them, one of BENGINE_*. Waits for the requests in flight.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bsetqueue(int depth, int engine);
+
+/*
+ * Returns the engine serving the requests, BENGINE_URING or BENGINE_THREADS,
+ * or -1 if none was started yet.
+ */
+int bqueueengine(void);
+
+/*
+ * Submits a request, waiting for a free place if the queue is full.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bsubmit(char *deviceName, breq_t *req);
+
+/*
+ * Waits for a submitted request to complete, oldest completion first.
+ * Returns the request or NULL if none is pending.
+ */
+breq_t *bwait(void);
+
+/*
+ * Waits for every submitted request.
+ * Returns 0 if all of them completed or -1 if any failed.
+ */
+int bwaitall(void);
 #endif
@@ -14,16 +14,35 @@
 #include "blocks_cache.h" // Headers for block managing (read/write)
 
 #define DEVICE_IMAGE "disk.dat" // Device name
-#define MAX_FILE_SIZE 2048      // Maximum file size, in bytes
+#define MAX_FILE_SIZE (512 * 1024 * 1024) // Maximum file size, in bytes
+#define MAX_DEVICE_SIZE (64LL * 1024 * 1024 * 1024) // Maximum device size, in bytes
+#define MAX_INODES (16 * 1024 * 1024) // Maximum number of inodes
 #define FS_SEEK_CUR 0
 #define FS_SEEK_END 1
 #define FS_SEEK_BEGIN 2
+#define FS_OPEN_READ 1  // Descriptor used to read
+#define FS_OPEN_WRITE 2 // Descriptor used to write
+#define FS_OPEN_RDWR (FS_OPEN_READ | FS_OPEN_WRITE)
+
+/* Layout of a new file system */
+typedef struct {
+	long long deviceSize; // Device size, in bytes
+	int numInodes;        // Number of inodes, 0 for one every bytesPerInode bytes of device
+	int bytesPerInode;    // Device bytes per inode, used when numInodes is 0
+	int maxEntries;       // Maximum number of entries per directory
+} geometry_t;
 
 /*
  * @brief 	Generates the proper file system structure in a storage device, as designed by the student.
  * @return 	0 if success, -1 otherwise.
  */
 int mkFS(long deviceSize);
+
+/*
+ * @brief 	Generates the file system structure in a storage device, with the given geometry.
+ * @return 	0 if success, -1 otherwise.
+ */
+int mkFSGeometry(geometry_t *geometry);
 /*
  * @brief 	Mounts a file system in the simulated device.
  * @return 	0 if success, -1 otherwise.
@@ -49,11 +68,18 @@ int createFile(char *path);
 int removeFile(char *path);
 
 /*
- * @brief	Opens an existing file.
+ * @brief	Opens an existing file for reading and writing. A file can be opened
+ *          many times, every descriptor with its own seek pointer.
  * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
  */
 int openFile(char *path);
 
+/*
+ * @brief	Opens an existing file for reading, writing or both (FS_OPEN_*).
+ * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
+ */
+int openFileMode(char *path, int mode);
+
 /*
  * @brief	Closes a file.
  * @return	0 if success, -1 otherwise.
@@ -72,6 +98,25 @@ int readFile(int fileDescriptor, void *buffer, int numBytes);
  */
 int writeFile(int fileDescriptor, void *buffer, int numBytes);
 
+/*
+ * @brief	Reads a number of bytes from an offset of a file, without moving its seek pointer.
+ * @return	Number of bytes properly read, -1 in case of error.
+ */
+int readAt(int fileDescriptor, void *buffer, int numBytes, long offset);
+
+/*
+ * @brief	Writes a number of bytes at an offset of a file, up to its end, without moving its seek pointer.
+ * @return	Number of bytes properly written, -1 in case of error.
+ */
+int writeAt(int fileDescriptor, void *buffer, int numBytes, long offset);
+
+/*
+ * @brief	Writes the bytes of small writes that the file still keeps in memory.
+ *          Seeking, reading and closing the file also write them.
+ * @return	0 if success, -1 otherwise.
+ */
+int flushFile(int fileDescriptor);
+
 /*
  * @brief	Modifies the position of the seek pointer of a file.
  * @return	0 if succes, -1 otherwise.
@@ -96,4 +141,16 @@ int rmDir(char *path);
  */
 int lsDir(char *path, int inodesDir[10], char namesDir[10][33]);
 
+/*
+ * @brief	Lists up to maxItems entries of a directory and stores the inodes and names in arrays.
+ * @return	The number of items stored, -1 if the directory does not exist, -2 in case of error..
+ */
+int lsDirEx(char *path, int *inodesDir, char namesDir[][33], int maxItems);
+
+/*
+ * @brief	Fragmentation of the files: average number of extents of the files holding data.
+ * @return	Average extents per file (1 meaning no fragmentation), 0 if no file holds data.
+ */
+double fragmentationFS(void);
+
 #endif
@@ -6,19 +6,41 @@
  * @date	01/03/2017
  */
 
+#include <pthread.h>
+
 #define MAGIC_NUMBER 0x000D5500 /* Superblock magic number (slides) */
 
 /* Preguntar número de inodos */
 
-#define MAX_FILES 40 /* Maxium number of files */
-#define MAX_ENTRIES 10 /* Maxium number of entries per inode */
+#define MAX_FILES 40 /* Maxium number of files made by mkFS (mkFSGeometry chooses any) */
+#define MAX_ENTRIES 10 /* Maxium number of entries per inode made by mkFS, and listed by lsDir */
 #define MAX_FILE_NAME 32 /* Longest file or directory name */
 #define MAX_PATH_LEN_FILE 132 /* Longest route name */
+#define MAX_OPEN_FILES 64 /* Descriptors open at the same time, a file may hold many */
 #define MAX_FOLDER_LEVEL 3 /* Deepest folder level */
 #define TYPE_FILE 1 /* File type inode */
 #define TYPE_FOLDER 2 /* Folder type inode */
+#define N_DIRECT_EXTENTS 6 /* Extents stored in the inode itself */
+#define POINTERS_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(unsigned int))) /* Pointers held by a block of pointers */
+#define EXTENTS_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(extent_t))) /* Extents held by a block of extents */
+#define NULL_BLOCK 0 /* Pointer to no block (data block 0 is reserved by mkFS) */
+#define READ_BATCH (BCACHE_BLOCKS / 2) /* Blocks of a read handed to the device together */
+#define WRITE_BATCH (BCACHE_BLOCKS / 2) /* Whole blocks of a write handed to the device together */
+#define READAHEAD_MIN 4 /* Blocks read ahead once a reader turns sequential */
+#define READAHEAD_MAX (BCACHE_BLOCKS / 4) /* Most blocks read ahead of a sequential reader */
+
+#define JOURNAL_MAGIC 0x00D5A10E /* Magic number of the journal blocks */
+#define JOURNAL_BLOCKS 16 /* Journal blocks reserved by mkFS on top of twice those holding both maps */
+#define JOURNAL_COMMIT_MS 50 /* Maximum age of an uncommitted change at the end of an operation */
+#define JOURNAL_IMAP 1 /* Change: inode map bit. Record, only replayed: inode map bit (id, value) */
+#define JOURNAL_BMAP 2 /* Change: data map bit. Record, only replayed: data map bit (id, value) */
+#define JOURNAL_INODE 3 /* Record: whole inode (id, inode_t) */
+#define JOURNAL_IMAP_BYTES 4 /* Record: bytes of the inode map (first byte, length, bytes) */
+#define JOURNAL_BMAP_BYTES 5 /* Record: bytes of the data map (first byte, length, bytes) */
+#define JOURNAL_GAP 8 /* Unchanged map bytes logged to join two runs of changed ones, instead of a new record */
+#define JOURNAL_OP_INODES 1 /* Most inodes changed by one operation: the file or directory it works on */
 
-#define bitmap_getbit(bitmap_, i_) (bitmap_[i_ >> 3] & (1 << (i_ & 0x07)))
+#define bitmap_getbit(bitmap_, i_) ((bitmap_)[(i_) >> 3] & (1 << ((i_) & 0x07)))
 static inline void bitmap_setbit(char *bitmap_, int i_, int val_) {
   if (val_)
     bitmap_[(i_ >> 3)] |= (1 << (i_ & 0x07));
@@ -26,7 +48,9 @@ static inline void bitmap_setbit(char *bitmap_, int i_, int val_) {
     bitmap_[(i_ >> 3)] &= ~(1 << (i_ & 0x07));
 }
 
-/* Superblock structure */
+/* Superblock structure. Only the device size is kept in bytes and needs 64 bits:
+ * the other fields count blocks or inodes, bounded by MAX_DEVICE_SIZE / BLOCK_SIZE
+ * and MAX_INODES, so they keep the 32-bit layout of the original superblock */
 typedef struct {
 
   unsigned int magicNumber;                             /* Superblock Magic Number */
@@ -36,31 +60,162 @@ typedef struct {
   unsigned int firstInodeBlock;                              /* First device inode */
   unsigned int numDataBlocks;                            /* Data Blocks Number */
   unsigned int firstDataBlock;                          /* First device data block */
-  unsigned int deviceSize;                              /* Total disk space (in bytes) */
-  char padding[BLOCK_SIZE - 8 * sizeof(unsigned int)];  /* Padding field (to complete a block) */
+  unsigned int maxEntries;                              /* Maximum number of entries per directory */
+  unsigned long long deviceSize;                        /* Total disk space (in bytes) */
+  unsigned int firstJournalBlock;                       /* First device journal block */
+  unsigned int numJournalBlocks;                        /* Journal Number of blocks */
+  unsigned int journalHead;                             /* Journal block of the first transaction not checkpointed */
+  unsigned int journalSequence;                         /* Sequence number of that transaction */
+  unsigned int inodeHint;                               /* Inode where the search of a free one starts */
+  unsigned int dataHint;                                /* Data block where the search of a free one starts */
+  char padding[BLOCK_SIZE - 14 * sizeof(unsigned int) - sizeof(unsigned long long)]; /* Padding field (to complete a block) */
 
 } superblock_t;
 
+_Static_assert(sizeof(superblock_t) == BLOCK_SIZE, "the superblock must fill a block");
+_Static_assert(MAX_DEVICE_SIZE / BLOCK_SIZE <= 0xFFFFFFFFLL, "block numbers must fit in the 32-bit fields");
+_Static_assert(MAX_INODES <= 0xFFFFFFFFLL, "inode numbers must fit in the 32-bit fields");
+_Static_assert(MAX_FILE_SIZE <= 0x7FFFFFFFLL, "file sizes and offsets must fit in the 32-bit fields and int offsets");
+
+/* Run of data blocks contiguous on the device */
+typedef struct {
+  unsigned int start;  // First data block of the run
+  unsigned int length; // Number of data blocks of the run
+} extent_t;
+
 /* inode structure */
 typedef struct {
   char name [MAX_PATH_LEN_FILE + 1]; // Due to the final character \0
-  unsigned int dataBlockPos; // Position of the datablock
+  extent_t extents[N_DIRECT_EXTENTS]; // First extents of the file, in file order
+  unsigned int indirectBlock; // Block of extents following the direct ones
+  unsigned int doubleIndirectBlock; // Block of pointers to blocks of extents
+  unsigned int numExtents; // Extents of the file
+  unsigned int numBlocks; // Data blocks of the file, without the blocks of extents
   unsigned int type; // Type of inode
-  unsigned int size; // Size of inode
+  unsigned int size; // Bytes written to the file, at most MAX_FILE_SIZE
   unsigned int father; // inode of father inode
 } inode_t;
 
+/* Header of a journal block. A transaction is written as 'count' consecutive
+ * journal blocks sharing the same sequence number, followed by its records */
+typedef struct {
+  unsigned int magic;    /* JOURNAL_MAGIC */
+  unsigned int sequence; /* Transaction the block belongs to */
+  unsigned int index;    /* Position of the block inside the transaction */
+  unsigned int count;    /* Number of blocks of the transaction */
+  unsigned int numBytes; /* Bytes of records stored in this block */
+  unsigned int checksum; /* Checksum of the block with this field set to 0 */
+} journal_header_t;
+
+#define JOURNAL_PAYLOAD (BLOCK_SIZE - sizeof(journal_header_t)) /* Bytes of records per journal block */
+#define JOURNAL_MAP_RECORD(length_) ((int) (1 + sizeof(int) + sizeof(unsigned short) + (length_))) /* Bytes of a record of map bytes */
+
+/* Metadata change waiting to be committed to the journal */
+typedef struct {
+  int kind; /* JOURNAL_IMAP, JOURNAL_BMAP or JOURNAL_INODE */
+  int id;   /* Inode affected, or byte of the map holding the bit changed */
+} journal_change_t;
+
+/* Data blocks kept by the journal until the next commit */
+typedef struct {
+  unsigned int *blocks; /* Data block ids, in no order */
+  int count;
+  int max;              /* Allocated size of blocks */
+} block_list_t;
+
 /* Metadata of the FS */
 
 superblock_t sblock;  /* FS superblock*/
 
-inode_t inodes [MAX_FILES];
+inode_t *inodes; /* Inodes table, sblock.numInodes entries */
 
 char *i_map;  /* Map of used iNodes */
 char *b_map;  /* Map of used dataBlocks */
 
-/* Auxiliary structure for inode */
+/* Free entries of the maps, counted at mount so that a full device is detected at once */
+int i_free;  /* Free iNodes */
+int b_free;  /* Free dataBlocks */
+
+/* Locks of the maps, their free entries and their hints in the superblock */
+pthread_mutex_t i_map_lock;
+pthread_mutex_t b_map_lock;
+
+/* Number of blocks used by the inodes table */
+#define INODE_BLOCKS ((sblock.numInodes * sizeof(inode_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+/* Dirty flags of the metadata: syncFS only writes the blocks marked here */
+int sblock_dirty;                 /* 1 if the superblock changed */
+char *i_map_dirty;                /* One flag per inode map block */
+char *b_map_dirty;                /* One flag per data map block */
+char *inodes_dirty;               /* One flag per inodes table block */
+
+/* Metadata changes not committed to the journal yet (group commit) */
 struct {
+  journal_change_t *changes; /* Changes in the order they were made */
+  int numChanges;
+  int maxChanges;            /* Allocated size of changes */
+  int numInodes;             /* Changes of inodes, each one a record */
+  int maxInodes;             /* Most changes of inodes of a transaction, from journalMaxInodes */
+  int active;                /* Operations between journalBegin and journalEnd */
+  int numBytes;              /* Bytes the records of the changes will take */
+  char *inodeLogged;         /* 1 if the inode is already in changes, one flag per inode */
+  char *imapLogged;          /* 1 if the inode map byte is already in changes, one flag per byte */
+  char *bmapLogged;          /* 1 if the data map byte is already in changes, one flag per byte */
+  block_list_t fresh;        /* Blocks of extents allocated since the last commit, changed in place */
+  block_list_t stale;        /* Blocks of extents the last commit points to and the inodes no longer
+                              * do, freed by the next commit */
+  long firstChange;          /* Time (ms) of the oldest change, -1 if none */
+  unsigned int nextBlock;    /* Journal block where the next transaction starts */
+  unsigned int nextSequence; /* Sequence number of the next transaction */
+  pthread_mutex_t lock;      /* Taken to add a change or mark metadata as dirty */
+  pthread_rwlock_t opLock;   /* Shared by the operations changing metadata (journalBegin to
+                              * journalEnd), exclusive while their records are built */
+} journal;
+
+/* Children of a directory, kept in creation order */
+typedef struct {
+  int first; /* First child inode, -1 if empty */
+  int last;  /* Last child inode, -1 if empty */
+  int count; /* Number of children */
+} children_t;
+
+/* Auxiliary structure for inode */
+typedef struct {
+  pthread_rwlock_t lock; /* Shared to read a file, exclusive to change it or its descriptors */
+  int opened; /* Number of descriptors of the file, 0 if it is closed */
+  int buffered; /* Descriptors of the file with bytes in their write buffer */
+  int hashNext; /* Next inode in the same bucket of the path index, -1 if last */
+  children_t children; /* Children of a directory inode */
+  int nextSibling; /* Next child of the same father, -1 if last */
+  int prevSibling; /* Previous child of the same father, -1 if first */
+} inode_x_t;
+
+/* Entry of the open-file table, one per file descriptor */
+typedef struct {
+  pthread_mutex_t lock; /* Taken by the calls using the descriptor */
+  int opened; /* 0 if the descriptor is free, 1 if in use */
+  int inode; /* Inode of the open file */
+  int mode; /* FS_OPEN_READ, FS_OPEN_WRITE or both */
   int position; /* Position of the file seek pointer */
-  int opened; /* 0 if file is closed, 1 if opened */
-} inodes_x[MAX_FILES];
+  int raNext; /* Position where the next read continues a sequential one */
+  int raWindow; /* Blocks read ahead of the reader, 0 if its reads are random */
+  int raEnd; /* First file block not read ahead yet */
+  char *buffer; /* Image of the block where the small writes are gathered, NULL if none yet */
+  int bufferStart; /* Position of the first byte gathered in the buffer */
+  int bufferBytes; /* Number of bytes gathered in the buffer, 0 if empty */
+} file_t;
+
+inode_x_t *inodes_x; /* Auxiliary structure of every inode, sblock.numInodes entries */
+
+file_t files[MAX_OPEN_FILES]; /* Open-file table, indexed by file descriptor */
+pthread_mutex_t files_lock;   /* Taken to take or release an entry of the table */
+
+/* Taken exclusive by the calls adding or removing names, shared by the ones
+ * looking them up: guards the path index and the children of the directories */
+pthread_rwlock_t namespace_lock;
+
+children_t root_children; /* Children of the root directory */
+
+/* Path index used by namei: hash of the full path -> chain of inodes */
+int *namei_buckets; /* First inode of each bucket, -1 if empty */
+int namei_mask;     /* Number of buckets - 1, the number is a power of two */
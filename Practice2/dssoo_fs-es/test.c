@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include "include/filesystem.h"
 
 // Color definitions for asserts
@@ -19,16 +21,191 @@
 
 #define N_BLOCKS 60					  // Number of blocks in the device
 #define DEV_SIZE N_BLOCKS *BLOCK_SIZE // Device size, in bytes
+#define BIG_BLOCKS (4 * N_BLOCKS)	  // Number of blocks of the bigger file systems
+#define ASYNC_BLOCKS 40				  // Blocks past the bigger file system moved by asynchronous requests
+
+#ifndef DISK_BLOCKS
+#define DISK_BLOCKS 300 // Blocks of disk.dat, made by "make check" with TEST_BLOCKS
+#endif
+
+_Static_assert(BIG_BLOCKS + ASYNC_BLOCKS <= DISK_BLOCKS, "disk.dat is too small for the tests");
+
+#define N_THREADS 4	   // Threads using the file system at the same time
+#define THREAD_ROUNDS 20 // Files written and read by each thread
+
+#define CRASH_ROUNDS 24 // Files written before the crash, committed one after another
+
+#define BURST_FILES 30 // Files created by each thread before the crash, half of them removed after,
+                       // few enough for the files of every thread to fit in the data blocks at once
+
+#define RACE_BLOCKS 8	 // Blocks past the bigger file system read and written by several threads
+#define RACE_ROUNDS 20000 // Reads or writes of those blocks by each thread
+
+#define FRAG_EXTENTS 8 // Extents of the file grown before the crash, more than the inode holds
+
+char shared[3 * BLOCK_SIZE + 20]; // Content of the file read by every thread
+
+/*
+ * @brief	Reads the shared file and writes, reads back and removes a file of its
+ *          own, THREAD_ROUNDS times, while the other threads do the same.
+ * @return	NULL if success, the argument otherwise.
+ */
+void *worker(void *arg)
+{
+	int id = *(int *) arg;
+	char path[16], data[2 * BLOCK_SIZE + 100], back[3 * BLOCK_SIZE + 20];
+	int i, j, fd, ret = 0;
+
+	sprintf(path, "/thread%d", id);
+	for (j = 0; j < sizeof(data); j++) {
+		data[j] = (char) (j * 7 + id);
+	}
+
+	for (i = 0; i < THREAD_ROUNDS && ret == 0; i++) {
+		fd = openFileMode("/small.txt", FS_OPEN_READ);
+		ret += readAt(fd, back, sizeof(back), 0) == sizeof(shared) && memcmp(back, shared, sizeof(shared)) == 0 ? 0 : -1;
+		ret += closeFile(fd);
+
+		/* Small writes go through the buffer of the descriptor, the block through the cache */
+		ret += createFile(path);
+		fd = openFile(path);
+		for (j = 0; j < 100; j += 25) {
+			ret += writeFile(fd, data + j, 25) == 25 ? 0 : -1;
+		}
+		ret += writeFile(fd, data + 100, 2 * BLOCK_SIZE) == 2 * BLOCK_SIZE ? 0 : -1;
+		ret += readAt(fd, back, sizeof(back), 0) == sizeof(data) && memcmp(back, data, sizeof(data)) == 0 ? 0 : -1;
+		ret += closeFile(fd);
+		ret += removeFile(path);
+	}
+
+	return ret == 0 ? NULL : arg;
+}
+
+/*
+ * @brief	Creates BURST_FILES files in the directory of the thread and removes
+ *          the even ones, while the other threads do the same.
+ * @return	NULL if success, the argument otherwise.
+ */
+void *burstWorker(void *arg)
+{
+	char path[32];
+	int k, ret = 0;
+
+	for (k = 0; k < BURST_FILES; k++) {
+		sprintf(path, "/b%d/f%d", *(int *) arg, k);
+		ret += createFile(path);
+	}
+	for (k = 0; k < BURST_FILES; k += 2) {
+		sprintf(path, "/b%d/f%d", *(int *) arg, k);
+		ret += removeFile(path);
+	}
+
+	return ret == 0 ? NULL : arg;
+}
+
+/*
+ * @brief	Checks that the files left by burstWorker in the directory of a thread
+ *          are those of the first operations of the thread, the others lost.
+ * @return	0 if they are, -1 otherwise.
+ */
+int burstCheck(int id)
+{
+	char path[32];
+	int exists[BURST_FILES];
+	int k, fd, done;
+
+	for (k = 0; k < BURST_FILES; k++) {
+		sprintf(path, "/b%d/f%d", id, k);
+		fd = openFile(path);
+		exists[k] = fd >= 0;
+		if (fd >= 0) {
+			closeFile(fd);
+		}
+	}
+
+	/* Try every number of operations done */
+	for (done = 0; done <= BURST_FILES + BURST_FILES / 2; done++) {
+		for (k = 0; k < BURST_FILES; k++) {
+			int expected = done <= BURST_FILES ? k < done : (k % 2 == 1 || k >= 2 * (done - BURST_FILES));
+			if (exists[k] != expected) {
+				break;
+			}
+		}
+		if (k == BURST_FILES) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * @brief	Reads RACE_BLOCKS uncached blocks RACE_ROUNDS times, while other
+ *          threads write them, and checks that no block mixes two writes.
+ * @return	NULL if success, the argument otherwise.
+ */
+void *raceReader(void *arg)
+{
+	char *blocks = malloc(RACE_BLOCKS * BLOCK_SIZE);
+	bvec_t vec[RACE_BLOCKS];
+	int i, j, k, ret = blocks == NULL ? -1 : 0;
+
+	for (i = 0; i < RACE_ROUNDS && ret == 0; i++) {
+		for (j = 0; j < RACE_BLOCKS; j++) {
+			vec[j].blockNumber = BIG_BLOCKS + j;
+			vec[j].buffer = blocks + j * BLOCK_SIZE;
+		}
+		ret += breadv(DEVICE_IMAGE, vec, RACE_BLOCKS);
+		for (j = 0; j < RACE_BLOCKS && ret == 0; j++) {
+			for (k = 1; k < BLOCK_SIZE && vec[j].buffer[k] == vec[j].buffer[0]; k++);
+			ret += k == BLOCK_SIZE ? 0 : -1;
+		}
+	}
+
+	free(blocks);
+	return ret == 0 ? NULL : arg;
+}
+
+/*
+ * @brief	Writes RACE_BLOCKS blocks RACE_ROUNDS times, each block filled with
+ *          one byte, and closes the device now and then.
+ * @return	NULL if success, the argument otherwise.
+ */
+void *raceWriter(void *arg)
+{
+	char *blocks = malloc(RACE_BLOCKS * BLOCK_SIZE);
+	bvec_t vec[RACE_BLOCKS];
+	int i, j, ret = blocks == NULL ? -1 : 0;
+
+	for (i = 0; i < RACE_ROUNDS && ret == 0; i++) {
+		memset(blocks, 'a' + i % 26, RACE_BLOCKS * BLOCK_SIZE);
+		for (j = 0; j < RACE_BLOCKS; j++) {
+			vec[j].blockNumber = BIG_BLOCKS + j;
+			vec[j].buffer = blocks + j * BLOCK_SIZE;
+		}
+		ret += bwritev(DEVICE_IMAGE, vec, RACE_BLOCKS);
+		if (i % 16 == 15) {
+			ret += bclose(); // The next call opens the device again
+		}
+	}
+
+	free(blocks);
+	return ret == 0 ? NULL : arg;
+}
 
 int main()
 {
 
-	int ret, ret2, fd1;
+	int ret, ret2, fd1, fd2;
 	int inodesDir[10];
 	char namesDir[10][33];
 	char * buffer = malloc(sizeof(char) * 13);
 	char * buffer2 = malloc(sizeof(char) * 4);
 
+	if (bsize(DEVICE_IMAGE) < (long) DISK_BLOCKS * BLOCK_SIZE) {
+		fprintf(stdout, "disk.dat must have at least %d blocks, run ./create_disk %d or make check\n", DISK_BLOCKS, DISK_BLOCKS);
+		return -1;
+	}
+
 	fprintf(stdout, "\n%sTest 1: %sTry to make a very small file system\n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
 	ret = mkFS(51199);
 	if (ret < 0)
@@ -40,7 +217,7 @@ int main()
 	}
 
 	fprintf(stdout, "%sTest 2: %sTry to make a very big file system\n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
-	ret = mkFS(1024*1024*11);
+	ret = mkFS(MAX_DEVICE_SIZE + 1);
 	if (ret < 0)
 	{
 		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST mkFS ", ANSI_COLOR_GREEN, "FAILED\n\n", ANSI_COLOR_RESET);
@@ -174,15 +351,14 @@ int main()
 		return -1;
 	}
 
-	fprintf(stdout, "%sTest 28: %sTry to open a file already openned\n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	fprintf(stdout, "%sTest 28: %sOpen a file already openned, with another descriptor\n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
 	ret = openFile("/test.txt");
-	if (ret < 0)
+	if (ret < 0 || ret == fd1 || closeFile(ret) < 0)
 	{
-		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST openFile ", ANSI_COLOR_GREEN, "FAILED\n\n", ANSI_COLOR_RESET);
-	} else {
-		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST openFile ", ANSI_COLOR_RED, "SUCCESS\n\n", ANSI_COLOR_RESET);
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST openFile ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
 		return -1;
 	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST openFile ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
 
 	///////
 
@@ -844,12 +1020,12 @@ int main()
 		return -1;
 	}
 
-	fprintf(stdout, "%sTest 50: %sTry write more bytes than what is available in buffer \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	fprintf(stdout, "%sTest 50: %sTry write bytes past a zero byte of the buffer \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
 	ret2 = lseekFile(fd1, 0, FS_SEEK_BEGIN);
-	ret = writeFile(fd1, "buffer", 20);
+	ret = writeFile(fd1, "buf\0er", 6); // Binary data, nothing is cut at the zero
 	ret2 = lseekFile(fd1, 0, FS_SEEK_BEGIN);
 	ret2 = readFile(fd1, buffer, 13);
-	if (ret != 6 || ret2 != 13 || strcmp(buffer, "bufferI'm Poe")!=0 )
+	if (ret != 6 || ret2 != 13 || memcmp(buffer, "buf\0erI'm Poe", 13)!=0 )
 	{
 		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST writeFile ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
 		return -1;
@@ -870,11 +1046,11 @@ int main()
 	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST writeFile ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
 	memset(buffer,0,strlen(buffer));
 
-	fprintf(stdout, "%sTest 52: %sTry write more bytes than what is available in file \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	fprintf(stdout, "%sTest 52: %sTry write past the end of the file, which makes it grow \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
 	ret2 = lseekFile(fd1, 0, FS_SEEK_END);
 	ret2 = lseekFile(fd1, -5, FS_SEEK_CUR);
 	ret = writeFile(fd1, "Hello I'm Poe", 13);
-	if (ret != 5)
+	if (ret != 13)
 	{
 		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST writeFile ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
 		return -1;
@@ -884,7 +1060,7 @@ int main()
 	fprintf(stdout, "%sTest 44: %sTry read more bytes than what is available in file \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
 	ret2 = lseekFile(fd1, -5, FS_SEEK_CUR);
 	ret = readFile(fd1, buffer, 13);
-	if (ret != 5 || strcmp(buffer, "Hello")!=0)
+	if (ret != 5 || strcmp(buffer, "m Poe")!=0)
 	{
 		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST readFile ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
 		return -1;
@@ -908,6 +1084,564 @@ int main()
 	memset(buffer,0,strlen(buffer));
 	memset(buffer,0,strlen(buffer2));
 
+	fprintf(stdout, "%sTest 82: %sCheck that repeated reads are served by the block cache \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	bstats_t stats;
+	bresetstats();
+	ret = lseekFile(fd1, 0, FS_SEEK_BEGIN);
+	ret = readFile(fd1, buffer, 4);
+	ret2 = lseekFile(fd1, 0, FS_SEEK_BEGIN);
+	ret2 = readFile(fd1, buffer, 4);
+	bstats(&stats);
+	if (ret != 4 || ret2 != 4 || stats.hits < 1 || stats.misses != 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST block cache ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST block cache ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+	memset(buffer,0,strlen(buffer));
+
+	fprintf(stdout, "%sTest 83: %sCheck that the file system works on a memory-mapped device \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	closeFile(fd1);
+	ret = unmountFS();
+	bsetbackend(BACKEND_MMAP);
+	ret2 = mountFS();
+	fd1 = openFile("/test.txt");
+	if (ret < 0 || ret2 < 0 || fd1 < 0 || writeFile(fd1, "Mm", 2) != 2 || lseekFile(fd1, 0, FS_SEEK_BEGIN) < 0
+		|| readFile(fd1, buffer, 4) != 4 || strcmp(buffer, "Mm&i") != 0 || closeFile(fd1) < 0 || unmountFS() < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST mmap backend ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	bsetbackend(BACKEND_PREAD);
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST mmap backend ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+	memset(buffer,0,strlen(buffer));
+
+	fprintf(stdout, "%sTest 84: %sCheck that committed operations survive a crash \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	ret = mountFS();
+	ret2 = createFile("/crash1.txt");
+	usleep(100000); // Longer than the group commit interval
+	ret2 += createFile("/crash2.txt");
+	ret2 += mountFS(); // Mount again without unmounting, as after a crash
+	fd1 = openFile("/crash1.txt");
+	fd2 = openFile("/crash2.txt");
+	if (ret < 0 || ret2 < 0 || fd1 < 0 || fd2 < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST journal replay ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST journal replay ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 85: %sWrite and read a file spanning direct and indirect blocks \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	int bigSize = 20 * BLOCK_SIZE - 960;
+	char *big = malloc(bigSize + 1);
+	char *big2 = calloc(bigSize + 1, 1);
+	for (int i = 0; i < bigSize; i++) {
+		big[i] = 'a' + i % 26;
+	}
+	big[bigSize] = '\0';
+	closeFile(fd1);
+	closeFile(fd2);
+	ret = unmountFS();
+	ret += mkFS(DEV_SIZE);
+	ret += mountFS();
+	ret += createFile("/big.txt");
+	fd1 = openFile("/big.txt");
+	ret2 = writeFile(fd1, big, bigSize);
+	closeFile(fd1);
+	ret += unmountFS();
+	ret += mountFS();
+	fd1 = openFile("/big.txt");
+	if (ret < 0 || fd1 < 0 || ret2 != bigSize || readFile(fd1, big2, bigSize) != bigSize || memcmp(big, big2, bigSize) != 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST multi-block file ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST multi-block file ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+	free(big);
+	free(big2);
+
+	fprintf(stdout, "%sTest 86: %sCheck that sequential writes keep files contiguous \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	ret = (fragmentationFS() == 1) ? 0 : -1; // The big file is a single extent
+	ret += createFile("/a.txt");
+	ret += createFile("/b.txt");
+	fd2 = openFile("/a.txt");
+	int fd3 = openFile("/b.txt");
+	char block[BLOCK_SIZE + 1];
+	memset(block, 'x', BLOCK_SIZE);
+	block[BLOCK_SIZE] = '\0';
+	for (int i = 0; i < 2; i++) { // Interleaved writes split the files in extents
+		writeFile(fd2, block, BLOCK_SIZE);
+		writeFile(fd3, block, BLOCK_SIZE);
+	}
+	closeFile(fd2);
+	closeFile(fd3);
+	if (ret < 0 || fragmentationFS() <= 1)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST fragmentationFS ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST fragmentationFS ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 87: %sCheck that new blocks are written without reading them first \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	bresetstats();
+	ret = createFile("/lazy.txt");
+	fd2 = openFile("/lazy.txt");
+	for (int i = 0; i < 3; i++) {
+		ret += writeFile(fd2, block, BLOCK_SIZE) - BLOCK_SIZE;
+	}
+	bstats(&stats);
+	ret2 = stats.reads == 0 ? 0 : -1;
+	char lazy[BLOCK_SIZE + 1] = {0};
+	ret2 += lseekFile(fd2, 0, FS_SEEK_END);
+	ret2 += lseekFile(fd2, -BLOCK_SIZE, FS_SEEK_CUR);
+	if (ret < 0 || ret2 < 0 || readFile(fd2, lazy, BLOCK_SIZE) != BLOCK_SIZE || strcmp(lazy, block) != 0 || closeFile(fd2) < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST lazy zeroing ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST lazy zeroing ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 88: %sMake a file system with more inodes and bigger directories \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	geometry_t geometry = {BIG_BLOCKS * BLOCK_SIZE, 0, 2048, 50}; // One inode per block
+	int manyInodes[50];
+	char manyNames[50][33];
+	char name[40];
+	closeFile(fd1);
+	ret = unmountFS();
+	ret += mkFSGeometry(&geometry);
+	ret += mountFS();
+	ret += mkDir("/many");
+	for (int i = 0; i < 50; i++) {
+		sprintf(name, "/many/f%d", i);
+		ret += createFile(name);
+	}
+	ret2 = createFile("/many/full"); // The directory is full
+	if (ret < 0 || ret2 >= 0 || lsDirEx("/many", manyInodes, manyNames, 50) != 50 || strcmp(manyNames[49], "f49") != 0
+		|| lsDir("/many", inodesDir, namesDir) != 10 || unmountFS() < 0 || mountFS() < 0 || (fd2 = openFile("/many/f49")) < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST mkFSGeometry ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST mkFSGeometry ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 89: %sCheck that mount reads the metadata with a few device requests \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	ret = closeFile(fd2);
+	ret += unmountFS();
+	bresetstats();
+	ret += mountFS();
+	bstats(&stats);
+	if (ret < 0 || stats.reads < 25 || stats.requests > 4) // Superblock, maps and inodes, journal head
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST vectored mount ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST vectored mount ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 90: %sWrite and read blocks with asynchronous requests, on both engines \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	int engines[2] = {BENGINE_THREADS, BENGINE_AUTO};
+	char *async = malloc(40 * BLOCK_SIZE);
+	char *async2 = malloc(40 * BLOCK_SIZE);
+	bvec_t asyncVec[40];
+	breq_t asyncReqs[5];
+	ret = 0;
+	for (int e = 0; e < 2; e++) {
+		ret += bsetqueue(4, engines[e]);
+		for (int i = 0; i < 40 * BLOCK_SIZE; i++) {
+			async[i] = 'a' + (i / BLOCK_SIZE + e) % 26;
+		}
+		memset(async2, 0, 40 * BLOCK_SIZE);
+		for (int w = 1; w >= 0; w--) { // Blocks past the end of the file system
+			for (int i = 0; i < 40; i++) {
+				asyncVec[i].blockNumber = BIG_BLOCKS + i;
+				asyncVec[i].buffer = (w ? async : async2) + i * BLOCK_SIZE;
+			}
+			for (int r = 0; r < 5; r++) {
+				asyncReqs[r].write = w;
+				asyncReqs[r].vec = asyncVec + 8 * r;
+				asyncReqs[r].count = 8;
+				ret += bsubmit(DEVICE_IMAGE, &asyncReqs[r]);
+			}
+			ret += bwaitall();
+		}
+		ret += memcmp(async, async2, 40 * BLOCK_SIZE) == 0 ? 0 : -1;
+	}
+	ret += bqueueengine() < 0 || bwait() != NULL ? -1 : 0;
+	ret += bsetqueue(BQUEUE_DEPTH, BENGINE_AUTO);
+	free(async);
+	free(async2);
+	if (ret < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST asynchronous requests ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST asynchronous requests ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 91: %sRead a multi-block file with a few device requests \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	int streamSize = 20 * BLOCK_SIZE - 100;
+	char *stream = malloc(streamSize + 1);
+	char *stream2 = calloc(streamSize + 1, 1);
+	for (int i = 0; i < streamSize; i++) {
+		stream[i] = 'a' + i % 26;
+	}
+	stream[streamSize] = '\0';
+	ret = createFile("/stream.txt");
+	fd1 = openFile("/stream.txt");
+	ret2 = writeFile(fd1, stream, streamSize);
+	ret += closeFile(fd1);
+	ret += unmountFS();
+	ret += mountFS();
+	fd1 = openFile("/stream.txt");
+	bresetstats();
+	ret += readFile(fd1, stream2, streamSize) == streamSize ? 0 : -1;
+	bstats(&stats);
+	if (ret < 0 || ret2 != streamSize || memcmp(stream, stream2, streamSize) != 0 || stats.reads < 20 || stats.requests > 2
+		|| closeFile(fd1) < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST prefetched read ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST prefetched read ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 92: %sRead ahead of sequential reads only \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	ret = unmountFS();
+	ret += mountFS();
+	fd1 = openFile("/stream.txt");
+	bresetstats();
+	ret += lseekFile(fd1, 0, FS_SEEK_END);
+	ret += lseekFile(fd1, -3 * BLOCK_SIZE, FS_SEEK_CUR);
+	memset(stream2, 0, streamSize + 1);
+	ret += readFile(fd1, stream2, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1; // Random: nothing read ahead
+	bstats(&stats);
+	ret2 = stats.prefetches == 0 ? 0 : -1;
+	memset(stream2, 0, streamSize + 1);
+	ret += lseekFile(fd1, 0, FS_SEEK_BEGIN);
+	for (int i = 0; i < 12; i++) { // Sequential: the window grows with every block
+		ret += readFile(fd1, stream2 + i * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+	}
+	bstats(&stats);
+	if (ret < 0 || ret2 < 0 || memcmp(stream, stream2, 12 * BLOCK_SIZE) != 0 || stats.prefetches < 12 || stats.requests > 8
+		|| closeFile(fd1) < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST read ahead ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST read ahead ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+	free(stream);
+	free(stream2);
+
+	fprintf(stdout, "%sTest 93: %sWrite and read whole blocks of binary data without the cache \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	unsigned char binary[3 * BLOCK_SIZE], binary2[3 * BLOCK_SIZE];
+	for (int i = 0; i < 3 * BLOCK_SIZE; i++) {
+		binary[i] = i % 256; // Zero bytes included
+	}
+	ret = createFile("/binary.bin");
+	fd1 = openFile("/binary.bin");
+	ret += writeFile(fd1, binary, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE ? 0 : -1;
+	ret += closeFile(fd1);
+	ret += unmountFS();
+	ret += mountFS();
+	fd1 = openFile("/binary.bin");
+	bresetstats();
+	ret += readFile(fd1, binary2, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE ? 0 : -1;
+	bstats(&stats);
+	if (ret < 0 || fd1 < 0 || memcmp(binary, binary2, 3 * BLOCK_SIZE) != 0 || stats.hits != 0 || stats.misses != 0
+		|| stats.reads != 3 || closeFile(fd1) < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST binary blocks ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST binary blocks ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 94: %sOverwrite parts of blocks without reading them \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	ret = unmountFS();
+	ret += mountFS();
+	fd1 = openFile("/binary.bin");
+	bresetstats();
+	ret += lseekFile(fd1, 100, FS_SEEK_CUR);
+	ret += writeFile(fd1, "0123456789", 10) == 10 ? 0 : -1; // Bytes 100 to 109 of block 0
+	ret += lseekFile(fd1, BLOCK_SIZE, FS_SEEK_CUR);
+	ret += writeFile(fd1, "abcdefghij", 10) == 10 ? 0 : -1; // Bytes 110 to 119 of block 1
+	ret += lseekFile(fd1, 0, FS_SEEK_BEGIN);
+	ret += writeFile(fd1, binary2, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1; // Block 0 again, as a whole
+	bstats(&stats);
+	ret2 = stats.reads == 0 ? 0 : -1;
+	memcpy(binary + BLOCK_SIZE + 110, "abcdefghij", 10);
+	ret += closeFile(fd1);
+	ret += unmountFS(); // Block 1 is written back in part
+	ret += mountFS();
+	fd1 = openFile("/binary.bin");
+	ret += readFile(fd1, binary2, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE ? 0 : -1;
+	if (ret < 0 || ret2 < 0 || fd1 < 0 || memcmp(binary, binary2, 3 * BLOCK_SIZE) != 0 || closeFile(fd1) < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST partial writes ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST partial writes ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 95: %sGather small writes in whole blocks \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	char small[3 * BLOCK_SIZE + 16];
+	memcpy(small, binary, 3 * BLOCK_SIZE);
+	memcpy(small + 3 * BLOCK_SIZE, "0123456789abcdef", 16);
+	ret = createFile("/small.txt");
+	fd1 = openFile("/small.txt");
+	bresetstats();
+	for (int i = 0; i < sizeof(small); i += 16) {
+		ret += writeFile(fd1, small + i, 16) == 16 ? 0 : -1;
+	}
+	ret += flushFile(fd1);
+	bstats(&stats);
+	ret2 = (stats.reads == 0 && stats.requests <= 8) ? 0 : -1; // 3 blocks and the journal
+	ret += lseekFile(fd1, 0, FS_SEEK_BEGIN);
+	memset(binary2, 0, 3 * BLOCK_SIZE);
+	ret += readFile(fd1, binary2, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE ? 0 : -1;
+	ret += writeFile(fd1, "tail", 4) == 4 ? 0 : -1; // Over bytes 0 to 3 of block 3, kept in memory until closeFile
+	memcpy(small + 3 * BLOCK_SIZE, "tail", 4);
+	ret += closeFile(fd1);
+	ret += unmountFS();
+	ret += mountFS();
+	fd1 = openFile("/small.txt");
+	ret += memcmp(small, binary2, 3 * BLOCK_SIZE) == 0 ? 0 : -1;
+	ret += readFile(fd1, binary2, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE ? 0 : -1;
+	ret += memcmp(small, binary2, 3 * BLOCK_SIZE) == 0 ? 0 : -1;
+	ret += readFile(fd1, binary2, 20) == 16 ? 0 : -1;
+	ret += memcmp(small + 3 * BLOCK_SIZE, binary2, 16) == 0 ? 0 : -1;
+	if (ret < 0 || ret2 < 0 || fd1 < 0 || closeFile(fd1) < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST write buffer ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST write buffer ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 96: %sOpen a file many times and access it at offsets \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	char at[16];
+	fd1 = openFile("/small.txt");
+	fd2 = openFileMode("/small.txt", FS_OPEN_READ);
+	int fd4 = openFile("/small.txt");
+	ret = (fd1 >= 0 && fd2 >= 0 && fd4 >= 0 && fd1 != fd2 && fd2 != fd4) ? 0 : -1;
+	ret += writeFile(fd2, "x", 1) < 0 ? 0 : -1; // Read only
+	ret += removeFile("/small.txt") < 0 ? 0 : -1; // Still opened
+	ret += lseekFile(fd1, 3 * BLOCK_SIZE, FS_SEEK_CUR);
+	ret += writeFile(fd1, "ABCD", 4) == 4 ? 0 : -1; // Kept in the buffer of fd1, read through fd2
+	ret += readFile(fd2, at, 4) == 4 && memcmp(at, small, 4) == 0 ? 0 : -1;
+	ret += readAt(fd2, at, 16, 3 * BLOCK_SIZE) == 16 && memcmp(at, "ABCD", 4) == 0 && memcmp(at + 4, small + 3 * BLOCK_SIZE + 4, 12) == 0 ? 0 : -1;
+	ret += writeAt(fd4, "wxyz", 4, 2) == 4 ? 0 : -1;
+	ret += writeAt(fd4, "end!", 4, 3 * BLOCK_SIZE + 16) == 4 ? 0 : -1; // Appends
+	ret += writeAt(fd4, "hole", 4, 3 * BLOCK_SIZE + 100) < 0 ? 0 : -1; // Past the end
+	ret += readAt(fd2, at, 16, 0) == 16 && memcmp(at, small, 2) == 0 && memcmp(at + 2, "wxyz", 4) == 0 ? 0 : -1;
+	ret += readFile(fd2, at, 2) == 2 && memcmp(at, "yz", 2) == 0 ? 0 : -1; // Seek pointer of fd2 left at 4
+	ret += readFile(fd4, at, 4) == 4 && memcmp(at, small, 2) == 0 ? 0 : -1; // Seek pointer of fd4 still at 0
+	ret += lseekFile(fd4, 0, FS_SEEK_END);
+	ret += readAt(fd4, at, 16, 3 * BLOCK_SIZE + 16) == 4 && memcmp(at, "end!", 4) == 0 ? 0 : -1;
+	ret += closeFile(fd1);
+	ret += closeFile(fd2);
+	ret += closeFile(fd4);
+	ret += closeFile(fd4) < 0 ? 0 : -1;
+	if (ret < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST open-file table ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST open-file table ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 97: %sRead and write files from several threads at the same time \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	pthread_t threads[N_THREADS];
+	int ids[N_THREADS];
+	void *result;
+	fd1 = openFile("/small.txt");
+	ret = readFile(fd1, shared, sizeof(shared)) == sizeof(shared) ? 0 : -1;
+	ret += closeFile(fd1);
+	for (int i = 0; i < N_THREADS; i++) {
+		ids[i] = i;
+		ret += pthread_create(&threads[i], NULL, worker, &ids[i]) == 0 ? 0 : -1;
+	}
+	for (int i = 0; i < N_THREADS; i++) {
+		ret += pthread_join(threads[i], &result) == 0 && result == NULL ? 0 : -1;
+	}
+	ret += unmountFS();
+	ret += mountFS();
+	ret += openFile("/thread0") < 0 ? 0 : -1; // Every file was removed
+	fd1 = openFileMode("/small.txt", FS_OPEN_READ);
+	ret += readFile(fd1, binary2, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE && memcmp(binary2, shared, 3 * BLOCK_SIZE) == 0 ? 0 : -1;
+	ret += closeFile(fd1);
+	if (ret < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST threads ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST threads ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 98: %sCrash after the journal went round several times, then replay it \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	char *crash = malloc(4 * BLOCK_SIZE);
+	char *crash2 = malloc(4 * BLOCK_SIZE);
+	int status;
+	ret = unmountFS();
+	ret += mkFS(BIG_BLOCKS * BLOCK_SIZE);
+	ret += mountFS();
+	ret += bsetqueue(0, BENGINE_AUTO); // The child process has no worker threads
+	ret += bsync(DEVICE_IMAGE);
+	pid_t pid = fork();
+	if (pid == 0) {
+		/* Each round commits the previous one, some of them with bursts of
+		 * changes taking several journal blocks. The process dies without
+		 * writing its cache or its last changes, as in a crash */
+		for (int r = 0; r < CRASH_ROUNDS; r++) {
+			memset(crash, 'A' + r, 4 * BLOCK_SIZE);
+			sprintf(name, "/crash%d", r);
+			createFile(name);
+			fd1 = openFile(name);
+			writeFile(fd1, crash, (r % 4 + 1) * BLOCK_SIZE - r);
+			closeFile(fd1);
+			for (int k = 0; r % 4 == 3 && k < 8; k++) {
+				sprintf(name, "/burst%d", k);
+				createFile(name);
+			}
+			for (int k = 0; r % 4 == 3 && k < 8; k++) {
+				sprintf(name, "/burst%d", k);
+				removeFile(name);
+			}
+			usleep(60000); // Longer than the group commit interval
+		}
+		_exit(0);
+	}
+	ret += pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) ? 0 : -1;
+	ret += bsetcache(0) + bsetcache(BCACHE_BLOCKS); // Forget the blocks read before the crash
+	ret += mountFS();
+	for (int r = 0; r < CRASH_ROUNDS - 1 && ret == 0; r++) { // The last round may be lost
+		int length = (r % 4 + 1) * BLOCK_SIZE - r;
+		memset(crash, 'A' + r, length);
+		sprintf(name, "/crash%d", r);
+		fd1 = openFile(name);
+		ret += readAt(fd1, crash2, 4 * BLOCK_SIZE, 0) == length && memcmp(crash, crash2, length) == 0 ? 0 : -1;
+		ret += closeFile(fd1);
+	}
+	ret += openFile("/burst0") < 0 ? 0 : -1;
+	ret += createFile("/after.txt"); // The journal goes on where the replay left it
+	ret += unmountFS();
+	ret += mountFS();
+	fd1 = openFile("/after.txt");
+	ret += fd1 < 0 ? -1 : closeFile(fd1);
+	ret += bsetqueue(BQUEUE_DEPTH, BENGINE_AUTO);
+	free(crash);
+	free(crash2);
+	if (ret < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST crash and replay ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST crash and replay ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 99: %sCrash while several threads create and remove files, then replay \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	geometry_t burst = {BIG_BLOCKS * BLOCK_SIZE, 4 * N_THREADS * BURST_FILES, 0, BURST_FILES};
+	ret = unmountFS();
+	ret += mkFSGeometry(&burst);
+	ret += mountFS();
+	for (int i = 0; i < N_THREADS; i++) {
+		sprintf(name, "/b%d", i);
+		ret += mkDir(name);
+	}
+	ret += unmountFS(); // The directories are checkpointed
+	ret += mountFS();
+	ret += bsetqueue(0, BENGINE_AUTO);
+	ret += bsync(DEVICE_IMAGE);
+	pid = fork();
+	if (pid == 0) {
+		/* The operations of the threads are committed in groups; the process
+		 * dies without writing its cache or its last changes */
+		for (int i = 0; i < N_THREADS; i++) {
+			pthread_create(&threads[i], NULL, burstWorker, &ids[i]);
+		}
+		for (int i = 0; i < N_THREADS; i++) {
+			pthread_join(threads[i], &result);
+		}
+		_exit(0);
+	}
+	ret += pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) ? 0 : -1;
+	ret += bsetcache(0) + bsetcache(BCACHE_BLOCKS); // Forget the blocks read before the crash
+	ret += mountFS();
+	for (int i = 0; i < N_THREADS && ret == 0; i++) {
+		ret += burstCheck(i);
+	}
+	ret += bsetqueue(BQUEUE_DEPTH, BENGINE_AUTO);
+	if (ret < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST crash during a burst ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST crash during a burst ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 100: %sRead uncached blocks from threads while others write them and close the device \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	ret = unmountFS();
+	ret += bsetcache(0); // Every read goes to the device
+	for (int i = 0; i < N_THREADS; i++) {
+		ret += pthread_create(&threads[i], NULL, i % 2 == 0 ? raceReader : raceWriter, &ids[i]) == 0 ? 0 : -1;
+	}
+	for (int i = 0; i < N_THREADS; i++) {
+		ret += pthread_join(threads[i], &result) == 0 && result == NULL ? 0 : -1;
+	}
+	ret += bsetcache(BCACHE_BLOCKS);
+	if (ret < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST reads racing writes ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST reads racing writes ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
+	fprintf(stdout, "%sTest 101: %sCrash while a file with a block of extents grows, then replay \n", ANSI_COLOR_BLUE, ANSI_COLOR_RESET);
+	char *frag = malloc((FRAG_EXTENTS + 2) * BLOCK_SIZE);
+	char *frag2 = malloc((FRAG_EXTENTS + 2) * BLOCK_SIZE);
+	char *fill = malloc(BIG_BLOCKS * BLOCK_SIZE);
+	for (int k = 0; k < FRAG_EXTENTS + 2; k++) {
+		memset(frag + k * BLOCK_SIZE, 'a' + k, BLOCK_SIZE);
+	}
+	memset(fill, 'F', BIG_BLOCKS * BLOCK_SIZE);
+	ret = mkFS(BIG_BLOCKS * BLOCK_SIZE);
+	ret += mountFS();
+	ret += createFile("/frag") + createFile("/gap");
+	fd1 = openFile("/frag");
+	fd2 = openFile("/gap");
+	for (int k = 0; k < FRAG_EXTENTS; k++) { // The blocks of both files alternate, one extent each
+		ret += writeFile(fd1, frag + k * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+		ret += k == FRAG_EXTENTS - 1 || writeFile(fd2, fill, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+	}
+	ret += closeFile(fd1) + closeFile(fd2);
+	ret += fragmentationFS() == (2 * FRAG_EXTENTS - 1) / 2.0 ? 0 : -1;
+	ret += unmountFS(); // The extents are checkpointed
+	ret += mountFS();
+	ret += bsetqueue(0, BENGINE_AUTO);
+	ret += bsync(DEVICE_IMAGE);
+	pid = fork();
+	if (pid == 0) {
+		/* The last extent grows; the cache is written back before the change
+		 * is committed, and the process dies */
+		fd1 = openFile("/frag");
+		writeAt(fd1, frag + FRAG_EXTENTS * BLOCK_SIZE, 2 * BLOCK_SIZE, FRAG_EXTENTS * BLOCK_SIZE);
+		bsync(DEVICE_IMAGE);
+		_exit(0);
+	}
+	ret += pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) ? 0 : -1;
+	ret += bsetcache(0) + bsetcache(BCACHE_BLOCKS); // Forget the blocks read before the crash
+	ret += mountFS();
+	/* The growth is lost, the file grows again and then another one takes every free block */
+	fd1 = openFile("/frag");
+	ret += writeAt(fd1, frag + FRAG_EXTENTS * BLOCK_SIZE, 2 * BLOCK_SIZE, FRAG_EXTENTS * BLOCK_SIZE) == 2 * BLOCK_SIZE ? 0 : -1;
+	ret += createFile("/fill");
+	fd2 = openFile("/fill");
+	ret += writeFile(fd2, fill, BIG_BLOCKS * BLOCK_SIZE) > 0 ? 0 : -1;
+	ret += readAt(fd1, frag2, (FRAG_EXTENTS + 2) * BLOCK_SIZE, 0) == (FRAG_EXTENTS + 2) * BLOCK_SIZE
+		&& memcmp(frag, frag2, (FRAG_EXTENTS + 2) * BLOCK_SIZE) == 0 ? 0 : -1;
+	ret += closeFile(fd1) + closeFile(fd2);
+	ret += unmountFS();
+	ret += bsetqueue(BQUEUE_DEPTH, BENGINE_AUTO);
+	free(frag);
+	free(frag2);
+	free(fill);
+	if (ret < 0)
+	{
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST crash while extents grow ", ANSI_COLOR_RED, "FAILED\n\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST crash while extents grow ", ANSI_COLOR_GREEN, "SUCCESS\n\n", ANSI_COLOR_RESET);
+
 
 	free (buffer);
 	free (buffer2);